@@ -0,0 +1,328 @@
+// childenv-elf: wrapper-free allocator injection. Writes a copy of a
+// dynamically linked ELF64 executable whose dynamic section lists the
+// profile's LD_PRELOAD libraries as DT_NEEDED entries, with the rest of the
+// profile (allocator knobs, CHILD_ENV_RULES) embedded for libchildenv to pick
+// up in its constructor. Nothing is exec'd at launch and nothing is set in
+// LD_PRELOAD, so there is nothing to strip for children.
+//
+//   childenv-elf add-needed <input> <output> <profile-file>
+//
+// The original dynamic section has no spare slots, so, like patchelf, we
+// append a segment holding a new .dynstr (old table + new names) and a new
+// .dynamic, and point PT_DYNAMIC at it. The program header table cannot grow
+// in place either, so a copy with one more entry (the new PT_LOAD) goes at
+// the end of the segment and e_phoff and PT_PHDR move to it; every original
+// header, notes included, is kept. The segment keeps the first PT_LOAD's
+// vaddr - offset, so kernels that derive AT_PHDR from that agree with those
+// that read PT_PHDR.
+//
+// An allocator profile (libchildenv plus one library) is linked through the
+// multiplexer instead: libchildenv-malloc.so becomes the DT_NEEDED entry and
+// the allocator is recorded as CHILD_ENV_MALLOC, so the mux dlopens it only
+// after the embedded knobs are in the environ; a directly linked allocator
+// could have initialized from libc's first malloc long before. Otherwise the
+// new DT_NEEDED entries go first and libchildenv is moved behind the other
+// profile libraries, whose constructors then run before its own.
+
+#define _GNU_SOURCE
+#include "childenv-format.h"
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Covers 4K and 64K page kernels (aarch64).
+#define SEG_ALIGN 0x10000
+#define MAX_LIBS  16
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+
+static int die(const char *msg, const char *arg) {
+    fprintf(stderr, "childenv-elf: %s%s%s\n", msg, arg ? ": " : "", arg ? arg : "");
+    return 1;
+}
+
+static char *read_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    char *buf = NULL;
+    if (fstat(fd, &st) == 0 && (buf = malloc((size_t)st.st_size + 1))) {
+        size_t got = 0;
+        while (got < (size_t)st.st_size) {
+            ssize_t r = read(fd, buf + got, (size_t)st.st_size - got);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            got += (size_t)r;
+        }
+        if (got != (size_t)st.st_size) { free(buf); buf = NULL; }
+        else { buf[got] = '\0'; *size = got; }
+    }
+    close(fd);
+    return buf;
+}
+
+// Split the profile into LD_PRELOAD libraries and the remaining text.
+static int split_profile(char *text, const char **libs, int *nlibs,
+                         char *rest, size_t *rest_len) {
+    *nlibs = 0;
+    *rest_len = 0;
+    for (char *line = text, *next; line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        line += strspn(line, " \t");
+        if (*line == '#' || !strchr(line, '=') || *line == '=') continue;
+        if (!strncmp(line, "LD_PRELOAD=", 11)) {
+            for (char *tok, *p = line + 11; (tok = strsep(&p, ": ")); ) {
+                if (!*tok) continue;
+                if (*nlibs == MAX_LIBS) return -1;
+                libs[(*nlibs)++] = tok;
+            }
+            continue;
+        }
+        size_t len = strlen(line);
+        memcpy(rest + *rest_len, line, len);
+        rest[*rest_len + len] = '\n';
+        *rest_len += len + 1;
+    }
+    rest[*rest_len] = '\0';
+    return 0;
+}
+
+static bool is_childenv(const char *lib) {
+    const char *base = strrchr(lib, '/');
+    return !strncmp(base ? base + 1 : lib, "libchildenv.", 12);
+}
+
+// Room for the lines mux_profile() adds to the profile text.
+#define PROFILE_SLACK (4096 + 64)
+
+// Record `alloc` as CHILD_ENV_MALLOC and keep it out of children: the name is
+// appended to an existing CHILD_ENV_RULES line.
+static int mux_profile(char *rest, size_t *rest_len, const char *alloc) {
+    size_t len = strlen(alloc);
+    if (len > 4096 - 32) return -1;
+    char *rules = strstr(rest, "CHILD_ENV_RULES=");
+    if (rules && (rules == rest || rules[-1] == '\n')) {
+        char *eol = strchr(rules, '\n');
+        static const char add[] = ",CHILD_ENV_MALLOC";
+        memmove(eol + sizeof(add) - 1, eol, (size_t)(rest + *rest_len - eol) + 1);
+        memcpy(eol, add, sizeof(add) - 1);
+        *rest_len += sizeof(add) - 1;
+    }
+    *rest_len += (size_t)sprintf(rest + *rest_len, "CHILD_ENV_MALLOC=%s\n", alloc);
+    return 0;
+}
+
+static int64_t vaddr_to_off(const Elf64_Phdr *ph, int phnum, uint64_t vaddr) {
+    for (int i = 0; i < phnum; i++)
+        if (ph[i].p_type == PT_LOAD && vaddr >= ph[i].p_vaddr
+            && vaddr < ph[i].p_vaddr + ph[i].p_filesz)
+            return (int64_t)(ph[i].p_offset + (vaddr - ph[i].p_vaddr));
+    return -1;
+}
+
+static int add_needed(const char *in, const char *out_path, const char *profile) {
+    size_t size, prof_size;
+    char *buf = read_file(in, &size);
+    if (!buf) return die(strerror(errno), in);
+    char *prof = read_file(profile, &prof_size);
+    if (!prof) return die(strerror(errno), profile);
+
+    const char *libs[MAX_LIBS];
+    int nlibs;
+    char *rest = malloc(prof_size + PROFILE_SLACK);
+    size_t rest_len;
+    if (!rest || split_profile(prof, libs, &nlibs, rest, &rest_len) < 0)
+        return die("bad profile", profile);
+    if (!nlibs) return die("profile has no LD_PRELOAD libraries", profile);
+    for (int l = 0; l < nlibs - 1; l++) {
+        if (!is_childenv(libs[l])) continue;
+        const char *self = libs[l];
+        memmove(&libs[l], &libs[l + 1], sizeof(*libs) * (size_t)(nlibs - l - 1));
+        libs[nlibs - 1] = self;
+        break;
+    }
+    char mux_lib[4096];
+    if (nlibs == 2 && is_childenv(libs[1]) && !is_childenv(libs[0])) {
+        const char *base = strrchr(libs[1], '/');
+        int dir = base ? (int)(base + 1 - libs[1]) : 0;
+        if (snprintf(mux_lib, sizeof(mux_lib), "%.*slibchildenv-malloc.%s", dir,
+                     libs[1], libs[1] + dir + 12) >= (int)sizeof(mux_lib)
+            || mux_profile(rest, &rest_len, libs[0]) < 0)
+            return die("bad profile", profile);
+        libs[0] = mux_lib;
+        nlibs = 1;
+    }
+
+    Elf64_Ehdr *eh = (Elf64_Ehdr *)buf;
+    if (size < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG)
+        || eh->e_ident[EI_CLASS] != ELFCLASS64
+        || eh->e_ident[EI_DATA] != ELFDATA2LSB
+        || (eh->e_type != ET_EXEC && eh->e_type != ET_DYN)
+        || eh->e_phentsize != sizeof(Elf64_Phdr)
+        || eh->e_phoff > size
+        || (size - eh->e_phoff) / sizeof(Elf64_Phdr) < eh->e_phnum)
+        return die("not a little-endian ELF64 executable", in);
+
+    Elf64_Phdr *ph = (Elf64_Phdr *)(buf + eh->e_phoff);
+    int phnum = eh->e_phnum;
+    int dyn_i = -1, phdr_i = -1, first_load = -1, last_load = -1;
+    bool interp = false;
+    uint64_t max_end = 0;
+    for (int i = 0; i < phnum; i++) {
+        switch (ph[i].p_type) {
+        case PT_DYNAMIC: dyn_i = i; break;
+        case PT_PHDR: phdr_i = i; break;
+        case PT_INTERP: interp = true; break;
+        case PT_LOAD:
+            if (first_load < 0) first_load = i;
+            last_load = i;
+            if (ph[i].p_vaddr + ph[i].p_memsz > max_end)
+                max_end = ph[i].p_vaddr + ph[i].p_memsz;
+            break;
+        }
+    }
+    if (!interp || dyn_i < 0 || last_load < 0)
+        return die("not a dynamically linked executable", in);
+    uint64_t delta = ph[first_load].p_vaddr - ph[first_load].p_offset;
+    if (delta % SEG_ALIGN || phnum + 1 >= PN_XNUM)
+        return die("unsupported program header layout", in);
+    if (ph[dyn_i].p_offset > size || ph[dyn_i].p_filesz > size - ph[dyn_i].p_offset)
+        return die("truncated dynamic segment", in);
+
+    Elf64_Dyn *dyn = (Elf64_Dyn *)(buf + ph[dyn_i].p_offset);
+    size_t dyn_max = ph[dyn_i].p_filesz / sizeof(Elf64_Dyn), ndyn = 0;
+    uint64_t strtab = 0, strsz = 0;
+    while (ndyn < dyn_max && dyn[ndyn].d_tag != DT_NULL) {
+        if (dyn[ndyn].d_tag == DT_STRTAB) strtab = dyn[ndyn].d_un.d_ptr;
+        if (dyn[ndyn].d_tag == DT_STRSZ) strsz = dyn[ndyn].d_un.d_val;
+        ndyn++;
+    }
+    int64_t str_off = vaddr_to_off(ph, phnum, strtab);
+    if (!strtab || str_off < 0 || (uint64_t)str_off > size
+        || strsz > size - (uint64_t)str_off)
+        return die("no usable DT_STRTAB", in);
+    for (size_t i = 0; i < ndyn; i++) {
+        if (dyn[i].d_tag != DT_NEEDED || dyn[i].d_un.d_val >= strsz) continue;
+        const char *name = buf + str_off + dyn[i].d_un.d_val;
+        for (int l = 0; l < nlibs; l++)
+            if (!strcmp(name, libs[l])) return die("already patched", in);
+    }
+
+    // New segment: policy payload, new .dynstr, new .dynamic, new program
+    // header table. It may start past the end of the file when the last
+    // PT_LOAD has a large .bss; the gap is written as zeros.
+    size_t pol_size = sizeof(struct childenv_elf_policy) + rest_len + 1;
+    size_t names = 0;
+    for (int l = 0; l < nlibs; l++) names += strlen(libs[l]) + 1;
+    uint64_t dynstr_rel = ALIGN_UP(pol_size, 8);
+    uint64_t dynstr_size = strsz + names;
+    uint64_t dyn_rel = ALIGN_UP(dynstr_rel + dynstr_size, 8);
+    size_t new_ndyn = (size_t)nlibs + ndyn + 1;
+    uint64_t phdr_rel = dyn_rel + new_ndyn * sizeof(Elf64_Dyn);
+    int new_phnum = phnum + 1;
+    uint64_t seg_size = phdr_rel + (uint64_t)new_phnum * sizeof(Elf64_Phdr);
+    uint64_t seg_vaddr = ALIGN_UP(size, SEG_ALIGN) + delta;
+    if (seg_vaddr < ALIGN_UP(max_end, SEG_ALIGN)) seg_vaddr = ALIGN_UP(max_end, SEG_ALIGN);
+    uint64_t seg_off = seg_vaddr - delta;
+
+    char *out = calloc(1, seg_off + seg_size);
+    if (!out) return die("out of memory", NULL);
+    memcpy(out, buf, size);
+    char *seg = out + seg_off;
+
+    struct childenv_elf_policy *pol = (struct childenv_elf_policy *)seg;
+    memcpy(pol->magic, CHILDENV_ELF_MAGIC, sizeof(pol->magic));
+    pol->version = CHILDENV_ELF_VERSION;
+    pol->size = (uint32_t)pol_size;
+    memcpy(pol->text, rest, rest_len + 1);
+
+    char *dynstr = seg + dynstr_rel;
+    memcpy(dynstr, buf + str_off, strsz);
+    Elf64_Dyn *nd = (Elf64_Dyn *)(seg + dyn_rel);
+    uint64_t name_off = strsz;
+    for (int l = 0; l < nlibs; l++) {
+        size_t len = strlen(libs[l]) + 1;
+        memcpy(dynstr + name_off, libs[l], len);
+        nd[l].d_tag = DT_NEEDED;
+        nd[l].d_un.d_val = name_off;
+        name_off += len;
+    }
+    for (size_t i = 0; i < ndyn; i++) {
+        nd[nlibs + i] = dyn[i];
+        if (dyn[i].d_tag == DT_STRTAB) nd[nlibs + i].d_un.d_ptr = seg_vaddr + dynstr_rel;
+        if (dyn[i].d_tag == DT_STRSZ) nd[nlibs + i].d_un.d_val = dynstr_size;
+    }
+    nd[new_ndyn - 1].d_tag = DT_NULL;
+
+    // Program headers: the copy gains the new PT_LOAD right after the last
+    // PT_LOAD, so the table stays sorted by p_vaddr (the kernel sizes the
+    // mapping from first and last); PT_DYNAMIC and PT_PHDR move.
+    Elf64_Phdr *oph = (Elf64_Phdr *)(seg + phdr_rel);
+    memcpy(oph, ph, sizeof(*oph) * (size_t)(last_load + 1));
+    memcpy(&oph[last_load + 2], &ph[last_load + 1],
+           sizeof(*oph) * (size_t)(phnum - last_load - 1));
+    oph[last_load + 1] = (Elf64_Phdr){
+        .p_type = PT_LOAD, .p_flags = PF_R | PF_W,
+        .p_offset = seg_off, .p_vaddr = seg_vaddr, .p_paddr = seg_vaddr,
+        .p_filesz = seg_size, .p_memsz = seg_size, .p_align = SEG_ALIGN,
+    };
+    int odyn = dyn_i > last_load ? dyn_i + 1 : dyn_i;
+    oph[odyn].p_offset = seg_off + dyn_rel;
+    oph[odyn].p_vaddr = oph[odyn].p_paddr = seg_vaddr + dyn_rel;
+    oph[odyn].p_filesz = oph[odyn].p_memsz = new_ndyn * sizeof(Elf64_Dyn);
+    if (phdr_i >= 0) {
+        int ophdr = phdr_i > last_load ? phdr_i + 1 : phdr_i;
+        oph[ophdr].p_offset = seg_off + phdr_rel;
+        oph[ophdr].p_vaddr = oph[ophdr].p_paddr = seg_vaddr + phdr_rel;
+        oph[ophdr].p_filesz = oph[ophdr].p_memsz = (uint64_t)new_phnum * sizeof(Elf64_Phdr);
+    }
+    Elf64_Ehdr *oeh = (Elf64_Ehdr *)out;
+    oeh->e_phoff = seg_off + phdr_rel;
+    oeh->e_phnum = (Elf64_Half)new_phnum;
+
+    // Keep the section view consistent for readelf/gdb/strip.
+    if (oeh->e_shoff && oeh->e_shentsize == sizeof(Elf64_Shdr) && oeh->e_shoff <= size
+        && (size - oeh->e_shoff) / sizeof(Elf64_Shdr) >= oeh->e_shnum) {
+        Elf64_Shdr *sh = (Elf64_Shdr *)(out + oeh->e_shoff);
+        for (int i = 0; i < oeh->e_shnum; i++) {
+            if (sh[i].sh_type == SHT_DYNAMIC) {
+                sh[i].sh_offset = seg_off + dyn_rel;
+                sh[i].sh_addr = seg_vaddr + dyn_rel;
+                sh[i].sh_size = new_ndyn * sizeof(Elf64_Dyn);
+            } else if (sh[i].sh_type == SHT_STRTAB && sh[i].sh_addr == strtab) {
+                sh[i].sh_offset = seg_off + dynstr_rel;
+                sh[i].sh_addr = seg_vaddr + dynstr_rel;
+                sh[i].sh_size = dynstr_size;
+            }
+        }
+    }
+
+    struct stat st;
+    mode_t mode = stat(in, &st) == 0 ? st.st_mode & 07777 : 0755;
+    int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if (fd < 0) return die(strerror(errno), out_path);
+    size_t total = seg_off + seg_size, done = 0;
+    while (done < total) {
+        ssize_t w = write(fd, out + done, total - done);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) { close(fd); unlink(out_path); return die(strerror(errno), out_path); }
+        done += (size_t)w;
+    }
+    if (close(fd) < 0) { unlink(out_path); return die(strerror(errno), out_path); }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc == 5 && !strcmp(argv[1], "add-needed"))
+        return add_needed(argv[2], argv[3], argv[4]);
+    fprintf(stderr, "Usage: childenv-elf add-needed <input> <output> <profile-file>\n");
+    return 2;
+}
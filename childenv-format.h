@@ -0,0 +1,59 @@
+// On-disk formats shared by libchildenv.so and its command-line tools.
+// Private to this source tree: not installed, no compatibility promise beyond
+// the version fields checked by the reader.
+
+#ifndef CHILDENV_FORMAT_H
+#define CHILDENV_FORMAT_H
+
+#include <stdint.h>
+
+// Embedded policy written by `childenv-elf add-needed` at the start of the
+// PT_LOAD segment it appends to an executable. The payload is profile text
+// (NAME=value per line, as read by childenv-launch) minus LD_PRELOAD, which
+// became DT_NEEDED entries instead. libchildenv's constructor finds it by
+// checking the start of the main program's last PT_LOAD for the magic.
+#define CHILDENV_ELF_MAGIC   "CENVELF"          // 8 bytes with the NUL
+#define CHILDENV_ELF_VERSION 1
+
+struct childenv_elf_policy {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;          // header + NUL-terminated text
+    char text[];
+};
+
+// System-wide policy index written by childenv-index and mapped by every
+// process when libchildenv is listed in /etc/ld.so.preload. Entries are
+// sorted by the hash of the executable path (as the kernel reports it in
+// AT_EXECFN); each names a NUL-terminated path and a NUL-terminated profile
+// text in the same format as the embedded policy above. Offsets are from the
+// start of the file.
+#define CHILDENV_INDEX_MAGIC   "CENVIDX"          // 8 bytes with the NUL
+#define CHILDENV_INDEX_VERSION 1
+#ifndef CHILDENV_INDEX_PATH                       // tests build with their own
+#define CHILDENV_INDEX_PATH    "/etc/libchildenv/system.idx"
+#endif
+
+struct childenv_index_entry {
+    uint32_t hash;
+    uint32_t path;
+    uint32_t profile;
+};
+
+struct childenv_index {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;          // whole file
+    uint32_t nentries;
+    uint32_t reserved;
+    struct childenv_index_entry entries[];
+};
+
+// FNV-1a; cheap enough to run on every process start.
+static inline uint32_t childenv_index_hash(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+#endif // CHILDENV_FORMAT_H
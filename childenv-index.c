@@ -0,0 +1,185 @@
+// childenv-index: compile the system-wide program list into the index that
+// libchildenv maps in every process when it is listed in /etc/ld.so.preload.
+//
+//   childenv-index <system.conf> <system.idx>
+//
+// system.conf is a list of profiles, one section per executable:
+//
+//   # comment
+//   [/usr/bin/nemo]
+//   LD_PRELOAD=libtcmalloc.so
+//   CHILD_ENV_RULES=LD_PRELOAD,TCMALLOC_AGGRESSIVE_DECOMMIT,CHILD_ENV_RULES
+//   TCMALLOC_AGGRESSIVE_DECOMMIT=1
+//
+// Programs are matched on the path they were exec'd by (AT_EXECFN), so a
+// section also indexes the path with symlinks resolved when it differs. The
+// output is written to a temporary file and renamed into place: processes
+// starting concurrently see either the old index or the new one.
+
+#define _GNU_SOURCE
+#include "childenv-format.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct entry {
+    uint32_t hash;
+    char *path;
+    char *profile;
+};
+
+static int die(const char *msg, const char *arg) {
+    fprintf(stderr, "childenv-index: %s%s%s\n", msg, arg ? ": " : "", arg ? arg : "");
+    return 1;
+}
+
+static int cmp_entry(const void *a, const void *b) {
+    const struct entry *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+static struct entry *entries;
+static size_t nentries, cap;
+
+static int add_entry(char *path, char *profile) {
+    if (nentries == cap) {
+        cap = cap ? cap * 2 : 16;
+        struct entry *n = realloc(entries, cap * sizeof(*entries));
+        if (!n) return -1;
+        entries = n;
+    }
+    entries[nentries++] = (struct entry){childenv_index_hash(path), path, profile};
+    return 0;
+}
+
+// Append `line` plus a newline to the profile being collected.
+static char *profile_append(char *profile, const char *line) {
+    size_t old = profile ? strlen(profile) : 0, len = strlen(line);
+    char *n = realloc(profile, old + len + 2);
+    if (!n) { free(profile); return NULL; }
+    memcpy(n + old, line, len);
+    n[old + len] = '\n';
+    n[old + len + 1] = '\0';
+    return n;
+}
+
+static int finish_section(char *path, char *profile) {
+    if (!path) return 0;
+    if (!profile && !(profile = strdup(""))) return -1;
+    if (add_entry(path, profile) < 0) return -1;
+    char real[PATH_MAX];
+    if (realpath(path, real) && strcmp(real, path)) {
+        char *alias = strdup(real);
+        if (!alias || add_entry(alias, profile) < 0) return -1;
+    }
+    return 0;
+}
+
+static int parse_conf(const char *conf) {
+    FILE *f = fopen(conf, "re");
+    if (!f) return die(strerror(errno), conf);
+    char *line = NULL, *path = NULL, *profile = NULL;
+    size_t len = 0;
+    int lineno = 0, rc = 0;
+    while (getline(&line, &len, f) >= 0) {
+        lineno++;
+        line[strcspn(line, "\n")] = '\0';
+        char *s = line + strspn(line, " \t");
+        if (!*s || *s == '#') continue;
+        if (*s == '[') {
+            char *end = strchr(s, ']');
+            if (!end || s[1] != '/') {
+                fprintf(stderr, "childenv-index: %s:%d: expected [/absolute/path]\n",
+                        conf, lineno);
+                rc = 1;
+                break;
+            }
+            if (finish_section(path, profile) < 0) { rc = die("out of memory", NULL); break; }
+            *end = '\0';
+            if (!(path = strdup(s + 1))) { rc = die("out of memory", NULL); break; }
+            profile = NULL;
+            continue;
+        }
+        char *eq = strchr(s, '=');
+        if (!path || !eq || eq == s) {
+            fprintf(stderr, "childenv-index: %s:%d: expected NAME=value inside a section\n",
+                    conf, lineno);
+            rc = 1;
+            break;
+        }
+        if (!(profile = profile_append(profile, s))) { rc = die("out of memory", NULL); break; }
+    }
+    if (!rc && finish_section(path, profile) < 0) rc = die("out of memory", NULL);
+    free(line);
+    fclose(f);
+    return rc;
+}
+
+static int write_index(const char *out) {
+    qsort(entries, nentries, sizeof(*entries), cmp_entry);
+    for (size_t i = 1; i < nentries; i++)
+        if (!cmp_entry(&entries[i - 1], &entries[i]))
+            return die("duplicate section", entries[i].path);
+
+    size_t size = sizeof(struct childenv_index)
+                + nentries * sizeof(struct childenv_index_entry);
+    for (size_t i = 0; i < nentries; i++)
+        size += strlen(entries[i].path) + strlen(entries[i].profile) + 2;
+    if (size > UINT32_MAX) return die("index too large", NULL);
+    struct childenv_index *idx = calloc(1, size);
+    if (!idx) return die("out of memory", NULL);
+    memcpy(idx->magic, CHILDENV_INDEX_MAGIC, sizeof(idx->magic));
+    idx->version = CHILDENV_INDEX_VERSION;
+    idx->size = (uint32_t)size;
+    idx->nentries = (uint32_t)nentries;
+    size_t off = sizeof(*idx) + nentries * sizeof(struct childenv_index_entry);
+    for (size_t i = 0; i < nentries; i++) {
+        // Aliases share their profile text; storing it twice keeps the
+        // reader trivial and the file is tiny either way.
+        size_t plen = strlen(entries[i].path) + 1, tlen = strlen(entries[i].profile) + 1;
+        idx->entries[i] = (struct childenv_index_entry){
+            entries[i].hash, (uint32_t)off, (uint32_t)(off + plen)};
+        memcpy((char *)idx + off, entries[i].path, plen);
+        memcpy((char *)idx + off + plen, entries[i].profile, tlen);
+        off += plen + tlen;
+    }
+
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", out) >= (int)sizeof(tmp))
+        return die("path too long", out);
+    int fd = mkstemp(tmp);
+    if (fd < 0) return die(strerror(errno), tmp);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t w = write(fd, (char *)idx + done, size - done);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break;
+        done += (size_t)w;
+    }
+    if (done != size || fchmod(fd, 0644) < 0 || fsync(fd) < 0 || close(fd) < 0) {
+        unlink(tmp);
+        return die("write failed", tmp);
+    }
+    if (rename(tmp, out) < 0) {
+        unlink(tmp);
+        return die(strerror(errno), out);
+    }
+    free(idx);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: childenv-index <system.conf> <system.idx>\n");
+        return 2;
+    }
+    if (parse_conf(argv[1])) return 1;
+    return write_index(argv[2]);
+}
@@ -0,0 +1,256 @@
+// childenv-launch: native replacement for the `#!/bin/sh` + `exec env` pair
+// that apply-malloc wrappers and `libchildenv.sh <allocator>` used to cost on
+// every launch. Built static, so starting it runs no dynamic loader and it is
+// never itself subject to LD_PRELOAD.
+//
+// Two modes, chosen by whether the path it was exec'd as (AT_EXECFN), or a
+// symlink on the way from there to the launcher, has a profile next to it,
+// not by its name, so aliases of the launcher and of wrapped binaries work:
+//
+//   /usr/bin/foo -> childenv-launch        (apply-malloc wrapper symlink)
+//       /usr/bin/foo.childenv exists: reads the profile from it and execs
+//       /usr/bin/foo.orig with the original argv. An alias such as
+//       /usr/bin/bar -> foo finds the same profile one link further.
+//
+//   childenv-launch <profile> <command> [args...]
+//       <profile> is a built-in allocator profile (mimalloc, jemalloc,
+//       tcmalloc, glibc) or a path to a profile file. Runs <command> from PATH.
+//
+//   childenv-launch --print <profile>
+//       Prints a built-in profile, one entry per line. libchildenv.sh takes
+//       its profiles from here, so they are defined only once.
+//
+//   childenv-launch --child <setup> <path> <argv0> [args...]
+//       Used by libchildenv for posix_spawn() children that need settings
+//       only the child itself can make. Applies <setup> (key=value,...) to
+//       this process and execs <path> with the given argv and environment.
+//
+// Profile files hold one NAME=value per line; '#' starts a comment. Each
+// entry overrides the variable of the same name, exactly like env(1).
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/auxv.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+
+extern char **environ;
+
+#define SELF_NAME   "childenv-launch"
+#define MAX_ENTRIES 64
+#define MAX_LINKS   40          // symlinks followed looking for a profile
+
+static const char *const mimalloc_env[] = {
+    "LD_PRELOAD=libchildenv.so:libmimalloc.so",
+    "CHILD_ENV_RULES=LD_PRELOAD,MIMALLOC_PURGE_DELAY,CHILD_ENV_RULES",
+    "MIMALLOC_PURGE_DELAY=0",
+    NULL,
+};
+static const char *const jemalloc_env[] = {
+    "LD_PRELOAD=libchildenv.so:libjemalloc.so",
+    "CHILD_ENV_RULES=LD_PRELOAD,MALLOC_CONF,CHILD_ENV_RULES",
+    "MALLOC_CONF=narenas:1",
+    NULL,
+};
+static const char *const tcmalloc_env[] = {
+    "LD_PRELOAD=libchildenv.so:libtcmalloc.so",
+    "CHILD_ENV_RULES=LD_PRELOAD,TCMALLOC_AGGRESSIVE_DECOMMIT,CHILD_ENV_RULES",
+    "TCMALLOC_AGGRESSIVE_DECOMMIT=1",
+    NULL,
+};
+// glibc malloc kept, tuned in-host via mallopt() and trimmed when idle; for
+// apps that cannot take a replacement allocator.
+static const char *const glibc_env[] = {
+    "LD_PRELOAD=libchildenv.so",
+    "CHILD_ENV_RULES=LD_PRELOAD,CHILD_ENV_MALLOPT,CHILD_ENV_PURGE_IDLE,CHILD_ENV_RULES",
+    "CHILD_ENV_MALLOPT=arena_max=2,trim_threshold=131072,mmap_threshold=131072",
+    "CHILD_ENV_PURGE_IDLE=30",
+    NULL,
+};
+
+static const struct { const char *name; const char *const *env; } builtins[] = {
+    {"mimalloc", mimalloc_env},
+    {"jemalloc", jemalloc_env},
+    {"tcmalloc", tcmalloc_env},
+    {"glibc", glibc_env},
+};
+
+static int die(const char *what, const char *arg) {
+    fprintf(stderr, SELF_NAME ": %s%s%s: %s\n", what, arg ? " " : "",
+            arg ? arg : "", strerror(errno));
+    return 127;
+}
+
+// Read a profile file into `out` (at most MAX_ENTRIES). The buffer is
+// intentionally never freed: we are about to exec.
+static int read_profile(const char *path, const char **out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    size_t cap = 4096, len = 0;
+    char *buf = malloc(cap);
+    for (;;) {
+        if (!buf) { close(fd); errno = ENOMEM; return -1; }
+        ssize_t r = read(fd, buf + len, cap - len - 1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) { close(fd); return -1; }
+        if (r == 0) break;
+        len += (size_t)r;
+        if (len + 1 == cap) buf = realloc(buf, cap *= 2);
+    }
+    close(fd);
+    buf[len] = '\0';
+    int n = 0;
+    for (char *line = buf, *next; line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        line += strspn(line, " \t");
+        char *eq = strchr(line, '=');
+        if (*line == '#' || !eq || eq == line) continue;
+        if (n == MAX_ENTRIES) { errno = E2BIG; return -1; }
+        out[n++] = line;
+    }
+    out[n] = NULL;
+    return n;
+}
+
+// environ with every profile entry overriding the variable of the same name.
+static char **merge_env(const char *const *profile) {
+    size_t n = 0, k = 0;
+    while (environ[n]) n++;
+    while (profile[k]) k++;
+    char **out = malloc(sizeof(char *) * (n + k + 1));
+    if (!out) return NULL;
+    size_t oi = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t name_len = strcspn(environ[i], "=");
+        int overridden = 0;
+        for (size_t j = 0; j < k && !overridden; j++)
+            overridden = !strncmp(environ[i], profile[j], name_len)
+                      && profile[j][name_len] == '=';
+        if (!overridden) out[oi++] = environ[i];
+    }
+    for (size_t j = 0; j < k; j++) out[oi++] = (char *)profile[j];
+    out[oi] = NULL;
+    return out;
+}
+
+// Wrapper mode: `self` is the wrapped binary's path (the one we were exec'd
+// as, or the link an alias led to), `prof` its profile.
+static int launch_wrapped(const char *self, const char *prof, char **argv) {
+    size_t len = strlen(self);
+    char *orig = malloc(len + sizeof(".orig"));
+    if (!orig) { errno = ENOMEM; return die("launch", self); }
+    memcpy(orig, self, len);
+    memcpy(orig + len, ".orig", sizeof(".orig"));
+
+    const char *profile[MAX_ENTRIES + 1];
+    if (read_profile(prof, profile) < 0) return die("profile", prof);
+    char **envp = merge_env(profile);
+    if (!envp) { errno = ENOMEM; return die("launch", self); }
+    execve(orig, argv, envp);
+    return die("exec", orig);
+}
+
+#ifndef PR_SET_MEMORY_MERGE
+#define PR_SET_MEMORY_MERGE 67
+#endif
+#ifndef PR_THP_DISABLE_EXCEPT_ADVISED
+#define PR_THP_DISABLE_EXCEPT_ADVISED (1 << 1)
+#endif
+
+// Child setup mode. thp is 0 (default), 1 (never) or 2 (advised); ksm 0 or
+// 1. A setting that cannot be applied is skipped: the program still runs.
+static int launch_child(char *setup, const char *path, char **argv) {
+    for (char *tok; (tok = strsep(&setup, ",")); ) {
+        char *eq = strchr(tok, '=');
+        if (!eq) continue;
+        *eq++ = '\0';
+        long v = strtol(eq, NULL, 10);
+        if (!strcmp(tok, "thp"))
+            prctl(PR_SET_THP_DISABLE, v != 0, v == 2 ? PR_THP_DISABLE_EXCEPT_ADVISED : 0, 0, 0);
+        else if (!strcmp(tok, "ksm"))
+            prctl(PR_SET_MEMORY_MERGE, v, 0, 0, 0);
+    }
+    execve(path, argv, environ);
+    return die("exec", path);
+}
+
+static const char *const *builtin(const char *name) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(*builtins); i++)
+        if (!strcmp(name, builtins[i].name)) return builtins[i].env;
+    return NULL;
+}
+
+static int launch_cli(int argc, char **argv) {
+    if (argc == 3 && !strcmp(argv[1], "--print")) {
+        const char *const *profile = builtin(argv[2]);
+        if (!profile) {
+            fprintf(stderr, SELF_NAME ": unknown profile: %s\n", argv[2]);
+            return 2;
+        }
+        while (*profile) puts(*profile++);
+        return 0;
+    }
+    if (argc >= 4 && !strcmp(argv[1], "--child"))
+        return launch_child(argv[2], argv[3], argv + 4);
+    if (argc < 3) {
+        fprintf(stderr, "Usage: " SELF_NAME " <mimalloc|jemalloc|tcmalloc|glibc|profile-file>"
+                        " <command> [args...]\n"
+                        "       " SELF_NAME " --print <mimalloc|jemalloc|tcmalloc|glibc>\n");
+        return 2;
+    }
+    const char *const *profile = NULL;
+    const char *loaded[MAX_ENTRIES + 1];
+    if (strchr(argv[1], '/')) {
+        if (read_profile(argv[1], loaded) < 0) return die("profile", argv[1]);
+        profile = loaded;
+    } else {
+        profile = builtin(argv[1]);
+    }
+    if (!profile) {
+        fprintf(stderr, SELF_NAME ": unknown profile: %s\n", argv[1]);
+        return 2;
+    }
+    char **envp = merge_env(profile);
+    if (!envp) { errno = ENOMEM; return die("launch", argv[2]); }
+    execvpe(argv[2], argv + 2, envp);
+    return die("exec", argv[2]);
+}
+
+// Follow the symlinks from `self` one link at a time until one has a
+// profile next to it. Fills `link` with that path and `prof` with its
+// profile's; false if the chain ends (normally at the launcher) without one.
+static int find_wrapped(const char *self, char *link, char *prof) {
+    char target[PATH_MAX];
+    if ((size_t)snprintf(link, PATH_MAX, "%s", self) >= PATH_MAX) return 0;
+    for (int hops = 0; hops < MAX_LINKS; hops++) {
+        if ((size_t)snprintf(prof, PATH_MAX, "%s.childenv", link) < PATH_MAX
+            && access(prof, F_OK) == 0)
+            return 1;
+        ssize_t n = readlink(link, target, sizeof(target) - 1);
+        if (n <= 0) return 0;
+        target[n] = '\0';
+        // A relative target is relative to the link's directory.
+        char *slash = strrchr(link, '/');
+        size_t dir = *target == '/' || !slash ? 0 : (size_t)(slash - link) + 1;
+        if (dir + (size_t)n >= PATH_MAX) return 0;
+        memcpy(link + dir, target, (size_t)n + 1);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *self = (const char *)getauxval(AT_EXECFN);
+    if (!self) self = argv[0];
+    char *link = malloc(PATH_MAX), *prof = malloc(PATH_MAX);
+    if (!link || !prof) { errno = ENOMEM; return die("launch", self); }
+    if (find_wrapped(self, link, prof)) return launch_wrapped(link, prof, argv);
+    free(link);
+    free(prof);
+    return launch_cli(argc, argv);
+}
@@ -16,110 +16,3822 @@
 // By the time the constructor runs, ld.so has already dlopen'd every
 // LD_PRELOAD entry, so removing the variable from environ does not
 // unload anything — it only blocks downstream propagation.
+//
+// Hosts that hand environ to something other than exec (D-Bus activation,
+// their own spawn code) can get the same child view through the snapshot API
+// declared in libchildenv.h.
+//
+// Optional CHILD_ENV_DEPTH_RULES extends the rules to grandchildren and beyond
+// by keeping libchildenv (and nothing else) loaded in descendants — see the
+// depth-scoped propagation section.
+//
+// Listed in /etc/ld.so.preload instead, it applies per-program profiles from
+// the index childenv-index compiles — see the system-wide preload section.
+
+#define _GNU_SOURCE
+#include "childenv-format.h"
+#include "libchildenv.h"
+
+#include <dlfcn.h>
+#include <linux/kcmp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <link.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// ---------- env builder ----------
+
+// A built envp is one block: the pointer array, then the strings. Each
+// thread keeps such a block as scratch and builds into it again on its next
+// spawn, so hosts spawning from many threads at once do not serialize on
+// the shared heap's locks (or fragment it) for every child. The block grows
+// geometrically; one that stayed four times larger than needed for
+// ENV_SCRATCH_TRIM builds in a row is shrunk, one above ENV_SCRATCH_KEEP is
+// never kept, and a pthread key frees it when the thread exits.
+//
+// `owner` is the pid holding the block, so a signal handler spawning while
+// its thread builds falls back to malloc. The pid is the one the
+// constructor cached, refreshed after fork(), so a build makes no syscall.
+// A vfork() child still sees its parent's, and its exec never returns to
+// release the block, so vfork_unpin() frees it right before that exec.
+
+#define ENV_SCRATCH_MIN  4096
+#define ENV_SCRATCH_KEEP (256 * 1024)
+#define ENV_SCRATCH_TRIM 64
+
+struct env_scratch {
+    char *buf;
+    size_t cap;
+    unsigned small_runs;        // consecutive builds needing < cap/4
+    pid_t owner;                // 0: free
+};
+
+static __thread struct env_scratch env_scratch;
+static pid_t self_pid;                      // refreshed after fork(), not vfork()
+
+// Our pid without a syscall once the constructor has cached it.
+static pid_t cached_pid(void) {
+    return self_pid ? self_pid : getpid();
+}
+static pthread_key_t env_scratch_key;
+static pthread_once_t env_scratch_once = PTHREAD_ONCE_INIT;
+
+static void env_scratch_free(void *p) {
+    struct env_scratch *s = p;
+    free(s->buf);
+    s->buf = NULL;
+    s->cap = 0;
+}
+
+static void env_scratch_key_init(void) {
+    pthread_key_create(&env_scratch_key, env_scratch_free);
+}
+
+// Room for `n` entries and `bytes` of strings.
+static char **env_alloc(size_t n, size_t bytes) {
+    size_t need = sizeof(char *) * (n + 1) + bytes;
+    struct env_scratch *s = &env_scratch;
+    pid_t self = cached_pid();
+    if (need > ENV_SCRATCH_KEEP || s->owner == self) return malloc(need);
+    s->small_runs = need < s->cap / 4 ? s->small_runs + 1 : 0;
+    if (need > s->cap || s->small_runs > ENV_SCRATCH_TRIM) {
+        size_t cap = ENV_SCRATCH_MIN;
+        while (cap < need) cap *= 2;
+        char *buf = malloc(cap);
+        if (!buf) return NULL;
+        if (!s->buf) {
+            pthread_once(&env_scratch_once, env_scratch_key_init);
+            pthread_setspecific(env_scratch_key, s);
+        }
+        free(s->buf);
+        s->buf = buf;
+        s->cap = cap;
+        s->small_runs = 0;
+    }
+    s->owner = self;
+    return (char **)s->buf;
+}
+
+static void free_envp(char **e) {
+    if (!e) return;
+    if ((char *)e == env_scratch.buf) env_scratch.owner = 0;
+    else free(e);
+}
+
+// Fills a block from env_alloc(); the caller sized it.
+struct env_pack {
+    char **envp;
+    char *str;                  // next free string byte
+    size_t n;
+};
+
+static bool env_pack_init(struct env_pack *p, size_t n, size_t bytes) {
+    if (!(p->envp = env_alloc(n, bytes))) return false;
+    p->str = (char *)(p->envp + n + 1);
+    p->n = 0;
+    return true;
+}
+
+static char *env_push(struct env_pack *p, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsprintf(p->str, fmt, ap);
+    va_end(ap);
+    p->envp[p->n++] = p->str;
+    p->str += len + 1;
+    return p->envp[p->n - 1];
+}
+
+static char **env_pack_done(struct env_pack *p) {
+    p->envp[p->n] = NULL;
+    return p->envp;
+}
+
+static char **copy_envp(char *const envp[]) {
+    size_t n = 0, bytes = 0;
+    if (envp) for (char *const *e = envp; *e; ++e) { n++; bytes += strlen(*e) + 1; }
+    struct env_pack p;
+    if (!env_pack_init(&p, n, bytes)) return NULL;
+    for (size_t i = 0; i < n; i++) env_push(&p, "%s", envp[i]);
+    return env_pack_done(&p);
+}
+
+typedef struct { char *name, *value; } Rule;
+
+// Split a comma-separated rule list in place, appending to `rules`. The caller
+// sized `rules` by counting commas, so there is always room.
+static void parse_rules(char *str, Rule *rules, int *rc) {
+    char *tok;
+    while ((tok = strsep(&str, ",")) != NULL) {
+        if (!*tok || *tok == '=') continue;
+        char *eq = strchr(tok, '=');
+        if (eq) { *eq = '\0'; rules[*rc].value = eq + 1; }
+        else rules[*rc].value = NULL;
+        rules[*rc].name = tok;
+        (*rc)++;
+    }
+}
+
+// ---------- compiled policy ----------
+
+// The rule text (CHILD_ENV_RULES plus CHILD_ENV_DEPTH_RULES) is parsed once,
+// in the constructor, into a flat position-independent blob: a header, a rule
+// array sorted by depth, then a NUL-terminated string table addressed by
+// offset. The hooks only walk the array. When rules reach past depth 1 the
+// host puts the blob in a sealed memfd and passes its number to descendants
+// (CHILDENV_POLICY_FD), so every process of the tree maps the same physical
+// pages read-only instead of parsing again.
+
+#define POLICY_MAGIC   0x564e4543u  // "CENV"
+#define POLICY_VERSION 2
+#define POLICY_SEALS   (F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+struct policy_rule {
+    uint32_t name;      // string-table offset
+    uint32_t name_len;
+    uint32_t value;     // string-table offset, 0 = unset rule
+    uint16_t depth;     // 1 = children of the host
+    uint16_t flags;     // POLICY_RULE_*
+};
+
+// A child resource directive (nice, ioprio, ...), not a variable: `name` is
+// the directive and `value` its argument. See the child resource profile
+// section.
+#define POLICY_RULE_RESOURCE 0x1
+
+struct policy {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t max_depth;
+    uint32_t size;      // whole blob, header included
+    uint32_t nrules;
+    struct policy_rule rules[];
+};
+
+#define POLICY_STR(pol, off) ((const char *)(pol) + (off))
+
+// Rules gathered from every source (env text, policy file) before layout.
+// `bufs` owns the strings the Rule pointers refer to.
+struct rule_set {
+    Rule *rules;
+    int *depths;
+    uint16_t *flags;
+    int rc;
+    char **bufs;
+    int nbufs;
+};
+
+static void rule_set_free(struct rule_set *rs) {
+    for (int i = 0; i < rs->nbufs; i++) free(rs->bufs[i]);
+    free(rs->bufs); free(rs->rules); free(rs->depths); free(rs->flags);
+}
+
+// Take ownership of `str` and make room for `more` rules. Returns false (and
+// frees `str`) on OOM.
+static bool rule_set_reserve(struct rule_set *rs, char *str, int more) {
+    Rule *r = realloc(rs->rules, sizeof(Rule) * ((size_t)rs->rc + (size_t)more));
+    if (r) rs->rules = r;
+    int *d = realloc(rs->depths, sizeof(int) * ((size_t)rs->rc + (size_t)more));
+    if (d) rs->depths = d;
+    uint16_t *f = realloc(rs->flags, sizeof(uint16_t) * ((size_t)rs->rc + (size_t)more));
+    if (f) rs->flags = f;
+    char **b = realloc(rs->bufs, sizeof(char *) * ((size_t)rs->nbufs + 1));
+    if (b) rs->bufs = b;
+    if (!r || !d || !f || !b) { free(str); return false; }
+    b[rs->nbufs++] = str;
+    return true;
+}
+
+// Parse `raw` as rule group `depth` and append its rules. Returns false on OOM.
+static bool rule_set_add_text(struct rule_set *rs, const char *raw, size_t len,
+                              int depth) {
+    char *str = strndup(raw, len);
+    if (!str) return false;
+    int max_rules = 1;
+    for (char *p = str; *p; p++) if (*p == ',') max_rules++;
+    if (!rule_set_reserve(rs, str, max_rules)) return false;
+    int first = rs->rc;
+    parse_rules(str, rs->rules, &rs->rc);
+    for (int i = first; i < rs->rc; i++) { rs->depths[i] = depth; rs->flags[i] = 0; }
+    return true;
+}
+
+// Append every "N:rules" group of a CHILD_ENV_DEPTH_RULES string.
+static bool rule_set_add_depths(struct rule_set *rs, const char *depth_rules) {
+    for (const char *g = depth_rules; g && *g; ) {
+        const char *end = strchr(g, ';');
+        char *colon;
+        long d = strtol(g, &colon, 10);
+        if (colon != g && *colon == ':' && (!end || colon < end)
+            && d > 0 && d <= UINT16_MAX) {
+            size_t len = end ? (size_t)(end - colon - 1) : strlen(colon + 1);
+            if (!rule_set_add_text(rs, colon + 1, len, (int)d)) return false;
+        }
+        g = end ? end + 1 : NULL;
+    }
+    return true;
+}
+
+// Append the rules of a policy file. Line-oriented; '#' starts a comment:
+//
+//   [depth 2]            following rules apply at this depth (default 1)
+//   unset NAME           strip NAME from the child
+//   set NAME=value       set/overwrite NAME in the child
+//   nice|ioprio|cpus|sched|cgroup|closefds <arg>
+//                        child resource profile (see res_parse())
+//   throttle <pattern> ...   spawn governor (see gov_parse())
+//
+// Unknown or malformed lines are skipped, as malformed CHILD_ENV_RULES tokens
+// are. A missing file contributes nothing. Returns false on OOM only.
+static bool res_valid(const char *name, const char *arg);
+
+static bool rule_set_add_file(struct rule_set *rs, const char *path) {
+    FILE *f = fopen(path, "re");
+    if (!f) return true;
+    char *line = NULL;
+    size_t cap = 0;
+    int depth = 1;
+    bool ok = true;
+    while (ok && getline(&line, &cap, f) >= 0) {
+        char *l = line + strspn(line, " \t");
+        l[strcspn(l, "#\r\n")] = '\0';
+        for (char *t = l + strlen(l); t > l && (t[-1] == ' ' || t[-1] == '\t'); )
+            *--t = '\0';
+        if (!*l) continue;
+        int d;
+        if (sscanf(l, "[depth %d]", &d) == 1) {
+            depth = d > 0 && d <= UINT16_MAX ? d : 0;
+            continue;
+        }
+        if (!depth) continue;
+        size_t word = strcspn(l, " \t");
+        char *arg = l + word + strspn(l + word, " \t");
+        if (l[word]) l[word] = '\0';
+        if (res_valid(l, arg)) {
+            char *str = malloc(word + strlen(arg) + 2);
+            if (!str || !rule_set_reserve(rs, str, 1)) { ok = false; break; }
+            strcpy(str, l);
+            Rule *r = &rs->rules[rs->rc];
+            r->name = str;
+            r->value = strcpy(str + word + 1, arg);
+            rs->flags[rs->rc] = POLICY_RULE_RESOURCE;
+            rs->depths[rs->rc++] = depth;
+            continue;
+        }
+        bool set = !strcmp(l, "set");
+        if (!set && strcmp(l, "unset")) continue;
+        char *eq = strchr(arg, '=');
+        if (!*arg || *arg == '=' || (set != !!eq)) continue;
+        char *str = strdup(arg);
+        if (!str || !rule_set_reserve(rs, str, 1)) { ok = false; break; }
+        Rule *r = &rs->rules[rs->rc];
+        r->name = str;
+        r->value = NULL;
+        if (set) { str[eq - arg] = '\0'; r->value = str + (eq - arg) + 1; }
+        rs->flags[rs->rc] = 0;
+        rs->depths[rs->rc++] = depth;
+    }
+    free(line);
+    fclose(f);
+    return ok;
+}
+
+// Lay a rule set out as a malloc'd policy blob. Returns NULL on OOM or if
+// there is nothing to apply.
+static struct policy *policy_layout(const struct rule_set *rs) {
+    const Rule *rules = rs->rules;
+    int rc = rs->rc;
+    if (!rc) return NULL;
+
+    size_t size = sizeof(struct policy) + sizeof(struct policy_rule) * (size_t)rc;
+    for (int i = 0; i < rc; i++) {
+        size += strlen(rules[i].name) + 1;
+        if (rules[i].value) size += strlen(rules[i].value) + 1;
+    }
+    struct policy *pol;
+    if (size > UINT32_MAX || !(pol = calloc(1, size))) return NULL;
+    pol->magic = POLICY_MAGIC;
+    pol->version = POLICY_VERSION;
+    pol->size = (uint32_t)size;
+    pol->nrules = (uint32_t)rc;
+
+    // Stable by depth: emit each depth's rules in their original order.
+    char *strtab = (char *)&pol->rules[rc];
+    uint32_t off = (uint32_t)(strtab - (char *)pol);
+    uint32_t ri = 0;
+    int maxd = 0;
+    for (int i = 0; i < rc; i++) if (rs->depths[i] > maxd) maxd = rs->depths[i];
+    for (int d = 1; d <= maxd; d++) {
+        for (int i = 0; i < rc; i++) {
+            if (rs->depths[i] != d) continue;
+            struct policy_rule *pr = &pol->rules[ri++];
+            size_t nl = strlen(rules[i].name);
+            pr->depth = (uint16_t)d;
+            pr->flags = rs->flags[i];
+            pr->name = off;
+            pr->name_len = (uint32_t)nl;
+            memcpy((char *)pol + off, rules[i].name, nl + 1);
+            off += (uint32_t)nl + 1;
+            if (rules[i].value) {
+                size_t vl = strlen(rules[i].value);
+                pr->value = off;
+                memcpy((char *)pol + off, rules[i].value, vl + 1);
+                off += (uint32_t)vl + 1;
+            }
+        }
+    }
+    pol->max_depth = (uint16_t)maxd;
+    return pol;
+}
+
+// Compile `base` (depth-1 rules), `depth_rules` ("N:rules;N:rules") and the
+// policy file at `file` into a malloc'd blob. Any source may be NULL.
+static struct policy *policy_compile(const char *base, const char *depth_rules,
+                                     const char *file) {
+    struct rule_set rs = {0};
+    struct policy *pol = NULL;
+    if ((!base || rule_set_add_text(&rs, base, strlen(base), 1))
+        && rule_set_add_depths(&rs, depth_rules)
+        && (!file || rule_set_add_file(&rs, file)))
+        pol = policy_layout(&rs);
+    rule_set_free(&rs);
+    return pol;
+}
+
+// Structural check for a blob we did not build ourselves (inherited memfd):
+// every offset must stay inside the mapping and every string be terminated.
+static bool policy_valid(const struct policy *pol, size_t size) {
+    if (size < sizeof(*pol) || pol->magic != POLICY_MAGIC
+        || pol->version != POLICY_VERSION || pol->size != size) return false;
+    if (pol->nrules > (size - sizeof(*pol)) / sizeof(struct policy_rule))
+        return false;
+    for (uint32_t i = 0; i < pol->nrules; i++) {
+        const struct policy_rule *r = &pol->rules[i];
+        if (r->name >= size || r->name_len >= size - r->name
+            || POLICY_STR(pol, r->name)[r->name_len] != '\0') return false;
+        if (r->value && (r->value >= size
+            || !memchr(POLICY_STR(pol, r->value), '\0', size - r->value)))
+            return false;
+        if (r->depth > pol->max_depth || (r->flags & ~POLICY_RULE_RESOURCE)) return false;
+    }
+    return true;
+}
+
+// Move a compiled blob into a sealed memfd that descendants inherit, and
+// return the read-only mapping (or NULL, leaving `*fd` at -1). The fd is
+// deliberately not CLOEXEC: it has to survive the descendants' execs.
+static const struct policy *policy_publish(const struct policy *pol, int *fd) {
+    *fd = memfd_create("childenv-policy", MFD_ALLOW_SEALING);
+    if (*fd < 0) return NULL;
+    const char *p = (const char *)pol;
+    size_t left = pol->size;
+    while (left) {
+        ssize_t w = write(*fd, p, left);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) goto fail;
+        p += w; left -= (size_t)w;
+    }
+    if (fcntl(*fd, F_ADD_SEALS, POLICY_SEALS) < 0) goto fail;
+    void *map = mmap(NULL, pol->size, PROT_READ, MAP_SHARED, *fd, 0);
+    if (map == MAP_FAILED) goto fail;
+    return map;
+fail:
+    close(*fd);
+    *fd = -1;
+    return NULL;
+}
+
+// Map the policy inherited through CHILDENV_POLICY_FD. Only a fully sealed
+// memfd is trusted — anything else means the number was reused for an
+// unrelated descriptor after some ancestor closed ours.
+static const struct policy *policy_map_inherited(int fd) {
+    struct stat st;
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & POLICY_SEALS) != POLICY_SEALS) return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct policy)
+        || st.st_size > UINT32_MAX) return NULL;
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return NULL;
+    if (!policy_valid(map, (size_t)st.st_size)) {
+        munmap(map, (size_t)st.st_size);
+        return NULL;
+    }
+    return map;
+}
+
+// ---------- depth-scoped propagation ----------
+
+// CHILD_ENV_DEPTH_RULES="2:VAR=x,VAR2;3:VAR3" holds one rule group per
+// descendant depth (the host is depth 0, its children depth 1). When it is set
+// the hooks keep libchildenv itself in the child's LD_PRELOAD — everything else
+// in LD_PRELOAD is still subject to the rules, so allocators are removed as
+// before — and pass the depth counter in CHILDENV_DEPTH, plus the compiled
+// policy's memfd number in CHILDENV_POLICY_FD. The raw group list travels too,
+// as a fallback for descendants whose inherited fd did not survive.
+// Propagation stops at the deepest depth that still has rules to apply.
+
+// Depth of this process in the managed tree and the raw group list. Set once
+// in the constructor, read-only afterwards.
+static int self_depth = 0;
+static char *cached_depth_rules = NULL;
+// Path ld.so resolved for this library, re-inserted into descendants'
+// LD_PRELOAD while propagating.
+static char *self_path = NULL;
+
+// Write "LD_PRELOAD=<self>[:<rest>]" to `out`, where <rest> is `cur` minus
+// any entry that already names this library. `out` holds at least
+// strlen("LD_PRELOAD=") + strlen(self_path) + strlen(cur) + 2 bytes.
+static char *propagated_preload(char *out, const char *cur) {
+    const char *base = strrchr(self_path, '/');
+    base = base ? base + 1 : self_path;
+    char *o = out + sprintf(out, "LD_PRELOAD=%s", self_path);
+    for (const char *p = cur; p && *p; ) {
+        size_t n = strcspn(p, ": ");
+        const char *slash = memrchr(p, '/', n);
+        const char *name = slash ? slash + 1 : p;
+        if (n && !((size_t)(p + n - name) == strlen(base)
+                   && !strncmp(name, base, strlen(base)))) {
+            *o++ = ':';
+            memcpy(o, p, n);
+            o += n;
+        }
+        p += n;
+        if (*p) p++;
+    }
+    *o = '\0';
+    return out;
+}
+
+static bool is_control_var(const char *e) {
+    return !strncmp(e, "CHILDENV_DEPTH=", 15)
+        || !strncmp(e, "CHILDENV_POLICY_FD=", 19)
+        || !strncmp(e, "CHILD_ENV_DEPTH_RULES=", 22)
+        || !strncmp(e, "CHILD_ENV_POLICY_FILE=", 22);
+}
+
+// ---------- getenv profile and hot-first order ----------
+
+// glibc's getenv() scans environ from the start, and toolkit programs call it
+// hundreds of times while starting up, for PATH, HOME, LANG, XDG_*, DISPLAY
+// and the like, which often sit behind long variables nobody reads.
+//
+// CHILD_ENV_GETENV_PROFILE=<file> profiles a program: getenv() and
+// secure_getenv() count, per name, the lookups and how many entries each
+// one scanned, and the table is written to <file> at exit (depth-0 process
+// only), most looked-up first:
+//
+//   PATH 412 37.0 0     name, lookups, mean entries scanned, lookups unset
+//
+// Our own control variables are not counted. The constructor decides once
+// whether this process profiles; when it does not, both calls forward to
+// libc's through RTLD_NEXT. Lookups made before the constructor (by other
+// libraries' constructors) use the same linear scan libc does and are not
+// counted, since dlsym() that early may itself look up variables.
+//
+// CHILD_ENV_HOT_FIRST lists the variables build_child_env() puts first in
+// a child's envp, in that order: comma-separated names, or the path of such
+// a profile, whose first HOT_MAX names that were ever set are used.
+
+#define GETENV_SLOTS 512
+#define HOT_MAX      32
+
+struct getenv_slot {
+    atomic_uint state;          // 0 free, 1 being claimed, 2 ready
+    char name[48];
+    atomic_ulong lookups;
+    atomic_ulong scanned;
+    atomic_ulong unset;
+};
+
+static struct getenv_slot getenv_slots[GETENV_SLOTS];
+static const char *getenv_profile;                   // copy of the profile path
+static atomic_int getenv_profiling = -1;             // -1: constructor not run yet
+static char *(*libc_getenv)(const char *);
+static char *(*libc_secure_getenv)(const char *);
+
+static char *hot_names[HOT_MAX];
+static size_t hot_lens[HOT_MAX];
+static size_t hot_count;
+
+static char *env_scan(const char *name, size_t *pos) {
+    size_t len = strlen(name), i = 0;
+    char *found = NULL;
+    if (environ && len && !strchr(name, '='))
+        for (char **e = environ; *e; e++, i++)
+            if (!strncmp(*e, name, len) && (*e)[len] == '=') { found = *e + len + 1; i++; break; }
+    *pos = i;
+    return found;
+}
+
+static void getenv_count(const char *name, size_t scanned, bool found) {
+    size_t len = strlen(name);
+    if (len >= sizeof(getenv_slots[0].name) || !strncmp(name, "CHILD_ENV_", 10)
+        || !strncmp(name, "CHILDENV_", 9))
+        return;
+    uint32_t h = childenv_index_hash(name);
+    for (uint32_t probe = 0; probe < GETENV_SLOTS; probe++) {
+        struct getenv_slot *s = &getenv_slots[(h + probe) % GETENV_SLOTS];
+        unsigned state = atomic_load_explicit(&s->state, memory_order_acquire);
+        if (state == 0) {
+            if (!atomic_compare_exchange_strong(&s->state, &state, 1)) {
+                if (state == 1) return;     // another thread is naming it
+            } else {
+                memcpy(s->name, name, len + 1);
+                atomic_store_explicit(&s->state, 2, memory_order_release);
+                state = 2;
+            }
+        }
+        if (state == 1) return;
+        if (strcmp(s->name, name)) continue;
+        atomic_fetch_add_explicit(&s->lookups, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->scanned, scanned, memory_order_relaxed);
+        if (!found) atomic_fetch_add_explicit(&s->unset, 1, memory_order_relaxed);
+        return;
+    }
+}
+
+char *getenv(const char *name) {
+    int on = atomic_load_explicit(&getenv_profiling, memory_order_acquire);
+    if (!on) return libc_getenv(name);
+    size_t pos;
+    char *v = env_scan(name, &pos);
+    if (on > 0) getenv_count(name, pos, v != NULL);
+    return v;
+}
+
+char *secure_getenv(const char *name) {
+    if (!atomic_load_explicit(&getenv_profiling, memory_order_acquire))
+        return libc_secure_getenv(name);
+    return getauxval(AT_SECURE) ? NULL : getenv(name);
+}
+
+// Called once from the constructor: profile only when asked to (the
+// caller passes false for setuid and unlisted system-mode processes), and
+// otherwise hand both calls to libc. The path is copied so a setenv() or
+// clearenv() by the program cannot move it.
+static void getenv_profile_init(bool allowed) {
+    size_t unused;
+    const char *file = allowed ? env_scan("CHILD_ENV_GETENV_PROFILE", &unused) : NULL;
+    if (file && *file == '/' && !env_scan("CHILDENV_DEPTH", &unused)
+        && (getenv_profile = strdup(file))) {
+        atomic_store_explicit(&getenv_profiling, 1, memory_order_release);
+        return;
+    }
+    libc_getenv = (char *(*)(const char *))dlsym(RTLD_NEXT, "getenv");
+    libc_secure_getenv = (char *(*)(const char *))dlsym(RTLD_NEXT, "secure_getenv");
+    if (libc_getenv && libc_secure_getenv)
+        atomic_store_explicit(&getenv_profiling, 0, memory_order_release);
+}
+
+static int getenv_slot_cmp(const void *a, const void *b) {
+    unsigned long la = atomic_load(&(*(struct getenv_slot *const *)a)->lookups);
+    unsigned long lb = atomic_load(&(*(struct getenv_slot *const *)b)->lookups);
+    return la < lb ? 1 : la > lb ? -1 : 0;
+}
+
+__attribute__((destructor))
+static void getenv_profile_fini(void) {
+    const char *file = getenv_profile;
+    if (!file) return;
+    struct getenv_slot *sorted[GETENV_SLOTS];
+    size_t n = 0;
+    for (size_t i = 0; i < GETENV_SLOTS; i++)
+        if (atomic_load(&getenv_slots[i].state) == 2) sorted[n++] = &getenv_slots[i];
+    qsort(sorted, n, sizeof(*sorted), getenv_slot_cmp);
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    for (size_t i = 0; i < n; i++) {
+        unsigned long lookups = atomic_load(&sorted[i]->lookups);
+        dprintf(fd, "%s %lu %.1f %lu\n", sorted[i]->name, lookups,
+                (double)atomic_load(&sorted[i]->scanned) / (double)lookups,
+                atomic_load(&sorted[i]->unset));
+    }
+    close(fd);
+}
+
+static void hot_add(const char *name, size_t len) {
+    if (!len || hot_count == HOT_MAX || memchr(name, '=', len)) return;
+    if (!(hot_names[hot_count] = strndup(name, len))) return;
+    hot_lens[hot_count++] = len;
+}
+
+static void hot_first_init(void) {
+    const char *opt = getenv("CHILD_ENV_HOT_FIRST");
+    if (!opt || !*opt) return;
+    if (*opt != '/') {
+        for (const char *p = opt; *p; ) {
+            size_t len = strcspn(p, ",");
+            hot_add(p, len);
+            p += len + (p[len] == ',');
+        }
+        return;
+    }
+    FILE *f = fopen(opt, "re");
+    if (!f) return;
+    char line[256], name[48];
+    unsigned long lookups, unset;
+    while (hot_count < HOT_MAX && fgets(line, sizeof(line), f))
+        if (sscanf(line, "%47s %lu %*f %lu", name, &lookups, &unset) == 3 && unset < lookups)
+            hot_add(name, strlen(name));
+    fclose(f);
+}
+
+// Move the hot entries of a built envp to the front, in list order; the
+// rest keep theirs.
+static char **hot_first(char **envp) {
+    size_t n = 0, k = 0;
+    if (!envp || !hot_count) return envp;
+    while (envp[n]) n++;
+    for (size_t h = 0; h < hot_count && k < n; h++)
+        for (size_t i = k; i < n; i++) {
+            if (strncmp(envp[i], hot_names[h], hot_lens[h]) || envp[i][hot_lens[h]] != '=')
+                continue;
+            char *e = envp[i];
+            memmove(envp + k + 1, envp + k, (i - k) * sizeof(*envp));
+            envp[k++] = e;
+            break;
+        }
+    return envp;
+}
+
+// ---------- policy publication and reload ----------
+
+// Long-running hosts (gnome-shell, Cinnamon, Nemo) can take their rules from
+// CHILD_ENV_POLICY_FILE, which is re-checked with a single stat() at most once
+// per second, from whichever exec hook comes along. A changed file is compiled
+// into a new policy_ref that is swapped in atomically; the old one is freed
+// once the last hook holding it lets go. Hooks never wait: each holds a
+// reference to the policy it read from env building through the real
+// exec/spawn call (which must keep the memfd number in the new envp valid),
+// and a reload in progress on another thread is simply skipped.
+//
+// The count is per policy rather than one for all readers: a vfork() child
+// shares our memory, and when its exec succeeds it never lets go. That
+// pins the one policy it read, not every policy loaded after it. Structs
+// are reused, never freed, so a reader that raced a retirement may still
+// touch the count: it only takes a reference while the count is nonzero.
+
+// One published policy: the blob and, when it lives in a memfd, the fd that
+// descendants inherit. Immutable once published.
+struct policy_ref {
+    const struct policy *pol;
+    size_t map_len;                 // 0: heap blob, else mmap'd length
+    int fd;                         // -1 unless descendants can inherit it
+    unsigned long gen;              // unique per ref, survives address reuse
+    atomic_ulong refs;              // holders, plus one while active
+    struct policy_ref *free_next;
+};
+
+static struct policy_ref *_Atomic active_ref = NULL;
+static struct policy_ref *_Atomic free_refs = NULL;  // popped under reload_lock
+static atomic_ulong policy_gen = 0;
+
+// Reload sources, set once in the constructor. cached_rules is the original
+// CHILD_ENV_RULES, kept because the environ copy may be gone by reload time.
+static char *cached_rules = NULL;
+static char *policy_file = NULL;
+static bool policy_reloadable = false;
+static bool ctor_done = false;
+// Set by the constructor when there is nothing to apply, now or later (no
+// rules, no policy file, no self-exec check): hooks then call straight
+// through, which is what almost every process sees in system-wide mode.
+static bool hooks_idle = false;
+static atomic_ulong spawn_count = 0;        // exec/spawn hook calls, for idleness
+static atomic_long reload_next = 0;         // CLOCK_MONOTONIC_COARSE seconds
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stat policy_file_st;          // identity last compiled, under reload_lock
+
+// Wrap a freshly compiled blob. With `share` it moves into a sealed memfd;
+// if that fails the heap copy is kept (descendants then fall back to text).
+// Called from the constructor or under reload_lock: the only poppers.
+static struct policy_ref *policy_ref_new(struct policy *pol, bool share) {
+    struct policy_ref *ref = atomic_load(&free_refs);
+    while (ref && !atomic_compare_exchange_weak(&free_refs, &ref, ref->free_next)) {}
+    if (!ref && !(ref = calloc(1, sizeof(*ref)))) { free(pol); return NULL; }
+    ref->map_len = 0;
+    ref->pol = pol;
+    ref->fd = -1;
+    ref->gen = atomic_fetch_add(&policy_gen, 1) + 1;
+    const struct policy *shared;
+    if (share && (shared = policy_publish(pol, &ref->fd))) {
+        ref->map_len = pol->size;
+        ref->pol = shared;
+        free(pol);
+    }
+    atomic_store(&ref->refs, 1);
+    return ref;
+}
+
+// Drop a reference; the last one frees the policy and recycles the struct.
+static void policy_leave(struct policy_ref *ref) {
+    if (!ref || atomic_fetch_sub(&ref->refs, 1) != 1) return;
+    if (ref->map_len) munmap((void *)ref->pol, ref->map_len);
+    else free((void *)ref->pol);
+    if (ref->fd >= 0) close(ref->fd);
+    ref->pol = NULL;
+    ref->fd = -1;
+    struct policy_ref *head = atomic_load(&free_refs);
+    do ref->free_next = head;
+    while (!atomic_compare_exchange_weak(&free_refs, &head, ref));
+}
+
+static void policy_swap(struct policy_ref *ref) {
+    policy_leave(atomic_exchange(&active_ref, ref));
+}
+
+static bool same_file_state(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino
+        && a->st_size == b->st_size
+        && a->st_mtim.tv_sec == b->st_mtim.tv_sec
+        && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec
+        && a->st_ctim.tv_sec == b->st_ctim.tv_sec
+        && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+static struct policy *compile_current(void) {
+    return policy_compile(cached_rules, cached_depth_rules, policy_file);
+}
+
+static void policy_maybe_reload(void) {
+    if (!policy_reloadable) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    long next = atomic_load_explicit(&reload_next, memory_order_relaxed);
+    if (now.tv_sec < next) return;
+    if (!atomic_compare_exchange_strong(&reload_next, &next, now.tv_sec + 1))
+        return;
+    // A vfork() child would open the new memfd in its own fd table only.
+    if (getpid() != self_pid) {
+        atomic_store(&reload_next, next);
+        return;
+    }
+    if (pthread_mutex_trylock(&reload_lock)) return;
+    struct stat st;
+    if (stat(policy_file, &st) < 0) memset(&st, 0, sizeof(st));
+    if (!same_file_state(&st, &policy_file_st)) {
+        policy_file_st = st;
+        struct policy *pol = compile_current();
+        struct policy_ref *ref = NULL;
+        if (pol) ref = policy_ref_new(pol, pol->max_depth > self_depth + 1 && self_path);
+        // An emptied file legitimately leaves no policy; only OOM keeps the old.
+        if (ref || !pol) policy_swap(ref);
+    }
+    pthread_mutex_unlock(&reload_lock);
+}
+
+static void self_pid_atfork_child(void) {
+    self_pid = getpid();
+}
+
+// A reference to the current policy (NULL: none), for policy_leave().
+static struct policy_ref *policy_enter(void) {
+    policy_maybe_reload();
+    for (;;) {
+        struct policy_ref *ref = atomic_load(&active_ref);
+        if (!ref) return NULL;
+        unsigned long n = atomic_load(&ref->refs);
+        while (n && !atomic_compare_exchange_weak(&ref->refs, &n, n + 1)) {}
+        // A zero count is a struct being recycled; a moved active_ref a
+        // struct reused for a newer policy meanwhile.
+        if (n && atomic_load(&active_ref) == ref) return ref;
+        if (n) policy_leave(ref);
+    }
+}
+
+// Apply the rules for the next depth on top of `envp`, returning a freshly
+// allocated array. Returns NULL on OOM. If no rules are set, copies envp
+// verbatim.
+//
+// Reads `ref`, compiled in the constructor from CHILD_ENV_RULES (so the rule
+// list survives even after strip_host_environ() removes it from the host
+// environ), mapped from the inherited memfd, or reloaded from the policy
+// file. Falls back to compiling from getenv() if the constructor never ran
+// (e.g., static link or interposition order edge case).
+static char **build_child_env(const struct policy_ref *ref, char *const envp[]) {
+    const struct policy *pol = ref ? ref->pol : NULL;
+    int policy_fd = ref ? ref->fd : -1;
+    struct policy *tmp = NULL;
+    if (!pol && !ctor_done)
+        pol = tmp = policy_compile(getenv("CHILD_ENV_RULES"), NULL, NULL);
+    if (!pol) return hot_first(copy_envp(envp));
+
+    int depth = self_depth + 1;
+    const struct policy_rule *first = pol->rules, *last = pol->rules;
+    const struct policy_rule *end = pol->rules + pol->nrules;
+    while (first < end && first->depth < depth) first++;
+    last = first;
+    while (last < end && last->depth == depth) last++;
+    bool propagate = self_path && pol->max_depth > depth;
+
+    // Size the block: every inherited string and rule value, and when
+    // propagating, the five control entries (LD_PRELOAD at most the longest
+    // string plus our path).
+    size_t n = 0, bytes = 0, longest = 0;
+    if (envp) for (char *const *e = envp; *e; ++e) {
+        size_t len = strlen(*e) + 1;
+        n++;
+        bytes += len;
+        if (len > longest) longest = len;
+    }
+    for (const struct policy_rule *r = first; r < last; r++) {
+        if (!r->value || (r->flags & POLICY_RULE_RESOURCE)) continue;
+        size_t len = r->name_len + strlen(POLICY_STR(pol, r->value)) + 2;
+        n++;
+        bytes += len;
+        if (len > longest) longest = len;
+    }
+    if (propagate) {
+        n += 5;
+        bytes += longest + strlen(self_path) + 13 + 2 * 32;
+        if (cached_depth_rules) bytes += strlen(cached_depth_rules) + sizeof("CHILD_ENV_DEPTH_RULES=");
+        if (policy_file) bytes += strlen(policy_file) + sizeof("CHILD_ENV_POLICY_FILE=");
+    }
+    struct env_pack out;
+    if (!env_pack_init(&out, n, bytes)) { free(tmp); return NULL; }
+
+    if (envp) for (char *const *e = envp; *e; ++e) {
+        char *eq = strchr(*e, '=');
+        size_t name_len = eq ? (size_t)(eq - *e) : strlen(*e);
+        bool ruled = false;
+        for (const struct policy_rule *r = first; r < last; r++) {
+            if (r->flags & POLICY_RULE_RESOURCE) continue;
+            if (r->name_len == name_len
+                && !strncmp(*e, POLICY_STR(pol, r->name), name_len)) { ruled = true; break; }
+        }
+        // Control vars are always re-derived below, never inherited.
+        if (eq && is_control_var(*e)) ruled = true;
+        if (!ruled) env_push(&out, "%s", *e);
+    }
+    for (const struct policy_rule *r = first; r < last; r++) {
+        if (!r->value || (r->flags & POLICY_RULE_RESOURCE)) continue;
+        env_push(&out, "%s=%s", POLICY_STR(pol, r->name), POLICY_STR(pol, r->value));
+    }
+    if (propagate) {
+        char **pi = NULL;
+        for (size_t i = 0; i < out.n; i++)
+            if (!strncmp(out.envp[i], "LD_PRELOAD=", 11)) pi = &out.envp[i];
+        char *pre = propagated_preload(out.str, pi ? *pi + 11 : NULL);
+        out.str += strlen(pre) + 1;
+        if (pi) *pi = pre;
+        else out.envp[out.n++] = pre;
+        env_push(&out, "CHILDENV_DEPTH=%d", depth);
+        if (policy_fd >= 0) env_push(&out, "CHILDENV_POLICY_FD=%d", policy_fd);
+        if (cached_depth_rules) env_push(&out, "CHILD_ENV_DEPTH_RULES=%s", cached_depth_rules);
+        if (policy_file) env_push(&out, "CHILD_ENV_POLICY_FILE=%s", policy_file);
+    }
+    free(tmp);
+    return hot_first(env_pack_done(&out));
+}
+
+// ---------- self re-exec ----------
+
+// Hosts that re-exec their own binary (crash restart, sandbox re-launch,
+// gnome-shell/cinnamon --replace) are not children: stripping LD_PRELOAD and
+// the allocator knobs there silently drops the restarted host back to glibc
+// malloc. With CHILD_ENV_SELF_EXEC=1 the hooks compare the exec target's
+// device/inode with /proc/self/exe (stat'd once, in the constructor) and, on a
+// match, pass the host environment through unchanged — including the control
+// vars the constructor removed from environ, restored from the copies below.
+// Off by default: the check costs a stat() per exec.
+
+static bool self_exec_enabled = false;
+static dev_t self_exe_dev;
+static ino_t self_exe_ino;
+static const char *self_exe_name;      // basename, pre-filters PATH searches
+static char *self_exec_env[5];         // original "NAME=value" control vars
+// Set by prepare_env(): the exec under way is a self re-exec, which also
+// keeps the host's own resource profile.
+static __thread bool exec_is_self;
+
+static void self_exec_init(void) {
+    char *opt = getenv("CHILD_ENV_SELF_EXEC");
+    if (!opt || strcmp(opt, "1")) return;
+    static const char *const saved[] = {
+        "LD_PRELOAD", "CHILD_ENV_RULES", "CHILD_ENV_DEPTH_RULES",
+        "CHILD_ENV_POLICY_FILE", "CHILD_ENV_SELF_EXEC",
+    };
+    int n = 0;
+    for (size_t i = 0; i < sizeof(saved) / sizeof(*saved); i++) {
+        char *v = getenv(saved[i]);
+        if (!v) continue;
+        size_t len = strlen(saved[i]) + strlen(v) + 2;
+        if (!(self_exec_env[n] = malloc(len))) return;
+        snprintf(self_exec_env[n++], len, "%s=%s", saved[i], v);
+    }
+    struct stat st;
+    char exe[4096];
+    ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (len <= 0 || stat("/proc/self/exe", &st) < 0) return;
+    exe[len] = '\0';
+    const char *base = strrchr(exe, '/');
+    if (!(self_exe_name = strdup(base ? base + 1 : exe))) return;
+    self_exe_dev = st.st_dev;
+    self_exe_ino = st.st_ino;
+    self_exec_enabled = true;
+    unsetenv("CHILD_ENV_SELF_EXEC");
+}
+
+static bool same_exe(const struct stat *st) {
+    return st->st_dev == self_exe_dev && st->st_ino == self_exe_ino;
+}
+
+// True if exec'ing `path` (or the file open at `fd` when path is NULL) would
+// start this very binary again. A bare name is looked up in envp's PATH the
+// way execvp does, but only when it already matches our own basename.
+static bool is_self_exec(const char *path, int fd, char *const envp[]) {
+    if (!self_exec_enabled) return false;
+    struct stat st;
+    if (!path) return fstat(fd, &st) == 0 && same_exe(&st);
+    if (strchr(path, '/')) return stat(path, &st) == 0 && same_exe(&st);
+    if (strcmp(path, self_exe_name)) return false;
+    const char *search = NULL;
+    if (envp) for (char *const *e = envp; *e; ++e)
+        if (!strncmp(*e, "PATH=", 5)) { search = *e + 5; break; }
+    if (!search) search = "/bin:/usr/bin";
+    char buf[4096];
+    for (const char *p = search; ; ) {
+        size_t n = strcspn(p, ":");
+        if (n + strlen(path) + 2 <= sizeof(buf)) {
+            snprintf(buf, sizeof(buf), "%.*s/%s", (int)n, n ? p : ".", path);
+            if (stat(buf, &st) == 0)
+                return S_ISREG(st.st_mode) && same_exe(&st);
+        }
+        if (!p[n]) return false;
+        p += n + 1;
+    }
+}
+
+// envp plus the control vars the constructor stripped, with no rules applied.
+static char **build_self_env(char *const envp[]) {
+    size_t n = 0, bytes = 0;
+    int k = 0;
+    if (envp) for (char *const *e = envp; *e; ++e) { n++; bytes += strlen(*e) + 1; }
+    for (; k < 5 && self_exec_env[k]; k++) bytes += strlen(self_exec_env[k]) + 1;
+    struct env_pack out;
+    if (!env_pack_init(&out, n + (size_t)k, bytes)) return NULL;
+    if (envp) for (char *const *e = envp; *e; ++e) {
+        bool restored = false;
+        for (int i = 0; i < k; i++) {
+            size_t len = strcspn(self_exec_env[i], "=") + 1;
+            if (!strncmp(*e, self_exec_env[i], len)) { restored = true; break; }
+        }
+        if (!restored) env_push(&out, "%s", *e);
+    }
+    for (int i = 0; i < k; i++) env_push(&out, "%s", self_exec_env[i]);
+    return env_pack_done(&out);
+}
+
+static char **fork_ready_env(const struct policy_ref *ref, char *const envp[]);
+
+// Environment for exec'ing `path` (or `fd` when path is NULL) from envp.
+// Takes a reference to the policy in *ref that lasts until release_env(),
+// so the real exec/spawn runs while the policy memfd named in the envp is
+// still open. Returns NULL (reference already dropped) on OOM.
+static char **prepare_env(const char *path, int fd, char *const envp[],
+                          struct policy_ref **ref) {
+    atomic_fetch_add_explicit(&spawn_count, 1, memory_order_relaxed);
+    *ref = policy_enter();
+    exec_is_self = is_self_exec(path, fd, envp);
+    char **out = exec_is_self ? build_self_env(envp) : fork_ready_env(*ref, envp);
+    if (!out && !exec_is_self) out = build_child_env(*ref, envp);
+    if (!out) policy_leave(*ref);
+    return out;
+}
+
+static void release_env(char **envp, struct policy_ref *ref) {
+    if (envp != fork_ready_env(NULL, NULL)) free_envp(envp);
+    policy_leave(ref);
+}
+
+// Right before an exec hook's real call. A vfork() child (its pid is not the
+// one fork() handlers last cached) whose exec succeeds never returns to
+// release_env(), so it lets go of the policy and the scratch block here: its
+// fd table is its own, and the envp it passes holds copies, so nothing it
+// still needs goes away if the parent frees them. Returns what release_env()
+// should drop instead.
+static struct policy_ref *vfork_unpin(struct policy_ref *ref, char **envp) {
+    if (getpid() == self_pid) return ref;
+    policy_leave(ref);
+    if ((char *)envp == env_scratch.buf) env_scratch.owner = 0;
+    return NULL;
+}
+
+// ---------- public snapshot API (libchildenv.h) ----------
+
+// A snapshot is one allocation: header, envp array, then the strings. The
+// cached one additionally records the policy generation and the environ it
+// was built from, pointers and contents. glibc's setenv/putenv always store
+// a new pointer, but a string passed to putenv() that the program then edits
+// in place keeps its pointer, so both are compared.
+struct childenv_snapshot {
+    atomic_uint refs;
+    unsigned long policy_gen;
+    char **src;                 // environ pointers, then their text (cache only)
+    size_t src_n;
+    size_t count;
+    char *envp[];
+};
+
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static childenv_snapshot *_Atomic cached_snapshot = NULL;   // holds one reference
+
+static childenv_snapshot *snapshot_pack(char **env) {
+    size_t n = 0, bytes = 0;
+    for (char **e = env; *e; ++e) { n++; bytes += strlen(*e) + 1; }
+    childenv_snapshot *snap = malloc(sizeof(*snap) + sizeof(char *) * (n + 1) + bytes);
+    if (!snap) return NULL;
+    atomic_init(&snap->refs, 1);
+    snap->policy_gen = 0;
+    snap->src = NULL;
+    snap->src_n = 0;
+    snap->count = n;
+    char *str = (char *)&snap->envp[n + 1];
+    for (size_t i = 0; i < n; i++) {
+        size_t len = strlen(env[i]) + 1;
+        memcpy(str, env[i], len);
+        snap->envp[i] = str;
+        str += len;
+    }
+    snap->envp[n] = NULL;
+    return snap;
+}
+
+static childenv_snapshot *snapshot_build(const struct policy_ref *ref,
+                                         char *const envp[]) {
+    char **env = build_child_env(ref, envp);
+    if (!env) { errno = ENOMEM; return NULL; }
+    childenv_snapshot *snap = snapshot_pack(env);
+    free_envp(env);
+    if (!snap) errno = ENOMEM;
+    return snap;
+}
+
+static bool snapshot_current(const childenv_snapshot *snap, unsigned long gen) {
+    if (snap->policy_gen != gen) return false;
+    const char *text = (const char *)(snap->src + snap->src_n);
+    size_t i = 0;
+    if (environ) for (; environ[i]; i++) {
+        if (i >= snap->src_n || environ[i] != snap->src[i] || strcmp(environ[i], text))
+            return false;
+        text += strlen(text) + 1;
+    }
+    return i == snap->src_n;
+}
+
+unsigned childenv_api_version(void) {
+    return CHILDENV_API_VERSION;
+}
+
+// The cached snapshot for environ under `ref`, rebuilt if stale.
+static childenv_snapshot *snapshot_get(const struct policy_ref *ref) {
+    unsigned long gen = ref ? ref->gen : 0;
+    pthread_mutex_lock(&snapshot_lock);
+    childenv_snapshot *snap = cached_snapshot;
+    if (snap && snapshot_current(snap, gen)) {
+        atomic_fetch_add(&snap->refs, 1);
+        goto out;
+    }
+    if (!(snap = snapshot_build(ref, environ))) goto out;
+    size_t n = 0, bytes = 0;
+    if (environ) for (; environ[n]; n++) bytes += strlen(environ[n]) + 1;
+    if ((snap->src = malloc(sizeof(char *) * n + bytes + 1))) {
+        char *text = (char *)(snap->src + n);
+        for (size_t i = 0; i < n; i++) {
+            size_t len = strlen(environ[i]) + 1;
+            snap->src[i] = environ[i];
+            memcpy(text, environ[i], len);
+            text += len;
+        }
+        snap->src_n = n;
+        snap->policy_gen = gen;
+        childenv_snapshot_unref(cached_snapshot);
+        cached_snapshot = snap;
+        atomic_fetch_add(&snap->refs, 1);
+    }
+out:
+    pthread_mutex_unlock(&snapshot_lock);
+    return snap;
+}
+
+childenv_snapshot *childenv_snapshot_get(void) {
+    struct policy_ref *ref = policy_enter();
+    childenv_snapshot *snap = snapshot_get(ref);
+    policy_leave(ref);
+    return snap;
+}
+
+// Fork-time child environment. A large host that fork()s and execs from the
+// child would otherwise build the child's envp in the child, where every
+// malloc, strdup and array store lands on a page shared copy-on-write with
+// the parent and costs a 4 KiB copy. The fork() hook takes a reference to
+// the cached snapshot in the parent first, so repeated forks only compare
+// environ against it. A child whose exec passes that same environ then gets
+// the snapshot's array back from prepare_env() and only reads it. vfork()
+// children never go through the hook (in_fork_child stays false in the
+// shared memory), so they keep building their own.
+//
+// Building (or rebuilding, after environ or the policy changed) is left to
+// the child until one of this process's fork()ed children has exec'd with
+// environ: hosts whose children never exec (worker pools, daemons) pay no
+// more than that comparison per fork(), and nothing at all (no lock, no
+// syscall) while no snapshot is cached. Such a child reports it in
+// fork_exec_parent, a MAP_SHARED word every fork()ed child inherits.
+
+static bool in_fork_child = false;
+static _Atomic pid_t *fork_exec_parent;    // last parent a child exec'd in
+static pid_t fork_parent;                  // in a fork()ed child: who forked it
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+
+static void fork_shared_map(void) {
+    void *m = mmap(NULL, sizeof(*fork_exec_parent), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (m != MAP_FAILED) fork_exec_parent = m;
+}
+
+// The ready envp for `envp` in a fork()ed child, or NULL. With a NULL
+// `envp`, whatever array may have been handed out, for release_env().
+static char **fork_ready_env(const struct policy_ref *ref, char *const envp[]) {
+    childenv_snapshot *snap = cached_snapshot;
+    if (!in_fork_child) return NULL;
+    if (!envp) return snap ? snap->envp : NULL;
+    if (envp != environ) return NULL;
+    if (fork_exec_parent)
+        atomic_store_explicit(fork_exec_parent, fork_parent, memory_order_relaxed);
+    if (!snap || !snapshot_current(snap, ref ? ref->gen : 0)) return NULL;
+    return snap->envp;
+}
+
+// A reference to the cached snapshot if it is still current, else NULL.
+// Never builds one.
+static childenv_snapshot *snapshot_cached(void) {
+    struct policy_ref *ref = policy_enter();
+    pthread_mutex_lock(&snapshot_lock);
+    childenv_snapshot *snap = cached_snapshot;
+    if (snap && snapshot_current(snap, ref ? ref->gen : 0)) atomic_fetch_add(&snap->refs, 1);
+    else snap = NULL;
+    pthread_mutex_unlock(&snapshot_lock);
+    policy_leave(ref);
+    return snap;
+}
+
+childenv_snapshot *childenv_snapshot_from(char *const envp[]) {
+    struct policy_ref *ref = policy_enter();
+    childenv_snapshot *snap = snapshot_build(ref, envp);
+    policy_leave(ref);
+    return snap;
+}
+
+childenv_snapshot *childenv_snapshot_ref(childenv_snapshot *snap) {
+    if (snap) atomic_fetch_add(&snap->refs, 1);
+    return snap;
+}
+
+void childenv_snapshot_unref(childenv_snapshot *snap) {
+    if (!snap || atomic_fetch_sub(&snap->refs, 1) != 1) return;
+    free(snap->src);
+    free(snap);
+}
+
+char *const *childenv_snapshot_envp(const childenv_snapshot *snap) {
+    return snap->envp;
+}
+
+size_t childenv_snapshot_count(const childenv_snapshot *snap) {
+    return snap->count;
+}
+
+// ---------- embedded ELF policy ----------
+
+// `childenv-elf add-needed` links libchildenv and the allocator into a copy of
+// the executable as DT_NEEDED entries and stores the rest of the profile
+// (allocator knobs, CHILD_ENV_RULES) at the start of the PT_LOAD segment it
+// appends. Apply it to our own environ before anything reads the rules, so
+// the patched binary behaves exactly as if it had been launched with the
+// profile — without the launch-time exec. Values already in the environment
+// win, so a user can still override a knob.
+
+static int find_main_phdrs(struct dl_phdr_info *info, size_t size, void *data) {
+    (void)size;
+    *(struct dl_phdr_info *)data = *info;
+    return 1;   // the main program is always reported first
+}
+
+// Apply one "NAME=value" per line to our own environ without overriding
+// what is already set. LD_PRELOAD is not applied: it is returned (malloc'd,
+// or NULL) for the caller to act on, since setting it this late loads nothing.
+static char *apply_profile(const char *profile) {
+    char *text = strdup(profile), *preload = NULL;
+    if (!text) return NULL;
+    for (char *line = text, *next; line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        char *eq = strchr(line, '=');
+        if (!eq || eq == line) continue;
+        *eq = '\0';
+        if (strcmp(line, "LD_PRELOAD")) setenv(line, eq + 1, 0);
+        else if (!preload) preload = strdup(eq + 1);
+    }
+    free(text);
+    return preload;
+}
+
+// Runs once: from the constructor, or earlier from the malloc multiplexer's
+// resolve so a patched binary's allocator is loaded with its knobs set.
+static bool embedded_found;     // the main program carries a policy
+
+static void apply_embedded_policy(void) {
+    static atomic_bool applied;
+    if (atomic_exchange(&applied, true)) return;
+    struct dl_phdr_info main = {0};
+    dl_iterate_phdr(find_main_phdrs, &main);
+    const ElfW(Phdr) *last = NULL;
+    for (int i = 0; i < main.dlpi_phnum; i++)
+        if (main.dlpi_phdr[i].p_type == PT_LOAD
+            && (!last || main.dlpi_phdr[i].p_vaddr > last->p_vaddr))
+            last = &main.dlpi_phdr[i];
+    if (!last || !(last->p_flags & PF_R)
+        || last->p_filesz < sizeof(struct childenv_elf_policy)) return;
+    const struct childenv_elf_policy *pol =
+        (const void *)(main.dlpi_addr + last->p_vaddr);
+    if (memcmp(pol->magic, CHILDENV_ELF_MAGIC, sizeof(pol->magic))
+        || pol->version != CHILDENV_ELF_VERSION
+        || pol->size <= sizeof(*pol) || pol->size > last->p_filesz
+        || ((const char *)pol)[pol->size - 1] != '\0') return;
+    embedded_found = true;
+    free(apply_profile(pol->text));
+}
+
+// ---------- system-wide preload mode ----------
+
+// With libchildenv in /etc/ld.so.preload every process on the machine runs
+// this constructor, so an unlisted program must pay next to nothing: one
+// open+mmap of the index childenv-index compiled at its fixed path, a binary
+// search on the hash of AT_EXECFN, and then the constructor returns before
+// reading any other knob, with every hook a plain call-through (hooks_idle).
+// That is system mode: the library is neither named in LD_PRELOAD nor a
+// DT_NEEDED of a patched binary, and no libchildenv parent started us.
+// Processes started with LD_PRELOAD consult the same index but keep their
+// CHILD_ENV_* knobs. A listed program gets its profile knobs like the
+// embedded policy does. Its allocator can no longer be loaded at this point,
+// so unless every profile LD_PRELOAD library is already mapped (wrapper,
+// childenv-elf), we re-exec once with them prepended to LD_PRELOAD.
+// CHILDENV_SYSTEM marks that second start, so a missing library cannot loop.
+// setuid/setgid programs (AT_SECURE) are never touched: their environment
+// comes from the unprivileged caller, so the constructor reads none of our
+// variables there and leaves every hook a call-through (see
+// strip_host_environ).
+
+static const char *index_lookup(const struct childenv_index *idx, size_t size,
+                                const char *exe) {
+    if (memcmp(idx->magic, CHILDENV_INDEX_MAGIC, sizeof(idx->magic))
+        || idx->version != CHILDENV_INDEX_VERSION || idx->size != size
+        || idx->nentries > (size - sizeof(*idx)) / sizeof(idx->entries[0])
+        || ((const char *)idx)[size - 1] != '\0') return NULL;
+    uint32_t hash = childenv_index_hash(exe);
+    size_t lo = 0, hi = idx->nentries;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (idx->entries[mid].hash < hash) lo = mid + 1;
+        else hi = mid;
+    }
+    for (; lo < idx->nentries && idx->entries[lo].hash == hash; lo++) {
+        const struct childenv_index_entry *e = &idx->entries[lo];
+        if (e->path >= size || e->profile >= size) return NULL;
+        if (!strcmp((const char *)idx + e->path, exe))
+            return (const char *)idx + e->profile;
+    }
+    return NULL;
+}
+
+struct lib_query { const char *name; size_t len; bool found; };
+
+static int find_lib(struct dl_phdr_info *info, size_t size, void *data) {
+    (void)size;
+    struct lib_query *q = data;
+    const char *base = strrchr(info->dlpi_name, '/');
+    base = base ? base + 1 : info->dlpi_name;
+    q->found = strlen(base) == q->len && !strncmp(base, q->name, q->len);
+    return q->found;
+}
+
+// True if every library in an LD_PRELOAD-style list is already mapped,
+// compared by file name.
+static bool preload_mapped(const char *list) {
+    for (const char *p = list; *p; ) {
+        size_t n = strcspn(p, ": ");
+        if (n) {
+            const char *slash = memrchr(p, '/', n);
+            struct lib_query q = {slash ? slash + 1 : p, 0, false};
+            q.len = n - (size_t)(q.name - p);
+            dl_iterate_phdr(find_lib, &q);
+            if (!q.found) return false;
+        }
+        p += n;
+        if (*p) p++;
+    }
+    return true;
+}
+
+static void reexec_with_preload(const char *exe, char **argv, const char *preload) {
+    int (*real)(const char *, char *const *, char *const *) = dlsym(RTLD_NEXT, "execve");
+    const char *cur = getenv("LD_PRELOAD");
+    char *old = cur ? strdup(cur) : NULL;
+    size_t len = strlen(preload) + (cur ? strlen(cur) + 1 : 0) + 1;
+    char *value = malloc(len);
+    if (real && value && (!cur || old)) {
+        if (cur) snprintf(value, len, "%s:%s", preload, cur);
+        else snprintf(value, len, "%s", preload);
+        if (!setenv("LD_PRELOAD", value, 1) && !setenv("CHILDENV_SYSTEM", "1", 1))
+            real(exe, argv, environ);
+        // Still here: run without the allocator rather than not at all.
+        if (old) setenv("LD_PRELOAD", old, 1);
+        else unsetenv("LD_PRELOAD");
+        unsetenv("CHILDENV_SYSTEM");
+    }
+    free(value);
+    free(old);
+}
+
+// True if the index lists this program (or already did, before a re-exec).
+static bool apply_system_policy(char **argv) {
+    if (getenv("CHILDENV_SYSTEM")) { unsetenv("CHILDENV_SYSTEM"); return true; }
+    const char *exe = (const char *)getauxval(AT_EXECFN);
+    if (getauxval(AT_SECURE) || !exe || *exe != '/' || !argv) return false;
+    int fd = open(CHILDENV_INDEX_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct childenv_index))
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    const char *profile = index_lookup(map, (size_t)st.st_size, exe);
+    char *preload = profile ? apply_profile(profile) : NULL;
+    munmap(map, (size_t)st.st_size);
+    if (preload && !preload_mapped(preload)) reexec_with_preload(exe, argv, preload);
+    free(preload);
+    return profile != NULL;
+}
+
+// True if LD_PRELOAD names this library (by file name): not system mode.
+static bool preload_names_self(void) {
+    const char *list = getenv("LD_PRELOAD");
+    Dl_info info;
+    if (!list || !dladdr((void *)preload_names_self, &info) || !info.dli_fname) return false;
+    const char *self = strrchr(info.dli_fname, '/');
+    self = self ? self + 1 : info.dli_fname;
+    size_t len = strlen(self);
+    for (const char *p = list; *p; ) {
+        size_t n = strcspn(p, ": ");
+        const char *slash = memrchr(p, '/', n);
+        const char *base = slash ? slash + 1 : p;
+        if ((size_t)(p + n - base) == len && !strncmp(base, self, len)) return true;
+        p += n;
+        if (*p) p++;
+    }
+    return false;
+}
+
+#ifdef CHILDENV_MALLOC_MUX
+// ---------- malloc multiplexer (libchildenv-malloc.so) ----------
+
+// Built with -DCHILDENV_MALLOC_MUX, the library also exports the malloc
+// family and forwards each call through the table `mux` points to, resolved
+// once in the constructor — after the embedded and system-wide profiles have been
+// applied, so they can choose: CHILD_ENV_MALLOC names mimalloc, jemalloc,
+// tcmalloc or any library, dlopen'd RTLD_LOCAL; unset (or unloadable) means
+// the next definition in link order, normally glibc's. A single preload
+// entry then selects the allocator per program, at one indirect call.
+//
+// Whatever allocates before that (ld.so, libc start-up, earlier constructors,
+// the dlopen itself) is served from a bump arena that is never reused:
+// free() of an arena pointer is a no-op and realloc() moves it out. Running
+// out of arena resolves early, from the environment as it stands plus the
+// embedded profile of a patched binary. If it runs out while resolving (the
+// allocator's own dlopen and constructors) or resolving failed, the rest
+// spills into one reserved anonymous mapping, used the same way.
+
+#define BOOT_ARENA_SIZE (1u << 20)
+#define BOOT_SPILL_SIZE ((size_t)64 << 20)  // MAP_NORESERVE: costs only what is used
+#define BOOT_ALIGN      16
+
+struct malloc_table {
+    void *(*malloc)(size_t);
+    void (*free)(void *);
+    void *(*calloc)(size_t, size_t);
+    void *(*realloc)(void *, size_t);
+    void *(*memalign)(size_t, size_t);
+    int (*posix_memalign)(void **, size_t, size_t);
+    size_t (*malloc_usable_size)(void *);
+};
+
+static char boot_arena[BOOT_ARENA_SIZE] __attribute__((aligned(BOOT_ALIGN)));
+static atomic_size_t boot_used = 0;
+static char *_Atomic boot_spill;        // mapped on first use
+static atomic_size_t boot_spill_used = 0;
+static atomic_int mux_state = 0;        // 0 bootstrap, 1 resolving, 2 resolved
+
+// The table in use: the bump arena's until mux_resolve() has filled
+// mux_resolved, then that one. Other threads may already be allocating while
+// it resolves, so the switch is one release store of a finished table and
+// every call loads the pointer once: no call can pair one table's malloc
+// with the other's free.
+static const struct malloc_table *_Atomic mux;    // defined below
+static struct malloc_table mux_resolved;
+static void mux_resolve(void);
+
+static const struct malloc_table *mux_table(void) {
+    return atomic_load_explicit(&mux, memory_order_acquire);
+}
+
+static bool in_boot(const void *p) {
+    const char *c = p, *spill = atomic_load_explicit(&boot_spill, memory_order_acquire);
+    return (c >= boot_arena && c < boot_arena + BOOT_ARENA_SIZE)
+        || (spill && c >= spill && c < spill + BOOT_SPILL_SIZE);
+}
+
+// Each block is preceded by its requested size. Neither region is ever
+// reused and both start zeroed (.bss, fresh mapping), so blocks are too.
+static void *boot_bump(char *base, atomic_size_t *used, size_t cap, size_t align, size_t size) {
+    size_t need = (size + align + BOOT_ALIGN + BOOT_ALIGN - 1) & ~(size_t)(BOOT_ALIGN - 1);
+    size_t start = atomic_fetch_add(used, need);
+    if (start + need > cap) return NULL;
+    uintptr_t p = (uintptr_t)base + start + BOOT_ALIGN;
+    p = (p + align - 1) & ~(uintptr_t)(align - 1);
+    ((size_t *)p)[-1] = size;
+    return (void *)p;
+}
+
+static char *boot_spill_map(void) {
+    char *spill = atomic_load(&boot_spill);
+    if (spill) return spill;
+    void *m = mmap(NULL, BOOT_SPILL_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (m == MAP_FAILED) return NULL;
+    if (atomic_compare_exchange_strong(&boot_spill, &spill, m)) return m;
+    munmap(m, BOOT_SPILL_SIZE);         // another thread mapped it first
+    return spill;
+}
+
+static void *boot_memalign(size_t align, size_t size) {
+    if (align < BOOT_ALIGN) align = BOOT_ALIGN;
+    if (align & (align - 1)) { errno = EINVAL; return NULL; }
+    if (size > BOOT_SPILL_SIZE / 2 || align > BOOT_ARENA_SIZE) { errno = ENOMEM; return NULL; }
+    void *p = boot_bump(boot_arena, &boot_used, BOOT_ARENA_SIZE, align, size);
+    if (p) return p;
+    if (atomic_load(&mux_state) == 0) mux_resolve();
+    if (atomic_load(&mux_state) == 2) return mux_table()->memalign(align, size);
+    char *spill = boot_spill_map();
+    if (!spill || !(p = boot_bump(spill, &boot_spill_used, BOOT_SPILL_SIZE, align, size)))
+        errno = ENOMEM;
+    return p;
+}
+
+static size_t boot_size(void *p) { return ((size_t *)p)[-1]; }
+static void *boot_malloc(size_t size) { return boot_memalign(BOOT_ALIGN, size); }
+static void boot_free(void *p) { (void)p; }
+
+static void *boot_calloc(size_t n, size_t size) {
+    if (size && n > SIZE_MAX / size) { errno = ENOMEM; return NULL; }
+    return boot_memalign(BOOT_ALIGN, n * size);
+}
+
+static int boot_posix_memalign(void **out, size_t align, size_t size) {
+    if (align < sizeof(void *)) return EINVAL;
+    void *p = boot_memalign(align, size);
+    if (!p) return errno;
+    *out = p;
+    return 0;
+}
+
+// Also the path that moves arena blocks into the resolved allocator.
+static void *boot_realloc(void *p, size_t size) {
+    void *n = malloc(size);
+    if (n && p) memcpy(n, p, boot_size(p) < size ? boot_size(p) : size);
+    return n;
+}
+
+static const struct malloc_table mux_boot = {
+    boot_malloc, boot_free, boot_calloc, boot_realloc,
+    boot_memalign, boot_posix_memalign, boot_size,
+};
+
+static const struct malloc_table *_Atomic mux = &mux_boot;
+
+static void *mux_handle;                // selected allocator, if dlopen'd
+
+static const struct { const char *name, *lib; } mux_allocators[] = {
+    {"mimalloc", "libmimalloc.so"},
+    {"jemalloc", "libjemalloc.so"},
+    {"tcmalloc", "libtcmalloc.so"},
+};
+
+static bool mux_load(void *handle, struct malloc_table *t) {
+    t->malloc = dlsym(handle, "malloc");
+    t->free = dlsym(handle, "free");
+    t->calloc = dlsym(handle, "calloc");
+    t->realloc = dlsym(handle, "realloc");
+    t->memalign = dlsym(handle, "memalign");
+    t->posix_memalign = dlsym(handle, "posix_memalign");
+    t->malloc_usable_size = dlsym(handle, "malloc_usable_size");
+    return t->malloc && t->free && t->calloc && t->realloc && t->memalign
+        && t->posix_memalign && t->malloc_usable_size;
+}
+
+static void mux_resolve(void) {
+    int expected = 0;
+    if (!atomic_compare_exchange_strong(&mux_state, &expected, 1)) return;
+    struct malloc_table t;
+    bool ok = false;
+    const char *want = NULL;
+    if (!getauxval(AT_SECURE)) {
+        apply_embedded_policy();
+        want = getenv("CHILD_ENV_MALLOC");
+    }
+    if (want && *want) {
+        const char *lib = want;
+        for (size_t i = 0; i < sizeof(mux_allocators) / sizeof(*mux_allocators); i++)
+            if (!strcmp(want, mux_allocators[i].name)) lib = mux_allocators[i].lib;
+        void *handle = dlopen(lib, RTLD_NOW | RTLD_LOCAL);
+        ok = handle && mux_load(handle, &t);
+        if (ok) mux_handle = handle;
+    }
+    if (!ok) ok = mux_load(RTLD_NEXT, &t);
+    if (ok) {
+        mux_resolved = t;
+        atomic_store_explicit(&mux, &mux_resolved, memory_order_release);
+    }
+    atomic_store(&mux_state, ok ? 2 : 0);
+}
+
+void *malloc(size_t size) { return mux_table()->malloc(size); }
+void free(void *p) { if (!in_boot(p)) mux_table()->free(p); }
+void *calloc(size_t n, size_t size) { return mux_table()->calloc(n, size); }
+void *memalign(size_t align, size_t size) { return mux_table()->memalign(align, size); }
+void *aligned_alloc(size_t align, size_t size) { return mux_table()->memalign(align, size); }
+void *valloc(size_t size) { return mux_table()->memalign((size_t)getpagesize(), size); }
+
+void *realloc(void *p, size_t size) {
+    return in_boot(p) ? boot_realloc(p, size) : mux_table()->realloc(p, size);
+}
+
+void *reallocarray(void *p, size_t n, size_t size) {
+    if (size && n > SIZE_MAX / size) { errno = ENOMEM; return NULL; }
+    return realloc(p, n * size);
+}
+
+int posix_memalign(void **out, size_t align, size_t size) {
+    return mux_table()->posix_memalign(out, align, size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = (size_t)getpagesize();
+    return mux_table()->memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *p) {
+    return in_boot(p) ? boot_size(p) : mux_table()->malloc_usable_size(p);
+}
+#endif // CHILDENV_MALLOC_MUX
+
+// ---------- glibc malloc tuning ----------
+
+// Hosts that cannot swap allocators can still be kept from bloating under
+// glibc malloc: CHILD_ENV_MALLOPT="arena_max=2,trim_threshold=131072,..."
+// is applied with mallopt() here, after the embedded and system-wide
+// profiles. mallopt() only changes this process, so children keep glibc's
+// defaults without any rule — the same isolation the LD_PRELOAD allocators
+// get. Pair it with CHILD_ENV_PURGE_IDLE for malloc_trim(0) while idle.
+
+static void apply_mallopt(void) {
+    static const struct { const char *name; int param; } params[] = {
+        {"arena_max", M_ARENA_MAX},
+        {"arena_test", M_ARENA_TEST},
+        {"trim_threshold", M_TRIM_THRESHOLD},
+        {"mmap_threshold", M_MMAP_THRESHOLD},
+        {"mmap_max", M_MMAP_MAX},
+        {"top_pad", M_TOP_PAD},
+    };
+    const char *opts = getenv("CHILD_ENV_MALLOPT");
+    if (!opts || !*opts) return;
+    char *s = strdup(opts);
+    if (!s) return;
+    char *p = s, *tok;
+    while ((tok = strsep(&p, ",")) != NULL) {
+        char *eq = strchr(tok, '='), *end;
+        if (!eq) continue;
+        *eq = '\0';
+        long value = strtol(eq + 1, &end, 10);
+        if (end == eq + 1 || *end || value < 0 || value > INT_MAX) continue;
+        for (size_t i = 0; i < sizeof(params) / sizeof(*params); i++)
+            if (!strcmp(tok, params[i].name)) mallopt(params[i].param, (int)value);
+    }
+    free(s);
+}
+
+// ---------- kernel memory policy ----------
+
+// CHILD_ENV_MM="thp=never,ksm=1" sets this process's kernel memory policy in
+// the constructor; CHILD_ENV_CHILD_MM takes the same keys for the programs it
+// starts. Both are mm attributes the kernel carries across fork() and
+// execve(), so without a child policy children inherit the host's — a huge
+// page setting meant for a big heap would follow every small helper.
+//
+//   thp=never     PR_SET_THP_DISABLE: no transparent huge pages
+//   thp=advised   huge pages only where the program madvise()s (Linux 6.18+)
+//   thp=default   clear a disable inherited from the parent
+//   ksm=1|0       PR_SET_MEMORY_MERGE: offer all anonymous memory to KSM
+//
+// The exec hooks switch the calling (forked) process to the child policy
+// right before the real exec and switch back if it fails. A vfork() child
+// shares the host's mm, so it is left alone rather than changing the host.
+// posix_spawn() execs from its own vfork-style child, which shares the mm
+// too: those children get the policy through the child setup shim below.
+
+#ifndef PR_SET_MEMORY_MERGE
+#define PR_SET_MEMORY_MERGE 67
+#define PR_GET_MEMORY_MERGE 68
+#endif
+#ifndef PR_THP_DISABLE_EXCEPT_ADVISED
+#define PR_THP_DISABLE_EXCEPT_ADVISED (1 << 1)
+#endif
+
+enum { THP_DEFAULT, THP_NEVER, THP_ADVISED };
+
+struct mm_policy {
+    int thp;                    // THP_*, -1: leave alone
+    int ksm;                    // 0/1, -1: leave alone
+};
+
+#define MM_POLICY_UNSET ((struct mm_policy){-1, -1})
+
+static struct mm_policy child_mm = MM_POLICY_UNSET;
+
+static struct mm_policy mm_parse(const char *spec) {
+    struct mm_policy p = MM_POLICY_UNSET;
+    char *s = spec && *spec ? strdup(spec) : NULL;
+    if (!s) return p;
+    char *q = s, *tok;
+    while ((tok = strsep(&q, ",")) != NULL) {
+        if (!strcmp(tok, "thp=default")) p.thp = THP_DEFAULT;
+        else if (!strcmp(tok, "thp=never")) p.thp = THP_NEVER;
+        else if (!strcmp(tok, "thp=advised")) p.thp = THP_ADVISED;
+        else if (!strcmp(tok, "ksm=0")) p.ksm = 0;
+        else if (!strcmp(tok, "ksm=1")) p.ksm = 1;
+    }
+    free(s);
+    return p;
+}
+
+static int thp_get(void) {
+    int r = prctl(PR_GET_THP_DISABLE, 0, 0, 0, 0);
+    return r < 0 ? -1 : r & PR_THP_DISABLE_EXCEPT_ADVISED ? THP_ADVISED
+                      : r ? THP_NEVER : THP_DEFAULT;
+}
+
+static void thp_set(int thp) {
+    if (thp == THP_ADVISED)
+        prctl(PR_SET_THP_DISABLE, 1, PR_THP_DISABLE_EXCEPT_ADVISED, 0, 0);
+    else
+        prctl(PR_SET_THP_DISABLE, thp == THP_NEVER, 0, 0, 0);
+}
+
+// Apply `p`; returns the previous value of every field it changed.
+static struct mm_policy mm_switch(struct mm_policy p) {
+    struct mm_policy old = MM_POLICY_UNSET;
+    int cur;
+    if (p.thp >= 0 && (cur = thp_get()) >= 0 && cur != p.thp) {
+        thp_set(p.thp);
+        old.thp = cur;
+    }
+    if (p.ksm >= 0 && (cur = prctl(PR_GET_MEMORY_MERGE, 0, 0, 0, 0)) >= 0
+        && cur != p.ksm && prctl(PR_SET_MEMORY_MERGE, p.ksm, 0, 0, 0) == 0)
+        old.ksm = cur;
+    return old;
+}
+
+static void apply_mm_policy(void) {
+    mm_switch(mm_parse(getenv("CHILD_ENV_MM")));
+    child_mm = mm_parse(getenv("CHILD_ENV_CHILD_MM"));
+}
+
+// Before an exec hook's real call. Skipped when our mm is our parent's
+// (vfork) or kcmp cannot tell.
+static struct mm_policy child_mm_enter(void) {
+    if (child_mm.thp < 0 && child_mm.ksm < 0) return MM_POLICY_UNSET;
+    if (syscall(SYS_kcmp, getpid(), getppid(), KCMP_VM, 0, 0) <= 0)
+        return MM_POLICY_UNSET;
+    return mm_switch(child_mm);
+}
+
+// ---------- PATH resolution cache ----------
+
+// execvp(), execlp() and posix_spawnp() search PATH by trying every
+// directory in turn; with long PATHs a common helper costs several failed
+// execve() calls per spawn. CHILD_ENV_PATH_CACHE=1 remembers where a name
+// was found for a given PATH value and execs that path directly. An entry
+// is trusted for one to two seconds (coarse clock), then revalidated by
+// stat()ing the directories up to and including the hit: creating, removing
+// or renaming a program in any of them changes a directory mtime. If the direct exec fails for any reason
+// the entry is dropped and libc's own search runs, so ENOEXEC scripts and
+// the like behave exactly as before.
+//
+// The table is a MAP_SHARED anonymous mapping made in the constructor: the
+// fork() children that actually call execvp() fill it for their parent and
+// siblings. Slots are seqlocked; a writer that loses the race just skips
+// the update. Nothing here allocates, so it is safe in a vfork() child.
+
+#define PATH_CACHE_SLOTS 64
+
+struct path_entry {
+    atomic_uint seq;            // odd while being written
+    uint32_t dirs;              // PATH entries walked, hit included
+    uint32_t path_len;          // strlen(PATH)
+    uint64_t path_hash;         // 64-bit FNV-1a of PATH; 0: empty
+    uint64_t dirs_sig;          // identity of those directories
+    atomic_long checked;        // CLOCK_MONOTONIC_COARSE seconds
+    char name[64];
+    char path[256];
+};
+
+struct path_cache {
+    atomic_ulong hits;
+    atomic_ulong misses;
+    struct path_entry slots[PATH_CACHE_SLOTS];
+};
+
+static struct path_cache *path_cache;
+
+static uint64_t sig_mix(uint64_t h, uint64_t v) {
+    return (h ^ v) * 1099511628211u;
+}
+
+// Walk up to `max` PATH directories, mixing their identity into *sig. With
+// `file`, stop at the first one holding it as an executable regular file,
+// leaving the full path in `out`. Returns the number of directories walked,
+// or 0 if `file` was not found or a relative entry (cwd-dependent) came first.
+static uint32_t path_walk(const char *path, const char *file, uint32_t max,
+                          char *out, size_t out_len, uint64_t *sig) {
+    uint64_t h = 1469598103934665603u;
+    uint32_t n = 0;
+    for (const char *p = path; n < max; p++) {
+        size_t len = strcspn(p, ":");
+        char dir[PATH_MAX];
+        if (*p != '/' || len >= sizeof(dir)) return 0;
+        memcpy(dir, p, len);
+        dir[len] = '\0';
+        struct stat st;
+        if (stat(dir, &st) == 0) {
+            h = sig_mix(h, st.st_dev);
+            h = sig_mix(h, st.st_ino);
+            h = sig_mix(h, (uint64_t)st.st_mtim.tv_sec);
+            h = sig_mix(h, (uint64_t)st.st_mtim.tv_nsec);
+        } else {
+            h = sig_mix(h, 0);
+        }
+        n++;
+        if (file && (size_t)snprintf(out, out_len, "%s/%s", dir, file) < out_len
+            && stat(out, &st) == 0 && S_ISREG(st.st_mode)
+            && faccessat(AT_FDCWD, out, X_OK, AT_EACCESS) == 0) {
+            *sig = h;
+            return n;
+        }
+        p += len;
+        if (!*p) break;
+    }
+    *sig = h;
+    return file ? 0 : n;
+}
+
+// An entry is used only if its name, PATH hash and PATH length all match.
+struct path_key {
+    uint64_t hash;
+    uint32_t len;
+};
+
+static struct path_entry *path_slot(const char *file, const char *path, struct path_key *key) {
+    uint64_t h = 1469598103934665603u;
+    const char *p = path;
+    for (; *p; p++) h = sig_mix(h, (unsigned char)*p);
+    key->hash = h | 1;
+    key->len = (uint32_t)(p - path);
+    return &path_cache->slots[(key->hash ^ childenv_index_hash(file)) % PATH_CACHE_SLOTS];
+}
+
+static bool path_match(const struct path_entry *e, const struct path_key *key, const char *file) {
+    return e->path_hash == key->hash && e->path_len == key->len && !strcmp(e->name, file);
+}
+
+// Publish an entry, or clear the slot when `file` is NULL.
+static void path_store(struct path_entry *e, const struct path_key *key, const char *file,
+                       const char *resolved, uint32_t dirs, uint64_t sig) {
+    unsigned seq = atomic_load_explicit(&e->seq, memory_order_relaxed);
+    if ((seq & 1) || !atomic_compare_exchange_strong(&e->seq, &seq, seq + 1)) return;
+    e->path_hash = file ? key->hash : 0;
+    e->path_len = file ? key->len : 0;
+    if (file) {
+        e->dirs = dirs;
+        e->dirs_sig = sig;
+        strcpy(e->name, file);
+        strcpy(e->path, resolved);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        atomic_store_explicit(&e->checked, now.tv_sec, memory_order_relaxed);
+    }
+    atomic_store_explicit(&e->seq, seq + 2, memory_order_release);
+}
+
+// Where execvp(file) would go, into `out` (PATH_MAX). False: not cacheable,
+// let libc search.
+static bool path_cache_resolve(const char *file, char *out) {
+    if (!path_cache || !file || !*file || strchr(file, '/')
+        || strlen(file) >= sizeof(path_cache->slots[0].name)) return false;
+    const char *path = getenv("PATH");
+    if (!path || !*path) return false;
+    struct path_key key;
+    uint64_t sig;
+    struct path_entry *e = path_slot(file, path, &key);
+    unsigned seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+    if (!(seq & 1) && e->path_hash) {
+        uint32_t dirs = e->dirs;
+        uint64_t dirs_sig = e->dirs_sig;
+        bool same = path_match(e, &key, file);
+        memcpy(out, e->path, sizeof(e->path));
+        atomic_thread_fence(memory_order_acquire);
+        if (same && atomic_load_explicit(&e->seq, memory_order_relaxed) == seq) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+            bool fresh = now.tv_sec - atomic_load_explicit(&e->checked, memory_order_relaxed) <= 1;
+            if (fresh || (path_walk(path, NULL, dirs, NULL, 0, &sig) == dirs
+                          && sig == dirs_sig)) {
+                if (!fresh)
+                    atomic_store_explicit(&e->checked, now.tv_sec, memory_order_relaxed);
+                atomic_fetch_add_explicit(&path_cache->hits, 1, memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+    atomic_fetch_add_explicit(&path_cache->misses, 1, memory_order_relaxed);
+    uint32_t dirs = path_walk(path, file, UINT32_MAX, out, PATH_MAX, &sig);
+    if (!dirs) return false;
+    if (strlen(out) < sizeof(e->path)) path_store(e, &key, file, out, dirs, sig);
+    return true;
+}
+
+static void path_cache_forget(const char *file) {
+    const char *path = getenv("PATH");
+    struct path_key key;
+    if (!path) return;
+    struct path_entry *e = path_slot(file, path, &key);
+    if (path_match(e, &key, file)) path_store(e, &key, NULL, NULL, 0, 0);
+}
+
+static void path_cache_init(void) {
+    const char *opt = getenv("CHILD_ENV_PATH_CACHE");
+    if (!opt || strcmp(opt, "1")) return;
+    void *m = mmap(NULL, sizeof(struct path_cache), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (m != MAP_FAILED) path_cache = m;
+}
+
+// execvpe-style call through the cache; `search` is libc's execvpe.
+static int exec_path_cached(const char *file, char *const argv[], char *const envp[],
+                            int (*search)(const char *, char *const *, char *const *)) {
+    static int (*direct)(const char *, char *const *, char *const *);
+    char resolved[PATH_MAX];
+    if (!direct) direct = dlsym(RTLD_NEXT, "execve");
+    if (direct && path_cache_resolve(file, resolved)) {
+        direct(resolved, argv, envp);
+        path_cache_forget(file);
+    }
+    return search(file, argv, envp);
+}
+
+typedef int (*spawn_fn)(pid_t *, const char *, const posix_spawn_file_actions_t *,
+                        const posix_spawnattr_t *, char *const *, char *const *);
+
+// posix_spawnp through the cache; `search` is libc's posix_spawnp.
+static int spawn_path_cached(pid_t *pid, const char *file,
+                             const posix_spawn_file_actions_t *fa,
+                             const posix_spawnattr_t *attr,
+                             char *const argv[], char *const envp[], spawn_fn search) {
+    static spawn_fn direct;
+    char resolved[PATH_MAX];
+    if (!direct) direct = (spawn_fn)dlsym(RTLD_NEXT, "posix_spawn");
+    if (direct && path_cache_resolve(file, resolved)) {
+        if (direct(pid, resolved, fa, attr, argv, envp) == 0) return 0;
+        path_cache_forget(file);
+    }
+    return search(pid, file, fa, attr, argv, envp);
+}
+
+// ---------- child setup shim ----------
+
+// Some child settings can only be made from inside the child: the THP and
+// KSM flags belong to the mm, which a posix_spawn() child shares with the
+// host until it execs. A spawn that needs them runs the static launcher
+// instead, as `childenv-launch --child <setup> <path> <argv...>` (next to
+// libchildenv, else on PATH): it applies <setup> to itself and execs <path>
+// with the caller's argv and envp under the same pid. The program is
+// resolved and checked for execute permission here first, so a missing or
+// non-executable one still fails the spawn itself; an exec that fails only
+// later in the launcher (a bad ELF, ENOEXEC, E2BIG) cannot reach the
+// caller as an errno and shows as the child exiting with status 127, like
+// a shell's. Without the launcher the mm settings are skipped, logged
+// once; the host never changes.
+
+// A child setting that cannot be applied is skipped, with one line on
+// stderr the first time per kind.
+enum { SKIP_MM = 1, SKIP_CLOSEFDS = 2 };
+static atomic_uint skips_logged;
+
+static void skip_once(unsigned kind, const char *what) {
+    if (!(atomic_fetch_or(&skips_logged, kind) & kind))
+        dprintf(2, "libchildenv: %s\n", what);
+}
+
+struct shim {
+    char setup[512];            // "key=value,..."
+    size_t len;
+};
+
+static char shim_launcher[PATH_MAX];
+static pthread_once_t shim_once = PTHREAD_ONCE_INIT;
+
+// Append one "key=value" (printf format); false if it does not fit.
+__attribute__((format(printf, 2, 3)))
+static bool shim_add(struct shim *s, const char *fmt, ...) {
+    size_t sep = s->len ? 1 : 0, room = sizeof(s->setup) - s->len - sep;
+    if (sizeof(s->setup) - s->len < sep + 2) return false;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(s->setup + s->len + sep, room, fmt, ap);
+    va_end(ap);
+    if (n <= 0 || (size_t)n >= room) { s->setup[s->len] = '\0'; return false; }
+    if (sep) s->setup[s->len] = ',';
+    s->len += sep + (size_t)n;
+    return true;
+}
+
+static void shim_find(void) {
+    const char *slash = self_path ? strrchr(self_path, '/') : NULL;
+    uint64_t sig;
+    if (slash && (size_t)snprintf(shim_launcher, sizeof(shim_launcher), "%.*s/childenv-launch",
+                                  (int)(slash - self_path), self_path) < sizeof(shim_launcher)
+        && access(shim_launcher, X_OK) == 0)
+        return;
+    const char *path = getenv("PATH");
+    if (!path || !path_walk(path, "childenv-launch", UINT32_MAX, shim_launcher,
+                            sizeof(shim_launcher), &sig))
+        shim_launcher[0] = '\0';
+}
+
+static void shim_mm(struct shim *s) {
+    if (child_mm.thp >= 0) shim_add(s, "thp=%d", child_mm.thp);
+    if (child_mm.ksm >= 0) shim_add(s, "ksm=%d", child_mm.ksm);
+}
+
+// posix_spawn of `file` (searched on PATH with `search`) through the shim.
+// -1 if the shim is not needed or cannot be used, else the spawn result.
+static int shim_spawn(const struct shim *s, pid_t *pid, const char *file,
+                      const posix_spawn_file_actions_t *fa, const posix_spawnattr_t *attr,
+                      char *const argv[], char *const envp[], bool search) {
+    static spawn_fn direct;
+    if (!s->len) return -1;
+    pthread_once(&shim_once, shim_find);
+    if (!direct) direct = (spawn_fn)dlsym(RTLD_NEXT, "posix_spawn");
+    if (!*shim_launcher || !direct) {
+        skip_once(SKIP_MM, "child THP/KSM settings skipped: childenv-launch not found");
+        return -1;
+    }
+    char path[PATH_MAX];
+    const char *env_path = getenv("PATH");
+    uint64_t sig;
+    if (search && !strchr(file, '/')) {
+        if (!path_cache_resolve(file, path)
+            && !path_walk(env_path ? env_path : "/bin:/usr/bin", file, UINT32_MAX,
+                          path, sizeof(path), &sig))
+            return -1;
+    } else if ((size_t)snprintf(path, sizeof(path), "%s", file) >= sizeof(path)) {
+        return -1;
+    }
+    /* /proc/self/exe or /dev/fd/N would name the launcher's own files once
+       it runs; resolve those here. Other paths stay as given so a wrapped
+       binary still sees its own AT_EXECFN. */
+    if (!strncmp(path, "/proc/", 6) || !strncmp(path, "/dev/fd/", 8)) {
+        char real[PATH_MAX];
+        if (!realpath(path, real)) return -1;
+        memcpy(path, real, strlen(real) + 1);
+    }
+    if (access(path, X_OK)) return -1;
+    size_t argc = 0;
+    while (argv[argc]) argc++;
+    char **shim_argv = malloc(sizeof(*shim_argv) * (argc + 5));
+    if (!shim_argv) return -1;
+    shim_argv[0] = shim_launcher;
+    shim_argv[1] = "--child";
+    shim_argv[2] = (char *)s->setup;
+    shim_argv[3] = path;
+    memcpy(shim_argv + 4, argv, sizeof(*argv) * (argc + 1));
+    int r = direct(pid, shim_launcher, fa, attr, shim_argv, envp);
+    free(shim_argv);
+    return r;
+}
+
+// ---------- child resource profile ----------
+
+// Besides variables, a policy file can give children a scheduling profile,
+// so background helpers (thumbnailers, indexers) stop competing with the
+// interactive host for CPU and disk:
+//
+//   nice 10          nice value, -20..19
+//   ioprio idle      I/O priority: idle, be[:0-7] or rt[:0-7]
+//   cpus 2-3,6       CPU affinity
+//   sched batch      scheduler class: batch, idle or other
+//   cgroup /sys/fs/cgroup/helpers memory.high=256M memory.max=512M cpu.weight=20
+//                    cgroup v2 leaf (created if missing) and the limits
+//                    written into it
+//   closefds 3 keep=5,7-9
+//                    descriptors from 3 up that are not close-on-exec,
+//                    except the kept ones, do not reach the child
+//
+// The directives are depth-scoped like the rules and travel in the compiled
+// policy flagged POLICY_RULE_RESOURCE. All four are per-task attributes that
+// the kernel keeps across fork() and execve(). An exec hook sets them on the
+// calling task right before the real exec, and puts back what it can if the
+// exec fails; even a vfork() child only changes itself. posix_spawn() has
+// no such moment. `sched other` goes in the spawn attributes; the rest are
+// set on the new pid right after the spawn returns (glibc rejects
+// SCHED_BATCH and SCHED_IDLE in setschedpolicy and has no nice, ioprio or
+// affinity attribute), so the child's first instructions may still run
+// with the host's profile. The host's thread is never switched: its own
+// work, signal handlers and atfork handlers would run with the child's
+// profile meanwhile.
+//
+// The cgroup is different: with glibc 2.41's posix_spawnattr_setcgroup_np()
+// the spawn uses clone3(CLONE_INTO_CGROUP) and the child never runs in the
+// host's cgroup. Older glibc has no way to do that for posix_spawn, so the
+// child is moved by writing its pid to cgroup.procs after the spawn, which
+// leaves a short window. An exec hook moves the calling process before the
+// real exec, so the new program always starts in the leaf.
+//
+// closefds is for hosts that leak descriptors without O_CLOEXEC (memfds,
+// dmabufs, DRM nodes, pipes) into every child, pinning their buffers for as
+// long as the child lives. The flag is only ever set in the process about
+// to exec: an exec hook marks everything from N up close-on-exec with
+// close_range(CLOSE_RANGE_CLOEXEC), one call per gap between the kept
+// descriptors; kernels before 5.11 get a scan of /proc/self/fd instead. A
+// failed exec leaves the flag set in the process that meant to replace
+// itself. A posix_spawn child gets a close action per leaked descriptor
+// instead, listed from /proc/self/fd without changing anything, so one
+// another thread opens meanwhile still reaches it; a spawn that passes its
+// own file actions is left alone. The host's table is never touched, since
+// another thread may be spawning or setting flags meanwhile. The policy
+// memfd that descendants inherit and an fexecve() descriptor are always
+// kept. `libchildenv.sh fds <pid>` lists
+// what a running host would leak.
+
+#define IOPRIO_WHO_PROCESS   1
+#define IOPRIO_CLASS_SHIFT   13
+#define IOPRIO_PRIO(cls, lvl) ((cls) << IOPRIO_CLASS_SHIFT | (lvl))
+#define RES_UNSET            INT_MIN
+
+#ifndef POSIX_SPAWN_SETCGROUP
+#define POSIX_SPAWN_SETCGROUP 0x100
+#endif
+#ifndef CGROUP2_SUPER_MAGIC
+#define CGROUP2_SUPER_MAGIC 0x63677270
+#endif
+
+struct child_res {
+    int nice;                   // RES_UNSET: leave alone
+    int ioprio;                 // IOPRIO_PRIO() value
+    int sched;                  // SCHED_* (and its priority, for restoring)
+    int sched_prio;
+    bool has_cpus;
+    cpu_set_t cpus;
+    const char *cgroup;         // "dir knob=value...", in the policy blob
+    int closefds;               // first fd to keep from children
+    const char *closefds_keep;  // exceptions, "a-b,c" in the policy blob
+    int keep_fd;                // one more exception (policy memfd)
+};
+
+static const struct child_res res_unset = {RES_UNSET, RES_UNSET, RES_UNSET, 0, false, {{0}},
+                                           NULL, RES_UNSET, NULL, -1};
+
+static bool res_parse_int(const char *s, long lo, long hi, int *out) {
+    char *end;
+    long v = strtol(s, &end, 10);
+    if (end == s || *end || v < lo || v > hi) return false;
+    *out = (int)v;
+    return true;
+}
+
+// One "knob=value" token of a cgroup directive, as the file to write and
+// the text to write there. Memory sizes take a K, M or G suffix.
+static bool cgroup_knob(const char *tok, size_t len, char *file, char *value) {
+    static const char *const knobs[] = {"memory.high", "memory.max", "cpu.weight"};
+    const char *eq = memchr(tok, '=', len);
+    if (!eq) return false;
+    size_t nl = (size_t)(eq - tok), vl = len - nl - 1;
+    char v[24];
+    if (!vl || vl >= sizeof(v)) return false;
+    memcpy(v, eq + 1, vl);
+    v[vl] = '\0';
+    for (size_t i = 0; i < sizeof(knobs) / sizeof(*knobs); i++) {
+        if (strlen(knobs[i]) != nl || strncmp(tok, knobs[i], nl)) continue;
+        strcpy(file, knobs[i]);
+        if (i == 2) {
+            int w;
+            if (!res_parse_int(v, 1, 10000, &w)) return false;
+            sprintf(value, "%d", w);
+            return true;
+        }
+        if (!strcmp(v, "max")) { strcpy(value, v); return true; }
+        char *end;
+        unsigned long long n = strtoull(v, &end, 10);
+        const char *units = "KMG", *u = *end ? strchr(units, *end) : NULL;
+        if (end == v || (*end && (!u || end[1]))) return false;
+        if (u) n <<= 10 * (u - units + 1);
+        sprintf(value, "%llu", n);
+        return true;
+    }
+    return false;
+}
+
+static bool cgroup_spec_valid(const char *spec) {
+    size_t len = strcspn(spec, " \t");
+    if (*spec != '/' || len >= PATH_MAX - 32) return false;
+    for (const char *p = spec + len; *(p += strspn(p, " \t")); ) {
+        char file[16], value[24];
+        size_t tl = strcspn(p, " \t");
+        if (!cgroup_knob(p, tl, file, value)) return false;
+        p += tl;
+    }
+    return true;
+}
+
+// Walk a "a-b,c" list of numbers in 0..max, calling `fn` for each range.
+// False on a syntax error.
+static bool list_walk(const char *list, long max, void (*fn)(long, long, void *), void *arg) {
+    for (const char *p = list; ; p++) {
+        char *end;
+        long a = strtol(p, &end, 10), b = a;
+        if (end == p || a < 0) return false;
+        if (*end == '-') {
+            p = end + 1;
+            b = strtol(p, &end, 10);
+            if (end == p || b < a) return false;
+        }
+        if (b > max) return false;
+        if (fn) fn(a, b, arg);
+        p = end;
+        if (!*p) return true;
+        if (*p != ',') return false;
+    }
+}
+
+static void cpus_add(long a, long b, void *set) {
+    for (long c = a; c <= b; c++) CPU_SET(c, (cpu_set_t *)set);
+}
+
+struct list_hit { long v; bool hit; };
+
+static void list_hit(long a, long b, void *arg) {
+    struct list_hit *h = arg;
+    if (h->v >= a && h->v <= b) h->hit = true;
+}
+
+// Parse the directive `name arg` into `res`. False if it is not one.
+static bool res_parse(struct child_res *res, const char *name, const char *arg) {
+    if (!strcmp(name, "nice")) return res_parse_int(arg, -20, 19, &res->nice);
+    if (!strcmp(name, "cgroup")) {
+        if (!cgroup_spec_valid(arg)) return false;
+        res->cgroup = arg;
+        return true;
+    }
+    if (!strcmp(name, "ioprio")) {
+        int cls = !strcmp(arg, "idle") ? 3 : !strncmp(arg, "be", 2) ? 2
+                : !strncmp(arg, "rt", 2) ? 1 : 0;
+        int level = 4;
+        if (!cls) return false;
+        if (cls == 3) level = 0;
+        else if (arg[2] && (arg[2] != ':' || !res_parse_int(arg + 3, 0, 7, &level))) return false;
+        res->ioprio = IOPRIO_PRIO(cls, level);
+        return true;
+    }
+    if (!strcmp(name, "sched")) {
+        res->sched = !strcmp(arg, "batch") ? SCHED_BATCH : !strcmp(arg, "idle") ? SCHED_IDLE
+                   : !strcmp(arg, "other") ? SCHED_OTHER : RES_UNSET;
+        res->sched_prio = 0;
+        return res->sched != RES_UNSET;
+    }
+    if (!strcmp(name, "closefds")) {
+        char *end;
+        long first = strtol(arg, &end, 10);
+        if (end == arg || first < 3 || first > INT_MAX) return false;
+        if (*end) {
+            if (strncmp(end, " keep=", 6) || !list_walk(end + 6, INT_MAX, NULL, NULL))
+                return false;
+            res->closefds_keep = end + 6;
+        }
+        res->closefds = (int)first;
+        return true;
+    }
+    if (strcmp(name, "cpus")) return false;
+    CPU_ZERO(&res->cpus);
+    return res->has_cpus = list_walk(arg, CPU_SETSIZE - 1, cpus_add, &res->cpus);
+}
+
+static bool gov_valid(const char *arg);
+
+static bool res_valid(const char *name, const char *arg) {
+    struct child_res res = res_unset;
+    if (!strcmp(name, "throttle")) return gov_valid(arg);
+    return res_parse(&res, name, arg);
+}
+
+// The profile for our children from the policy `ref` holds.
+static struct child_res res_load(const struct policy_ref *ref) {
+    struct child_res res = res_unset;
+    const struct policy *pol = ref ? ref->pol : NULL;
+    if (!pol) return res;
+    int depth = self_depth + 1;
+    for (uint32_t i = 0; i < pol->nrules; i++) {
+        const struct policy_rule *r = &pol->rules[i];
+        if (r->depth == depth && (r->flags & POLICY_RULE_RESOURCE))
+            res_parse(&res, POLICY_STR(pol, r->name), POLICY_STR(pol, r->value));
+    }
+    res.keep_fd = ref->fd;
+    return res;
+}
+
+static bool res_empty(const struct child_res *res) {
+    return res->nice == RES_UNSET && res->ioprio == RES_UNSET && res->sched == RES_UNSET
+        && !res->has_cpus && !res->cgroup && res->closefds == RES_UNSET;
+}
+
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+#define FDS_KEEP_MAX 32
+
+// The descriptors `want` keeps from children, as ranges.
+struct fds_keep { long r[FDS_KEEP_MAX][2]; size_t n; bool full; };
+
+static void fds_keep_add(long a, long b, void *arg) {
+    struct fds_keep *k = arg;
+    if (k->n == FDS_KEEP_MAX) { k->full = true; return; }
+    k->r[k->n][0] = a;
+    k->r[k->n++][1] = b;
+}
+
+// close_range(CLOSE_RANGE_CLOEXEC) over every gap between the kept ranges,
+// from `first` up; false if the kernel cannot.
+static bool fds_cloexec_ranges(long first, const struct fds_keep *k) {
+    for (long lo = first; ; ) {
+        long a = LONG_MAX, b = 0;
+        for (size_t i = 0; i < k->n; i++)
+            if (k->r[i][1] >= lo && k->r[i][0] < a) { a = k->r[i][0]; b = k->r[i][1]; }
+        if (a == LONG_MAX)
+            return syscall(SYS_close_range, (unsigned)lo, ~0U, CLOSE_RANGE_CLOEXEC) == 0;
+        if (a > lo && syscall(SYS_close_range, (unsigned)lo, (unsigned)(a - 1),
+                              CLOSE_RANGE_CLOEXEC))
+            return false;
+        if (b >= INT_MAX) return true;
+        lo = b + 1;
+    }
+}
+
+// Call `fn` for each descriptor from want->closefds up that is open
+// without close-on-exec and not kept, found through /proc/self/fd.
+static void fds_leaked(const struct child_res *want, int exec_fd,
+                       void (*fn)(int fd, int flags, void *), void *arg) {
+    int dir = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir < 0) return;
+    char buf[4096];
+    long got;
+    while ((got = syscall(SYS_getdents64, dir, buf, sizeof(buf))) > 0) {
+        for (long off = 0; off < got; ) {
+            struct { uint64_t ino; int64_t off; unsigned short reclen; unsigned char type; char name[]; }
+                *d = (void *)(buf + off);
+            off += d->reclen;
+            char *end;
+            long fd = strtol(d->name, &end, 10);
+            if (*end || end == d->name || fd < want->closefds || fd == dir
+                || fd == want->keep_fd || fd == exec_fd)
+                continue;
+            struct list_hit h = {fd, false};
+            if (want->closefds_keep) list_walk(want->closefds_keep, INT_MAX, list_hit, &h);
+            int flags = fcntl((int)fd, F_GETFD);
+            if (!h.hit && flags >= 0 && !(flags & FD_CLOEXEC)) fn((int)fd, flags, arg);
+        }
+    }
+    close(dir);
+}
+
+static void fds_set_cloexec(int fd, int flags, void *arg) {
+    (void)arg;
+    fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+// Mark every descriptor `want` keeps from children close-on-exec in the
+// calling process, which is about to exec; `exec_fd` (fexecve) stays open.
+static void fds_cloexec(const struct child_res *want, int exec_fd) {
+    struct fds_keep k = {.n = 0};
+    if (want->closefds_keep) list_walk(want->closefds_keep, INT_MAX, fds_keep_add, &k);
+    if (want->keep_fd >= 0) fds_keep_add(want->keep_fd, want->keep_fd, &k);
+    if (exec_fd >= 0) fds_keep_add(exec_fd, exec_fd, &k);
+    if (k.full || !fds_cloexec_ranges(want->closefds, &k))
+        fds_leaked(want, exec_fd, fds_set_cloexec, NULL);
+}
+
+// Hash of the cgroup spec last set up, so the leaf is created and its
+// limits written once rather than on every spawn.
+static atomic_uint cgroup_ready = 0;
+
+static bool write_file(const char *path, const char *text) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = write(fd, text, strlen(text)) == (ssize_t)strlen(text);
+    close(fd);
+    return ok;
+}
+
+// Create the leaf named by `spec` and write its limits, enabling their
+// controllers in the parent as needed; leaves the directory in `dir`
+// (PATH_MAX). Limits that cannot be set (controller not delegated) are
+// skipped: placement still works.
+static bool cgroup_prepare(const char *spec, char *dir) {
+    size_t len = strcspn(spec, " \t");
+    memcpy(dir, spec, len);
+    dir[len] = '\0';
+    unsigned h = childenv_index_hash(spec) | 1;
+    if (atomic_load_explicit(&cgroup_ready, memory_order_relaxed) == h) return true;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return false;
+    char path[PATH_MAX + 32];
+    for (const char *p = spec + len; *(p += strspn(p, " \t")); ) {
+        char file[16], value[24];
+        size_t tl = strcspn(p, " \t");
+        if (cgroup_knob(p, tl, file, value)) {
+            const char *slash = strrchr(dir, '/');
+            snprintf(path, sizeof(path), "%.*s/cgroup.subtree_control",
+                     (int)(slash - dir), dir);
+            char enable[16];
+            snprintf(enable, sizeof(enable), "+%.*s", (int)strcspn(file, "."), file);
+            write_file(path, enable);
+            snprintf(path, sizeof(path), "%s/%s", dir, file);
+            write_file(path, value);
+        }
+        p += tl;
+    }
+    atomic_store_explicit(&cgroup_ready, h, memory_order_relaxed);
+    return true;
+}
+
+// Move process `pid` (0: the caller) into `dir`.
+static bool cgroup_enter(const char *dir, pid_t pid) {
+    char path[PATH_MAX + 16], num[16];
+    snprintf(path, sizeof(path), "%s/cgroup.procs", dir);
+    snprintf(num, sizeof(num), "%d", (int)pid);
+    return write_file(path, num);
+}
+
+// The caller's current cgroup as a directory on the cgroup2 mount that
+// holds `leaf`, into `out` (PATH_MAX).
+static bool cgroup_current(const char *leaf, char *out) {
+    char root[PATH_MAX], buf[4096];
+    struct statfs fs;
+    snprintf(root, sizeof(root), "%s", leaf);
+    // Strip components while the parent is still cgroup2: the mount point.
+    for (char *slash; (slash = strrchr(root, '/')) && slash != root; ) {
+        *slash = '\0';
+        if (statfs(root, &fs) < 0 || fs.f_type != CGROUP2_SUPER_MAGIC) { *slash = '/'; break; }
+    }
+    int fd = open("/proc/self/cgroup", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return false;
+    buf[n] = '\0';
+    char *rel = !strncmp(buf, "0::", 3) ? buf : strstr(buf, "\n0::");
+    if (!rel) return false;
+    rel += *rel == '\n' ? 4 : 3;
+    rel[strcspn(rel, "\n")] = '\0';
+    return (size_t)snprintf(out, PATH_MAX, "%s%s", root, strcmp(rel, "/") ? rel : "") < PATH_MAX;
+}
 
-#define _GNU_SOURCE
-#include <dlfcn.h>
-#include <errno.h>
-#include <spawn.h>
-#include <stdarg.h>
-#include <stdbool.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/types.h>
-#include <unistd.h>
+// Where res_switch() moved the calling process from, for moving it back.
+static __thread char cgroup_prev[PATH_MAX];
 
-extern char **environ;
+// Apply `want` to the calling task (its process, for the cgroup); returns
+// the previous value of every attribute it changed.
+static struct child_res res_switch(const struct child_res *want) {
+    struct child_res old = res_unset;
+    if (want->cgroup == cgroup_prev) {
+        cgroup_enter(cgroup_prev, 0);
+    } else if (want->cgroup) {
+        char dir[PATH_MAX];
+        if (cgroup_prepare(want->cgroup, dir) && cgroup_current(dir, cgroup_prev)
+            && strcmp(dir, cgroup_prev) && cgroup_enter(dir, 0))
+            old.cgroup = cgroup_prev;
+    }
+    if (want->nice != RES_UNSET) {
+        errno = 0;
+        int cur = getpriority(PRIO_PROCESS, 0);
+        if (!errno && cur != want->nice && setpriority(PRIO_PROCESS, 0, want->nice) == 0)
+            old.nice = cur;
+    }
+    if (want->ioprio != RES_UNSET) {
+        int cur = (int)syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+        if (cur >= 0 && cur != want->ioprio
+            && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, want->ioprio) == 0)
+            old.ioprio = cur;
+    }
+    if (want->sched != RES_UNSET) {
+        int cur = sched_getscheduler(0);
+        struct sched_param sp = {0};
+        if (cur >= 0 && cur != want->sched && sched_getparam(0, &sp) == 0) {
+            struct sched_param np = {.sched_priority = want->sched_prio};
+            if (sched_setscheduler(0, want->sched, &np) == 0) {
+                old.sched = cur;
+                old.sched_prio = sp.sched_priority;
+            }
+        }
+    }
+    if (want->has_cpus) {
+        cpu_set_t cur;
+        if (sched_getaffinity(0, sizeof(cur), &cur) == 0 && !CPU_EQUAL(&cur, &want->cpus)
+            && sched_setaffinity(0, sizeof(want->cpus), &want->cpus) == 0) {
+            old.cpus = cur;
+            old.has_cpus = true;
+        }
+    }
+    return old;
+}
 
-// Cached CHILD_ENV_RULES, captured before strip_host_environ() removes the
-// variable from environ. Set once in the library constructor and read-only
-// after main() starts, so no synchronization is needed.
-static char *cached_rules = NULL;
+// Before an exec hook's real call; res_switch() the result back if it fails.
+// `exec_fd` (fexecve) is never marked close-on-exec.
+static struct child_res child_res_enter(const struct policy_ref *ref, int exec_fd) {
+    if (exec_is_self) return res_unset;
+    struct child_res want = res_load(ref);
+    if (res_empty(&want)) return want;
+    struct child_res old = res_switch(&want);
+    if (want.closefds != RES_UNSET) fds_cloexec(&want, exec_fd);
+    return old;
+}
 
-// ---------- env builder ----------
+// Around posix_spawn: `later` holds what the spawn attributes could not
+// carry, closefds for the file actions and the rest for the pid after the
+// spawn.
+struct res_spawn {
+    struct child_res later;
+    posix_spawnattr_t attr;     // copy of the caller's, plus cgroup/scheduler
+    bool attr_copied;
+    posix_spawn_file_actions_t fa;
+    bool fa_made;
+    int cgroup_fd;
+    char cgroup_dir[PATH_MAX];
+};
 
-static char **copy_envp(char *const envp[]) {
-    int n = 0;
-    if (envp) for (char *const *e = envp; *e; ++e) n++;
-    char **out = malloc(sizeof(char *) * (n + 1));
-    if (!out) return NULL;
-    for (int i = 0; i < n; i++) {
-        out[i] = strdup(envp[i]);
-        if (!out[i]) { while (i--) free(out[i]); free(out); return NULL; }
-    }
-    out[n] = NULL;
-    return out;
+typedef int (*setcgroup_fn)(posix_spawnattr_t *, int);
+
+// A fresh `out` carrying everything the caller set in `attr` (NULL: the
+// defaults), copied through the public getters: posix_spawnattr_t is opaque
+// and may own memory, so it is never copied by value. Destroy `out` after.
+static bool spawnattr_copy(posix_spawnattr_t *out, const posix_spawnattr_t *attr) {
+    if (posix_spawnattr_init(out)) return false;
+    if (!attr) return true;
+    short flags;
+    sigset_t set;
+    pid_t pgroup;
+    int policy;
+    struct sched_param sp;
+    if (posix_spawnattr_getflags(attr, &flags) || posix_spawnattr_setflags(out, flags)
+        || posix_spawnattr_getsigmask(attr, &set) || posix_spawnattr_setsigmask(out, &set)
+        || posix_spawnattr_getsigdefault(attr, &set) || posix_spawnattr_setsigdefault(out, &set)
+        || posix_spawnattr_getpgroup(attr, &pgroup) || posix_spawnattr_setpgroup(out, pgroup)
+        || posix_spawnattr_getschedparam(attr, &sp) || posix_spawnattr_setschedparam(out, &sp)
+        || posix_spawnattr_getschedpolicy(attr, &policy)
+        || posix_spawnattr_setschedpolicy(out, policy)) {
+        posix_spawnattr_destroy(out);
+        return false;
+    }
+    return true;
 }
 
-static void free_envp(char **e) {
-    if (!e) return;
-    for (char **p = e; *p; ++p) free(*p);
-    free(e);
+// rs->attr, copied from `attr` on first use; NULL if that fails.
+static posix_spawnattr_t *res_spawn_attr(struct res_spawn *rs, const posix_spawnattr_t *attr) {
+    if (!rs->attr_copied) rs->attr_copied = spawnattr_copy(&rs->attr, attr);
+    return rs->attr_copied ? &rs->attr : NULL;
+}
+
+// Place the child in `rs->cgroup_dir` at clone time through the spawn
+// attributes; false if this glibc cannot (or the caller already chose a
+// cgroup).
+static bool res_spawn_cgroup(struct res_spawn *rs, const posix_spawnattr_t *attr) {
+    static setcgroup_fn setcgroup;
+    static bool looked_up;
+    if (!looked_up) {
+        setcgroup = (setcgroup_fn)dlsym(RTLD_DEFAULT, "posix_spawnattr_setcgroup_np");
+        looked_up = true;
+    }
+    short flags = 0;
+    if (!setcgroup || (attr && (posix_spawnattr_getflags(attr, &flags)
+                                || (flags & POSIX_SPAWN_SETCGROUP))))
+        return false;
+    rs->cgroup_fd = open(rs->cgroup_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rs->cgroup_fd < 0) return false;
+    posix_spawnattr_t *a = res_spawn_attr(rs, attr);
+    if (!a || posix_spawnattr_getflags(a, &flags) || setcgroup(a, rs->cgroup_fd)
+        || posix_spawnattr_setflags(a, flags | POSIX_SPAWN_SETCGROUP)) {
+        close(rs->cgroup_fd);
+        rs->cgroup_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+// SCHED_OTHER through the spawn attributes. Not when the caller set its
+// own scheduler, and not from a SCHED_IDLE thread: leaving SCHED_IDLE can
+// need privilege, and posix_spawn() would then fail instead of the setting.
+static bool res_spawn_sched(struct res_spawn *rs, const posix_spawnattr_t *attr, int sched) {
+    short flags = 0;
+    if (sched != SCHED_OTHER || sched_getscheduler(0) == SCHED_IDLE
+        || (attr && (posix_spawnattr_getflags(attr, &flags)
+                     || (flags & POSIX_SPAWN_SETSCHEDULER))))
+        return false;
+    struct sched_param sp = {0};
+    posix_spawnattr_t *a = res_spawn_attr(rs, attr);
+    return a && !posix_spawnattr_getflags(a, &flags)
+        && !posix_spawnattr_setschedpolicy(a, SCHED_OTHER)
+        && !posix_spawnattr_setschedparam(a, &sp)
+        && !posix_spawnattr_setflags(a, flags | POSIX_SPAWN_SETSCHEDULER);
+}
+
+// Returns the attributes to spawn with, under the policy `ref` holds. A
+// `self` re-exec keeps the host's own profile.
+static const posix_spawnattr_t *res_spawn_enter(struct res_spawn *rs, const struct policy_ref *ref,
+                                                const posix_spawnattr_t *attr, bool self) {
+    struct child_res now = self ? res_unset : res_load(ref);
+    rs->later = res_unset;
+    rs->attr_copied = false;
+    rs->fa_made = false;
+    rs->cgroup_fd = -1;
+    if (res_empty(&now)) return attr;
+    if (now.cgroup && cgroup_prepare(now.cgroup, rs->cgroup_dir)
+        && !res_spawn_cgroup(rs, attr))
+        rs->later.cgroup = rs->cgroup_dir;
+    if (now.sched != RES_UNSET && !res_spawn_sched(rs, attr, now.sched)) {
+        rs->later.sched = now.sched;
+        rs->later.sched_prio = now.sched_prio;
+    }
+    rs->later.nice = now.nice;
+    rs->later.ioprio = now.ioprio;
+    rs->later.has_cpus = now.has_cpus;
+    rs->later.cpus = now.cpus;
+    rs->later.closefds = now.closefds;
+    rs->later.closefds_keep = now.closefds_keep;
+    rs->later.keep_fd = now.keep_fd;
+    return rs->attr_copied ? &rs->attr : attr;
+}
+
+static void fds_add_close(int fd, int flags, void *arg) {
+    (void)flags;
+    posix_spawn_file_actions_addclose(arg, fd);
+}
+
+// closefds for a posix_spawn child: a close action per leaked descriptor,
+// from a read-only walk of the host's table, in file actions of our own.
+// The caller's cannot be copied or extended without changing them, so a
+// spawn that brings its own skips closefds. Returns the file actions to
+// spawn with.
+static const posix_spawn_file_actions_t *res_spawn_fds(struct res_spawn *rs,
+                                                       const posix_spawn_file_actions_t *fa) {
+    if (rs->later.closefds == RES_UNSET) return fa;
+    if (fa) {
+        skip_once(SKIP_CLOSEFDS, "closefds skipped: posix_spawn with file actions");
+        return fa;
+    }
+    if (posix_spawn_file_actions_init(&rs->fa)) return fa;
+    rs->fa_made = true;
+    fds_leaked(&rs->later, -1, fds_add_close, &rs->fa);
+    return &rs->fa;
+}
+
+// After the spawn: what the spawn attributes did not carry, on the new pid.
+static void res_spawn_leave(struct res_spawn *rs, pid_t pid) {
+    if (rs->attr_copied) posix_spawnattr_destroy(&rs->attr);
+    if (rs->fa_made) posix_spawn_file_actions_destroy(&rs->fa);
+    if (rs->cgroup_fd >= 0) close(rs->cgroup_fd);
+    if (pid <= 0) return;
+    if (rs->later.cgroup) cgroup_enter(rs->later.cgroup, pid);
+    if (rs->later.nice != RES_UNSET) setpriority(PRIO_PROCESS, (id_t)pid, rs->later.nice);
+    if (rs->later.ioprio != RES_UNSET)
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, rs->later.ioprio);
+    if (rs->later.sched != RES_UNSET) {
+        struct sched_param sp = {.sched_priority = rs->later.sched_prio};
+        sched_setscheduler(pid, rs->later.sched, &sp);
+    }
+    if (rs->later.has_cpus) sched_setaffinity(pid, sizeof(rs->later.cpus), &rs->later.cpus);
 }
 
-// Apply CHILD_ENV_RULES on top of `envp`, returning a freshly allocated array.
-// Returns NULL on OOM. If no rules are set, copies envp verbatim.
+// ---------- child telemetry ----------
+
+// CHILD_ENV_CHILD_STATS=1 records what the children started through
+// posix_spawn()/posix_spawnp() cost, per executable (basename): how many,
+// wall lifetime, peak RSS (VmHWM) and CPU time. The `children` socket
+// command reports the table; with a path instead of 1, the host (depth 0
+// only) also writes it there when it exits. It shows which helpers deserve
+// an allocator or resource profile of their own.
 //
-// Reads from `cached_rules` (captured in the constructor) so that the rule
-// list survives even after strip_host_environ() removes CHILD_ENV_RULES from
-// the host environ. Falls back to getenv() if the constructor never ran
-// (e.g., static link or interposition order edge case).
-static char **build_child_env(char *const envp[]) {
-    char *raw = cached_rules ? cached_rules : getenv("CHILD_ENV_RULES");
-    if (!raw || !*raw) return copy_envp(envp);
+// The children are watched by the governor's helper thread through pidfds.
+// Every TEL_SAMPLE_MS it reads VmHWM and CPU time from /proc/<pid>, and
+// keeps a sample only if the pidfd still shows the child alive afterwards,
+// so a recycled pid is never read. When the child exits, its final CPU time
+// comes from waitid(P_PIDFD, WNOWAIT) if the host has not reaped it yet;
+// WNOWAIT leaves the status to the host's own waitpid(). A child that lives
+// shorter than one sample period may show a peak of 0.
 
-    char *rules_str = strdup(raw);
-    if (!rules_str) return NULL;
+#define TEL_EXES      64
+#define TEL_SAMPLE_MS 200
 
-    int max_rules = 1;
-    for (char *p = rules_str; *p; p++) if (*p == ',') max_rules++;
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
 
-    typedef struct { char *name, *value; } Rule;
-    Rule *rules = calloc((size_t)max_rules, sizeof(Rule));
-    if (!rules) { free(rules_str); return NULL; }
+struct tel_exe {
+    char name[64];
+    unsigned long spawned, exited;
+    unsigned long life_ms, life_max_ms;
+    unsigned long hwm_kb, hwm_max_kb;   // sum over exited children, and peak
+    unsigned long cpu_ms;
+};
 
-    int rc = 0;
-    char *str_ptr = rules_str, *tok;
-    while ((tok = strsep(&str_ptr, ",")) != NULL) {
-        if (!*tok || *tok == '=') continue;
-        char *eq = strchr(tok, '=');
-        if (eq) { *eq = '\0'; rules[rc].value = eq + 1; }
-        rules[rc].name = tok;
-        rc++;
+// Per tracked child.
+struct tel_child {
+    int exe;                    // tel_exes index, -1: not recorded
+    pid_t pid;
+    long start_ms;
+    long hwm_kb;
+    unsigned long cpu_ticks;
+};
+
+static bool tel_on;
+static char *tel_file;
+static pthread_mutex_t tel_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tel_exe tel_exes[TEL_EXES];
+static int tel_nexes;
+
+static long tel_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void tel_begin(struct tel_child *t, const char *file, pid_t pid) {
+    t->exe = -1;
+    t->pid = pid;
+    t->start_ms = tel_now_ms();
+    t->hwm_kb = 0;
+    t->cpu_ticks = 0;
+    if (!tel_on || !file) return;
+    const char *base = strrchr(file, '/');
+    base = base ? base + 1 : file;
+    pthread_mutex_lock(&tel_lock);
+    for (int i = 0; i < tel_nexes && t->exe < 0; i++)
+        if (!strncmp(tel_exes[i].name, base, sizeof(tel_exes[i].name) - 1)) t->exe = i;
+    if (t->exe < 0 && tel_nexes < TEL_EXES) {
+        t->exe = tel_nexes++;
+        snprintf(tel_exes[t->exe].name, sizeof(tel_exes[t->exe].name), "%s", base);
     }
+    if (t->exe >= 0) tel_exes[t->exe].spawned++;
+    pthread_mutex_unlock(&tel_lock);
+}
 
-    int n = 0;
-    if (envp) for (char *const *e = envp; *e; ++e) n++;
+static bool pidfd_exited(int pidfd) {
+    struct pollfd p = {pidfd, POLLIN, 0};
+    return poll(&p, 1, 0) != 0;
+}
 
-    char **out = malloc(sizeof(char *) * ((size_t)n + (size_t)rc + 1));
-    if (!out) { free(rules_str); free(rules); return NULL; }
+static void tel_sample(struct tel_child *t, int pidfd) {
+    char path[32], line[512];
+    long hwm = -1;
+    unsigned long ut = 0, st = 0;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)t->pid);
+    FILE *f = fopen(path, "re");
+    if (!f) return;
+    while (hwm < 0 && fgets(line, sizeof(line), f))
+        if (sscanf(line, "VmHWM: %ld kB", &hwm) != 1) hwm = -1;
+    fclose(f);
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)t->pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t n = read(fd, line, sizeof(line) - 1);
+        close(fd);
+        line[n > 0 ? n : 0] = '\0';
+        // utime and stime are fields 14 and 15; the comm before may hold spaces.
+        char *p = strrchr(line, ')');
+        if (p) sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &ut, &st);
+    }
+    if (pidfd_exited(pidfd)) return;
+    if (hwm > t->hwm_kb) t->hwm_kb = hwm;
+    if (ut + st > t->cpu_ticks) t->cpu_ticks = ut + st;
+}
 
-    int oi = 0;
-    if (envp) for (char *const *e = envp; *e; ++e) {
-        char *eq = strchr(*e, '=');
-        size_t name_len = eq ? (size_t)(eq - *e) : strlen(*e);
-        bool ruled = false;
-        for (int i = 0; i < rc; i++) {
-            if (strlen(rules[i].name) == name_len
-                && !strncmp(*e, rules[i].name, name_len)) { ruled = true; break; }
+static void tel_exit(struct tel_child *t, int pidfd) {
+    if (t->exe < 0) return;
+    unsigned long life = (unsigned long)(tel_now_ms() - t->start_ms), ticks = t->cpu_ticks;
+    siginfo_t si = {0};
+    if (waitid(P_PIDFD, (id_t)pidfd, &si, WEXITED | WNOWAIT | WNOHANG) == 0 && si.si_pid
+        && (unsigned long)(si.si_utime + si.si_stime) > ticks)
+        ticks = (unsigned long)(si.si_utime + si.si_stime);
+    unsigned long cpu = ticks * 1000 / (unsigned long)sysconf(_SC_CLK_TCK);
+    pthread_mutex_lock(&tel_lock);
+    struct tel_exe *e = &tel_exes[t->exe];
+    e->exited++;
+    e->life_ms += life;
+    if (life > e->life_max_ms) e->life_max_ms = life;
+    e->hwm_kb += (unsigned long)t->hwm_kb;
+    if ((unsigned long)t->hwm_kb > e->hwm_max_kb) e->hwm_max_kb = (unsigned long)t->hwm_kb;
+    e->cpu_ms += cpu;
+    pthread_mutex_unlock(&tel_lock);
+}
+
+// Averages are over exited children.
+static void tel_report(int fd) {
+    pthread_mutex_lock(&tel_lock);
+    dprintf(fd, "ok children %d\n", tel_nexes);
+    dprintf(fd, "name spawned exited life_avg_ms life_max_ms hwm_avg_kb hwm_max_kb cpu_ms\n");
+    for (int i = 0; i < tel_nexes; i++) {
+        const struct tel_exe *e = &tel_exes[i];
+        unsigned long n = e->exited ? e->exited : 1;
+        dprintf(fd, "%s %lu %lu %lu %lu %lu %lu %lu\n", e->name, e->spawned, e->exited,
+                e->life_ms / n, e->life_max_ms, e->hwm_kb / n, e->hwm_max_kb, e->cpu_ms);
+    }
+    pthread_mutex_unlock(&tel_lock);
+}
+
+// The table would be the parent's, not ours.
+static void tel_atfork_child(void) {
+    pthread_mutex_init(&tel_lock, NULL);
+    tel_nexes = 0;
+    free(tel_file);
+    tel_file = NULL;
+}
+
+static void tel_init(void) {
+    const char *opt = getenv("CHILD_ENV_CHILD_STATS");
+    if (!opt || (strcmp(opt, "1") && *opt != '/')) return;
+    tel_on = true;
+    if (*opt == '/' && !getenv("CHILDENV_DEPTH")) tel_file = strdup(opt);
+    pthread_atfork(NULL, NULL, tel_atfork_child);
+}
+
+__attribute__((destructor))
+static void tel_fini(void) {
+    if (!tel_file) return;
+    int fd = open(tel_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    tel_report(fd);
+    close(fd);
+}
+
+// ---------- spawn governor ----------
+
+// A host that opens a folder of thousands of files can start dozens of
+// thumbnailers at once, each with its own RSS spike. A policy-file line
+//
+//   throttle *-thumbnailer max=4 psi=20 timeout=5000
+//
+// makes posix_spawn()/posix_spawnp() of a matching program (fnmatch() on
+// the basename) wait while `max` of the children it started are still
+// alive, or while the memory PSI "some avg10" is above `psi` percent. A
+// spawn never waits longer than `timeout` ms (default 5000); after that it
+// goes ahead anyway, so a caller that waits for its own children cannot
+// deadlock. Each started child is tracked by a pidfd that a helper thread
+// polls; the pidfd turns readable when the child exits, reaped or not, so
+// the caller's own waitpid() is left alone. The first matching line wins.
+//
+// fork()+exec children are not counted: the parent never sees their exec.
+// The same thread watches the children child telemetry records.
+//
+// gov_lock only guards the counts and the child table: PSI and the /proc
+// telemetry reads happen with it dropped, into locals that are published
+// under it afterwards. A spawn enters the governor before it builds the
+// child's environment, so it holds no policy reference while it waits.
+
+#define GOV_SLOTS        16
+#define GOV_PATTERN_MAX  64
+#define GOV_PSI_POLL_MS  100
+
+struct gov_spec {
+    char pattern[GOV_PATTERN_MAX];
+    int max;
+    int psi;                    // percent; 0: not checked
+    int timeout_ms;
+};
+
+struct gov_slot {
+    char pattern[GOV_PATTERN_MAX];
+    int live;                   // children started and not yet exited
+};
+
+struct gov_child {
+    int pidfd;
+    int slot;                   // -1: only recorded by telemetry
+    struct tel_child tel;
+};
+
+static pthread_mutex_t gov_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gov_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t gov_once = PTHREAD_ONCE_INIT;
+static struct gov_slot gov_slots[GOV_SLOTS];
+static int gov_nslots;
+static struct gov_child *gov_children;
+static size_t gov_nchildren, gov_cap;
+static int gov_pipe[2] = {-1, -1};     // wakes the helper for new pidfds
+static bool gov_running;
+
+static atomic_ulong gov_held = 0;       // spawns that had to wait
+static atomic_ulong gov_timeouts = 0;   // ... and went ahead at the timeout
+static atomic_ulong gov_wait_ms = 0;    // total time held
+static atomic_ulong gov_wait_max_ms = 0;
+
+// "<pattern> [max=N] [psi=P] [timeout=MS]"; at least one of max and psi.
+static bool gov_parse(const char *arg, struct gov_spec *g) {
+    size_t len = strcspn(arg, " \t");
+    if (!len || len >= sizeof(g->pattern)) return false;
+    memcpy(g->pattern, arg, len);
+    g->pattern[len] = '\0';
+    g->max = INT_MAX;
+    g->psi = 0;
+    g->timeout_ms = 5000;
+    for (const char *p = arg + len; *(p += strspn(p, " \t")); ) {
+        size_t tl = strcspn(p, " \t");
+        char tok[32];
+        if (tl >= sizeof(tok)) return false;
+        memcpy(tok, p, tl);
+        tok[tl] = '\0';
+        if (!strncmp(tok, "max=", 4)) {
+            if (!res_parse_int(tok + 4, 1, 4096, &g->max)) return false;
+        } else if (!strncmp(tok, "psi=", 4)) {
+            if (!res_parse_int(tok + 4, 1, 100, &g->psi)) return false;
+        } else if (!strncmp(tok, "timeout=", 8)) {
+            if (!res_parse_int(tok + 8, 0, 600000, &g->timeout_ms)) return false;
+        } else {
+            return false;
         }
-        if (!ruled && !(out[oi] = strdup(*e))) goto oom;
-        if (!ruled) oi++;
+        p += tl;
     }
-    for (int i = 0; i < rc; i++) {
-        if (!rules[i].value) continue;
-        size_t len = strlen(rules[i].name) + strlen(rules[i].value) + 2;
-        if (!(out[oi] = malloc(len))) goto oom;
-        snprintf(out[oi++], len, "%s=%s", rules[i].name, rules[i].value);
+    return g->max != INT_MAX || g->psi;
+}
+
+static bool gov_valid(const char *arg) {
+    struct gov_spec g;
+    return gov_parse(arg, &g);
+}
+
+// The throttle line for spawning `file` from the policy `ref` holds, if any.
+static bool gov_match(const struct policy_ref *ref, const char *file, struct gov_spec *g) {
+    const struct policy *pol = ref ? ref->pol : NULL;
+    if (!pol || !file) return false;
+    const char *base = strrchr(file, '/');
+    base = base ? base + 1 : file;
+    int depth = self_depth + 1;
+    for (uint32_t i = 0; i < pol->nrules; i++) {
+        const struct policy_rule *r = &pol->rules[i];
+        if (r->depth == depth && (r->flags & POLICY_RULE_RESOURCE)
+            && !strcmp(POLICY_STR(pol, r->name), "throttle")
+            && gov_parse(POLICY_STR(pol, r->value), g)
+            && fnmatch(g->pattern, base, 0) == 0)
+            return true;
     }
-    out[oi] = NULL;
-    free(rules_str); free(rules);
-    return out;
+    return false;
+}
 
-oom:
-    while (oi--) free(out[oi]);
-    free(out); free(rules_str); free(rules);
-    return NULL;
+// Memory PSI "some avg10" in percent, or 0 if unavailable.
+static double gov_psi(void) {
+    char buf[256];
+    int fd = open("/proc/pressure/memory", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    double avg = 0;
+    if (n > 0) {
+        buf[n] = '\0';
+        sscanf(buf, "some avg10=%lf", &avg);
+    }
+    return avg;
+}
+
+static void *gov_thread(void *unused) {
+    (void)unused;
+    struct pollfd *pfd = NULL;
+    struct gov_child *local = NULL;     // copies sampled, then those that exited
+    size_t cap = 0;
+    long next_sample = 0;
+    for (;;) {
+        pthread_mutex_lock(&gov_lock);
+        size_t n = gov_nchildren;
+        if (n + 1 > cap) {
+            struct pollfd *grown = realloc(pfd, sizeof(*pfd) * (n + 1));
+            if (grown) pfd = grown;
+            struct gov_child *more = grown ? realloc(local, sizeof(*local) * (n + 1)) : NULL;
+            if (!more) {
+                pthread_mutex_unlock(&gov_lock);
+                usleep(GOV_PSI_POLL_MS * 1000);
+                continue;
+            }
+            local = more;
+            cap = n + 1;
+        }
+        pfd[0] = (struct pollfd){gov_pipe[0], POLLIN, 0};
+        for (size_t i = 0; i < n; i++) {
+            pfd[i + 1] = (struct pollfd){gov_children[i].pidfd, POLLIN, 0};
+            local[i] = gov_children[i];
+        }
+        pthread_mutex_unlock(&gov_lock);
+        // Only this thread removes entries, so the first n are still the
+        // ones copied when the samples are published.
+        bool sampled = false;
+        long now = tel_now_ms();
+        for (size_t i = 0; i < n; i++) {
+            if (local[i].tel.exe < 0) continue;
+            if (now >= next_sample) tel_sample(&local[i].tel, local[i].pidfd);
+            sampled = true;
+        }
+        if (sampled && now >= next_sample) {
+            pthread_mutex_lock(&gov_lock);
+            for (size_t i = 0; i < n; i++) gov_children[i].tel = local[i].tel;
+            pthread_mutex_unlock(&gov_lock);
+        }
+        if (now >= next_sample) next_sample = now + TEL_SAMPLE_MS;
+        int timeout = sampled ? (int)(next_sample - now) : -1;
+        if (poll(pfd, n + 1, timeout) < 0) {
+            if (errno == EINTR) continue;
+            pthread_mutex_lock(&gov_lock);
+            gov_running = false;
+            pthread_mutex_unlock(&gov_lock);
+            free(pfd);
+            free(local);
+            return NULL;
+        }
+        if (pfd[0].revents & POLLIN) {
+            char drain[64];
+            while (read(gov_pipe[0], drain, sizeof(drain)) > 0) {}
+        }
+        // The descriptors polled are still the ones in the table. Exited
+        // children leave it under the lock; their final reading and the
+        // close happen after.
+        size_t gone = 0;
+        pthread_mutex_lock(&gov_lock);
+        for (size_t i = 1; i <= n; i++) {
+            if (!pfd[i].revents) continue;
+            for (size_t j = 0; j < gov_nchildren; j++) {
+                if (gov_children[j].pidfd != pfd[i].fd) continue;
+                if (gov_children[j].slot >= 0) gov_slots[gov_children[j].slot].live--;
+                local[gone++] = gov_children[j];
+                gov_children[j] = gov_children[--gov_nchildren];
+                break;
+            }
+        }
+        pthread_cond_broadcast(&gov_cond);
+        pthread_mutex_unlock(&gov_lock);
+        for (size_t i = 0; i < gone; i++) {
+            tel_exit(&local[i].tel, local[i].pidfd);
+            close(local[i].pidfd);
+        }
+    }
+}
+
+// The helper thread does not survive fork(); neither do the children it
+// tracked, which are the parent's.
+static void gov_atfork_child(void) {
+    pthread_mutex_init(&gov_lock, NULL);
+    pthread_cond_init(&gov_cond, NULL);
+    for (size_t i = 0; i < gov_nchildren; i++) close(gov_children[i].pidfd);
+    for (int i = 0; i < gov_nslots; i++) gov_slots[i].live = 0;
+    gov_nchildren = 0;
+    if (gov_pipe[0] >= 0) { close(gov_pipe[0]); close(gov_pipe[1]); }
+    gov_pipe[0] = gov_pipe[1] = -1;
+    gov_running = false;
+}
+
+static void gov_register(void) {
+    pthread_atfork(NULL, NULL, gov_atfork_child);
+}
+
+// With gov_lock held.
+static bool gov_start(void) {
+    if (gov_running) return true;
+    pthread_once(&gov_once, gov_register);
+    if (gov_pipe[0] < 0 && pipe2(gov_pipe, O_CLOEXEC | O_NONBLOCK) < 0) return false;
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t th;
+    gov_running = pthread_create(&th, NULL, gov_thread, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (gov_running) pthread_detach(th);
+    return gov_running;
+}
+
+static int gov_slot(const char *pattern) {
+    for (int i = 0; i < gov_nslots; i++)
+        if (!strcmp(gov_slots[i].pattern, pattern)) return i;
+    if (gov_nslots == GOV_SLOTS) return -1;
+    strcpy(gov_slots[gov_nslots].pattern, pattern);
+    gov_slots[gov_nslots].live = 0;
+    return gov_nslots++;
+}
+
+// Before spawning `file`, with no policy reference held: wait for room and
+// count the child in. Returns the slot to hand to gov_leave(), or -1 if
+// `file` is not throttled.
+static int gov_enter(const char *file) {
+    struct gov_spec g;
+    struct policy_ref *ref = policy_enter();
+    bool throttled = gov_match(ref, file, &g);
+    policy_leave(ref);
+    if (!throttled) return -1;
+    pthread_mutex_lock(&gov_lock);
+    int slot = gov_slot(g.pattern);
+    if (slot < 0) { pthread_mutex_unlock(&gov_lock); return -1; }
+    long start = tel_now_ms(), waited = 0;
+    bool held = false;
+    for (;;) {
+        if (gov_slots[slot].live < g.max) {
+            if (!g.psi) break;
+            pthread_mutex_unlock(&gov_lock);
+            double psi = gov_psi();
+            pthread_mutex_lock(&gov_lock);
+            if (psi <= g.psi && gov_slots[slot].live < g.max) break;
+        }
+        if (!held) { held = true; atomic_fetch_add(&gov_held, 1); }
+        if ((waited = tel_now_ms() - start) >= g.timeout_ms) {
+            atomic_fetch_add(&gov_timeouts, 1);
+            break;
+        }
+        long wait = g.timeout_ms - waited;
+        if (g.psi && wait > GOV_PSI_POLL_MS) wait = GOV_PSI_POLL_MS;
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec += wait / 1000;
+        until.tv_nsec += wait % 1000 * 1000000;
+        if (until.tv_nsec >= 1000000000) { until.tv_sec++; until.tv_nsec -= 1000000000; }
+        pthread_cond_clockwait(&gov_cond, &gov_lock, CLOCK_MONOTONIC, &until);
+    }
+    gov_slots[slot].live++;
+    pthread_mutex_unlock(&gov_lock);
+    if (held) {
+        unsigned long ms = (unsigned long)(tel_now_ms() - start);
+        atomic_fetch_add(&gov_wait_ms, ms);
+        unsigned long max = atomic_load(&gov_wait_max_ms);
+        while (ms > max && !atomic_compare_exchange_weak(&gov_wait_max_ms, &max, ms)) {}
+    }
+    return slot;
+}
+
+// After spawning `file`: track `pid`, or give the place back if there is
+// none.
+static void gov_leave(int slot, const char *file, pid_t pid) {
+    if (slot < 0 && (!tel_on || pid <= 0)) return;
+    int fd = pid > 0 ? (int)syscall(SYS_pidfd_open, pid, 0) : -1;
+    struct tel_child tel;
+    if (fd >= 0) tel_begin(&tel, file, pid);
+    pthread_mutex_lock(&gov_lock);
+    bool tracked = false;
+    if (fd >= 0 && gov_start()) {
+        if (gov_nchildren == gov_cap) {
+            size_t cap = gov_cap ? gov_cap * 2 : 16;
+            struct gov_child *grown = realloc(gov_children, sizeof(*grown) * cap);
+            if (grown) { gov_children = grown; gov_cap = cap; }
+        }
+        if (gov_nchildren < gov_cap) {
+            struct gov_child *c = &gov_children[gov_nchildren++];
+            c->pidfd = fd;
+            c->slot = slot;
+            c->tel = tel;
+            tracked = true;
+            if (write(gov_pipe[1], "", 1) < 0) {}
+        }
+    }
+    if (!tracked) {
+        if (fd >= 0) close(fd);
+        if (slot >= 0) gov_slots[slot].live--;
+        pthread_cond_broadcast(&gov_cond);
+    }
+    pthread_mutex_unlock(&gov_lock);
+}
+
+// posix_spawn or posix_spawnp (`search`, through the PATH cache) of an
+// already prepared envp, with the child memory policy and, unless it is a
+// `self` re-exec, the resource profile. `slot` is what gov_enter() gave
+// before the envp was prepared; it is handed back here.
+static int spawn_prepared(pid_t *pid, const char *file,
+                          const posix_spawn_file_actions_t *fa,
+                          const posix_spawnattr_t *attr, char *const argv[],
+                          char *const envp[], spawn_fn real, bool search,
+                          const struct policy_ref *ref, bool self, int slot) {
+    pid_t child = -1;
+    struct res_spawn rs;
+    attr = res_spawn_enter(&rs, ref, attr, self);
+    struct shim sh = {{0}, 0};
+    shim_mm(&sh);
+    fa = res_spawn_fds(&rs, fa);
+    int r = shim_spawn(&sh, &child, file, fa, attr, argv, envp, search);
+    if (r < 0)
+        r = search ? spawn_path_cached(&child, file, fa, attr, argv, envp, real)
+                   : real(&child, file, fa, attr, argv, envp);
+    res_spawn_leave(&rs, r ? -1 : child);
+    gov_leave(slot, file, r ? -1 : child);
+    if (!r && pid) *pid = child;
+    return r;
+}
+
+// ---------- allocator purge control ----------
+
+// Long-running hosts keep freed memory cached in their allocator. With
+// CHILD_ENV_PURGE_SIGNAL=<USR1|USR2|number> and/or CHILD_ENV_PURGE_SOCKET=1 a
+// control thread waits for a purge request, calls the release primitive of
+// the allocator detected here in the constructor, and reports how much the
+// resident set shrank: as "ok <allocator> <bytes>" on the socket
+// ($XDG_RUNTIME_DIR/libchildenv/<pid>.sock, which also answers "info"), and
+// in the "stats" counters for the signal, so the host's stderr is left alone.
+// The signal handler only writes to a pipe; the purge itself never runs in
+// signal context. The socket is non-blocking: the thread accepts up to
+// PURGE_CONNS clients at a time and polls them along with everything else,
+// closing any that has not sent its command within PURGE_CONN_MS, so a slow
+// client cannot hold up the idle and PSI work.
+//
+// The same thread can purge on its own, so hosts can keep throughput-friendly
+// allocator settings and still give memory back when it matters:
+// CHILD_ENV_PURGE_PSI=<ms> registers a /proc/pressure/memory trigger for that
+// much "some" stall per 2 s window (the finest window unprivileged users may
+// set), and CHILD_ENV_PURGE_IDLE=<seconds> purges once per idle stretch in
+// which the process used under 1% CPU. With only the PSI trigger the thread
+// sleeps in poll() until the kernel reports pressure: no timer, no wakeups.
+//
+// CHILD_ENV_HEAP_SAMPLE=<seconds> tells leaks from fragmentation. Every
+// interval the thread records the allocator's own counters, bytes handed out
+// to the program ("allocated") and bytes it holds for them ("heap"), next to
+// the resident set, in a ring of the last HEAP_RING samples. The socket's
+// "heap" command fits a slope to each: allocated growing is the program
+// leaking; heap or RSS growing while allocated stays flat is the allocator
+// fragmenting or caching, which a purge or another allocator fixes.
+//
+// CHILD_ENV_RECLAIM_IDLE=<seconds>[:pageout][:anon] works without the
+// allocator's help: after a period with no exec/spawn and under 1% CPU the
+// thread reads /proc/self/smaps and applies MADV_COLD (or MADV_PAGEOUT) to
+// the RECLAIM_MAPPINGS largest resident allocator mappings, so a host left
+// open all day drifts to swap/zram first. Those are the brk heap and named
+// anonymous regions that are not stacks; `anon` opts in unnamed anonymous
+// mappings too, which JIT code caches and GC heaps also live in, still
+// without thread stacks. Like the idle purge it runs once per
+// idle stretch; "stats" on the socket reports runs, bytes advised and the
+// resident set drop.
+
+enum purge_kind { PURGE_GLIBC, PURGE_MIMALLOC, PURGE_JEMALLOC, PURGE_TCMALLOC };
+
+static const char *const purge_names[] = {"glibc", "mimalloc", "jemalloc", "tcmalloc"};
+static enum purge_kind purge_kind = PURGE_GLIBC;
+static void *purge_fn;
+static int purge_pipe[2] = {-1, -1};
+static int purge_sock = -1;
+static int purge_psi = -1;
+static int purge_idle_sec = 0;
+static char *purge_sock_path;
+static pid_t purge_owner;
+static atomic_ulong purge_auto_count = 0;
+static atomic_ulong purge_auto_bytes = 0;
+static atomic_ulong purge_signal_count = 0;
+static atomic_ulong purge_signal_bytes = 0;
+
+#define PURGE_CONNS   4
+#define PURGE_CONN_MS 1000
+
+struct purge_conn {
+    int fd;                     // -1: free
+    long deadline;              // CLOCK_MONOTONIC ms
+    size_t len;
+    char cmd[32];
+};
+
+#define HEAP_RING 256
+
+struct heap_sample {
+    long t_ms;                  // since the first sample
+    long allocated;             // -1: the allocator does not say
+    long heap;
+    long rss;
+};
+
+static struct heap_sample heap_ring[HEAP_RING];
+static unsigned long heap_count;
+static long heap_interval_ms = 0;
+static long heap_start_ms;
+static void *heap_fn;
+
+#define RECLAIM_MAPPINGS 8
+#define RECLAIM_MIN_BYTES (1L << 20)
+
+static int reclaim_idle_sec = 0;
+static int reclaim_advice = MADV_COLD;
+static bool reclaim_anon = false;
+static atomic_ulong reclaim_runs = 0;
+static atomic_ulong reclaim_advised = 0;
+static atomic_ulong reclaim_dropped = 0;
+
+static void *allocator_sym(const char *name) {
+#ifdef CHILDENV_MALLOC_MUX
+    if (mux_handle) {
+        void *sym = dlsym(mux_handle, name);
+        if (sym) return sym;
+    }
+#endif
+    return dlsym(RTLD_DEFAULT, name);
+}
+
+static void purge_detect(void) {
+    static const struct { enum purge_kind kind; const char *sym; } probes[] = {
+        {PURGE_MIMALLOC, "mi_collect"},
+        {PURGE_JEMALLOC, "mallctl"},
+        {PURGE_TCMALLOC, "MallocExtension_ReleaseFreeMemory"},
+        {PURGE_GLIBC, "malloc_trim"},
+    };
+    for (size_t i = 0; i < sizeof(probes) / sizeof(*probes); i++)
+        if ((purge_fn = allocator_sym(probes[i].sym))) {
+            purge_kind = probes[i].kind;
+            return;
+        }
+}
+
+static long rss_bytes(void) {
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    long size, resident;
+    if (n <= 0) return 0;
+    buf[n] = '\0';
+    if (sscanf(buf, "%ld %ld", &size, &resident) != 2) return 0;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Release cached memory; returns the drop in resident bytes.
+static long purge_now(void) {
+    if (!purge_fn) return 0;
+    long before = rss_bytes();
+    switch (purge_kind) {
+    case PURGE_MIMALLOC:
+        ((void (*)(bool))purge_fn)(true);
+        break;
+    case PURGE_JEMALLOC:        // arena.<MALLCTL_ARENAS_ALL>.purge
+        ((int (*)(const char *, void *, size_t *, void *, size_t))purge_fn)(
+            "arena.4096.purge", NULL, NULL, NULL, 0);
+        break;
+    case PURGE_TCMALLOC:
+        ((void (*)(void))purge_fn)();
+        break;
+    case PURGE_GLIBC:
+        ((int (*)(size_t))purge_fn)(0);
+        break;
+    }
+    long after = rss_bytes();
+    return before > after ? before - after : 0;
+}
+
+static void heap_detect(void) {
+    static const char *const syms[] = {
+        [PURGE_GLIBC] = "mallinfo2",
+        [PURGE_MIMALLOC] = "mi_process_info",
+        [PURGE_JEMALLOC] = "mallctl",
+        [PURGE_TCMALLOC] = "MallocExtension_GetNumericProperty",
+    };
+    heap_fn = allocator_sym(syms[purge_kind]);
+}
+
+static long jemalloc_stat(const char *name) {
+    int (*mallctl)(const char *, void *, size_t *, void *, size_t) = heap_fn;
+    size_t v, len = sizeof(v);
+    return mallctl(name, &v, &len, NULL, 0) == 0 ? (long)v : -1;
+}
+
+static long tcmalloc_stat(const char *name) {
+    int (*get)(const char *, size_t *) = heap_fn;
+    size_t v;
+    return get(name, &v) ? (long)v : -1;
+}
+
+static void heap_record(long now_ms) {
+    struct heap_sample s = {.allocated = -1, .heap = -1, .rss = rss_bytes()};
+    if (!heap_count) heap_start_ms = now_ms;
+    s.t_ms = now_ms - heap_start_ms;
+    if (heap_fn) switch (purge_kind) {
+    case PURGE_GLIBC: {
+        struct mallinfo2 mi = ((struct mallinfo2 (*)(void))heap_fn)();
+        s.allocated = (long)(mi.uordblks + mi.hblkhd);
+        s.heap = (long)(mi.arena + mi.hblkhd);
+        break;
+    }
+    case PURGE_MIMALLOC: {      // no in-use counter outside its stats build
+        size_t elapsed, user, sys, rss, peak_rss, commit, peak_commit, faults;
+        ((void (*)(size_t *, size_t *, size_t *, size_t *, size_t *, size_t *,
+                   size_t *, size_t *))heap_fn)(
+            &elapsed, &user, &sys, &rss, &peak_rss, &commit, &peak_commit, &faults);
+        s.heap = (long)commit;
+        break;
+    }
+    case PURGE_JEMALLOC: {      // stats are cached until the epoch advances
+        uint64_t epoch = 1;
+        ((int (*)(const char *, void *, size_t *, void *, size_t))heap_fn)(
+            "epoch", NULL, NULL, &epoch, sizeof(epoch));
+        s.allocated = jemalloc_stat("stats.allocated");
+        s.heap = jemalloc_stat("stats.resident");
+        break;
+    }
+    case PURGE_TCMALLOC: {
+        long size = tcmalloc_stat("generic.heap_size");
+        long unmapped = tcmalloc_stat("tcmalloc.pageheap_unmapped_bytes");
+        s.allocated = tcmalloc_stat("generic.current_allocated_bytes");
+        s.heap = size >= 0 && unmapped >= 0 ? size - unmapped : size;
+        break;
+    }
+    }
+    heap_ring[heap_count++ % HEAP_RING] = s;
+}
+
+// Least-squares slope of one field over the ring, in bytes per minute. Sets
+// *grew when the fitted growth across the window is above both 1 MiB and 5%
+// of the field's mean: noise from a single burst stays "stable".
+static long heap_slope(size_t field, bool *grew) {
+    unsigned long first = heap_count > HEAP_RING ? heap_count - HEAP_RING : 0;
+    double n = 0, st = 0, sy = 0, stt = 0, sty = 0;
+    for (unsigned long i = first; i < heap_count; i++) {
+        const struct heap_sample *s = &heap_ring[i % HEAP_RING];
+        long y = *(const long *)((const char *)s + field);
+        if (y < 0) { *grew = false; return 0; }
+        double t = s->t_ms / 60000.0;
+        n++; st += t; sy += y; stt += t * t; sty += t * y;
+    }
+    double den = n * stt - st * st;
+    if (n < 2 || den <= 0) { *grew = false; return 0; }
+    double slope = (n * sty - st * sy) / den;
+    double span = (heap_ring[(heap_count - 1) % HEAP_RING].t_ms
+                   - heap_ring[first % HEAP_RING].t_ms) / 60000.0;
+    double growth = slope * span, mean = sy / n;
+    *grew = growth > 1048576 && growth > mean * 0.05;
+    return (long)slope;
+}
+
+static void heap_report(int conn) {
+    if (!heap_interval_ms) {
+        dprintf(conn, "error heap sampling is off (CHILD_ENV_HEAP_SAMPLE)\n");
+        return;
+    }
+    bool alloc_grew, heap_grew, rss_grew;
+    long alloc = heap_slope(offsetof(struct heap_sample, allocated), &alloc_grew);
+    long heap = heap_slope(offsetof(struct heap_sample, heap), &heap_grew);
+    long rss = heap_slope(offsetof(struct heap_sample, rss), &rss_grew);
+    unsigned long first = heap_count > HEAP_RING ? heap_count - HEAP_RING : 0;
+    bool known = heap_ring[(heap_count - 1) % HEAP_RING].allocated >= 0;
+    const char *verdict = heap_count - first < 4 ? "collecting"
+                        : alloc_grew ? "leak"
+                        : !(heap_grew || rss_grew) ? "stable"
+                        : known ? "fragmentation" : "growing";
+    dprintf(conn, "ok %s samples %lu verdict %s\n", purge_names[purge_kind],
+            heap_count - first, verdict);
+    dprintf(conn, "slope/min allocated %ld heap %ld rss %ld\n", alloc, heap, rss);
+    for (unsigned long i = first; i < heap_count; i++) {
+        const struct heap_sample *s = &heap_ring[i % HEAP_RING];
+        dprintf(conn, "%ld %ld %ld %ld\n", s->t_ms, s->allocated, s->heap, s->rss);
+    }
+}
+
+// Writable private mappings with no file behind them that an allocator
+// owns: the brk heap and named regions (glibc names its arenas with
+// glibc.mem.decorate_maps), never a stack. With reclaim_anon, unnamed ones
+// too, except a thread stack, which sits right above its guard page
+// (`guard_below`).
+static bool reclaim_candidate(const char *line, bool guard_below) {
+    unsigned long inode;
+    char perms[5];
+    int name = 0;
+    if (sscanf(line, "%*x-%*x %4s %*x %*s %lu %n", perms, &inode, &name) != 2 || !name)
+        return false;
+    const char *n = line + name;
+    if (inode || perms[0] != 'r' || perms[1] != 'w' || perms[3] != 'p') return false;
+    if (!strncmp(n, "[heap]", 6)) return true;
+    if (!strncmp(n, "[anon:", 6)) return !strstr(n, "stack");
+    return reclaim_anon && (*n == '\n' || *n == '\0') && !guard_below;
+}
+
+struct reclaim_region {
+    unsigned long start, end;
+    long anon;                  // resident anonymous bytes
+};
+
+static void reclaim_cold(void) {
+    struct reclaim_region top[RECLAIM_MAPPINGS] = {{0, 0, 0}};
+    FILE *f = fopen("/proc/self/smaps", "re");
+    if (!f) return;
+    char line[512], perms[5];
+    unsigned long start = 0, end = 0, guard_end = 0;
+    bool candidate = false;
+    long kb;
+    while (fgets(line, sizeof(line), f)) {
+        size_t tok = strcspn(line, " ");
+        if (memchr(line, '-', tok) && !memchr(line, ':', tok)) {    // mapping header
+            bool ok = sscanf(line, "%lx-%lx %4s", &start, &end, perms) == 3;
+            candidate = ok && reclaim_candidate(line, guard_end && guard_end == start);
+            guard_end = ok && !strcmp(perms, "---p") ? end : 0;
+        } else if (candidate && sscanf(line, "Anonymous: %ld kB", &kb) == 1) {
+            size_t min = 0;
+            for (size_t i = 1; i < RECLAIM_MAPPINGS; i++)
+                if (top[i].anon < top[min].anon) min = i;
+            if (kb * 1024 >= RECLAIM_MIN_BYTES && kb * 1024 > top[min].anon)
+                top[min] = (struct reclaim_region){start, end, kb * 1024};
+            candidate = false;
+        }
+    }
+    fclose(f);
+    long before = rss_bytes(), advised = 0;
+    for (size_t i = 0; i < RECLAIM_MAPPINGS; i++)
+        if (top[i].anon && madvise((void *)top[i].start, top[i].end - top[i].start,
+                                   reclaim_advice) == 0)
+            advised += top[i].anon;
+    long after = rss_bytes();
+    atomic_fetch_add(&reclaim_runs, 1);
+    atomic_fetch_add(&reclaim_advised, (unsigned long)advised);
+    atomic_fetch_add(&reclaim_dropped, before > after ? (unsigned long)(before - after) : 0);
+}
+
+static void purge_signal(int sig) {
+    (void)sig;
+    int saved = errno;
+    if (write(purge_pipe[1], "p", 1) < 0) {}
+    errno = saved;
+}
+
+static void purge_serve(int conn, const char *cmd) {
+    if (!strcmp(cmd, "purge"))
+        dprintf(conn, "ok %s %ld\n", purge_names[purge_kind], purge_now());
+    else if (!strcmp(cmd, "info"))
+        dprintf(conn, "ok %s auto %lu %lu\n", purge_names[purge_kind],
+                atomic_load(&purge_auto_count), atomic_load(&purge_auto_bytes));
+    else if (!strcmp(cmd, "heap"))
+        heap_report(conn);
+    else if (!strcmp(cmd, "children") && tel_on)
+        tel_report(conn);
+    else if (!strcmp(cmd, "children"))
+        dprintf(conn, "error child telemetry is off (CHILD_ENV_CHILD_STATS)\n");
+    else if (!strcmp(cmd, "stats"))
+        dprintf(conn, "ok %s\npurge_auto %lu %lu\npurge_signal %lu %lu\n"
+                "reclaim %s %lu %lu %lu\nspawns %lu\n"
+                "path_cache %lu %lu\ngovernor %lu %lu %lu %lu\n",
+                purge_names[purge_kind], atomic_load(&purge_auto_count),
+                atomic_load(&purge_auto_bytes), atomic_load(&purge_signal_count),
+                atomic_load(&purge_signal_bytes),
+                reclaim_advice == MADV_PAGEOUT ? "pageout" : "cold",
+                atomic_load(&reclaim_runs), atomic_load(&reclaim_advised),
+                atomic_load(&reclaim_dropped), atomic_load(&spawn_count),
+                path_cache ? atomic_load(&path_cache->hits) : 0,
+                path_cache ? atomic_load(&path_cache->misses) : 0,
+                atomic_load(&gov_held),
+                atomic_load(&gov_timeouts), atomic_load(&gov_wait_ms),
+                atomic_load(&gov_wait_max_ms));
+    else
+        dprintf(conn, "error unknown command\n");
+}
+
+// Take every pending connection the free slots have room for. Only the
+// owner's uid (or root) gets a slot.
+static void purge_accept(struct purge_conn *conns, long now) {
+    for (int i = 0; i < PURGE_CONNS; i++) {
+        while (conns[i].fd < 0) {
+            int fd = accept4(purge_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            struct ucred cred;
+            socklen_t len = sizeof(cred);
+            if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0
+                || (cred.uid != getuid() && cred.uid != 0)) {
+                close(fd);
+                continue;
+            }
+            conns[i] = (struct purge_conn){.fd = fd, .deadline = now + PURGE_CONN_MS};
+        }
+    }
+}
+
+// Read what a client has sent so far; once the command is complete (newline,
+// end of stream or a full buffer), answer it and close the connection.
+static void purge_conn_read(struct purge_conn *c) {
+    ssize_t n = read(c->fd, c->cmd + c->len, sizeof(c->cmd) - 1 - c->len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (n < 0) c->len = 0;      // broken connection: nothing to answer
+    if (n > 0) c->len += (size_t)n;
+    c->cmd[c->len] = '\0';
+    if (n > 0 && c->len < sizeof(c->cmd) - 1 && !strchr(c->cmd, '\n')) return;
+    if (c->len) {
+        c->cmd[strcspn(c->cmd, "\r\n")] = '\0';
+        purge_serve(c->fd, c->cmd);
+    }
+    close(c->fd);
+    c->fd = -1;
+}
+
+static void purge_auto(void) {
+    atomic_fetch_add(&purge_auto_count, 1);
+    atomic_fetch_add(&purge_auto_bytes, (unsigned long)purge_now());
+}
+
+static long cpu_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Idle detection for the idle purge and cold reclaim: due once per stretch of
+// `period` seconds under 1% CPU (and, with `spawns`, no exec/spawn), then
+// not again until the process has been busy in between.
+struct idle_watch {
+    int period;                 // seconds, 0: off
+    bool spawns;
+    bool fired;
+    long next;                  // CLOCK_MONOTONIC ms, LONG_MAX when off
+    long last_cpu;
+    unsigned long last_spawns;
+};
+
+static void idle_watch_start(struct idle_watch *w, long now) {
+    w->next = w->period > 0 ? now + w->period * 1000L : LONG_MAX;
+    w->last_cpu = cpu_ms();
+    w->last_spawns = atomic_load(&spawn_count);
+}
+
+static bool idle_watch_due(struct idle_watch *w, long now) {
+    if (now < w->next) return false;
+    long cpu = cpu_ms();
+    unsigned long spawns = atomic_load(&spawn_count);
+    bool idle = cpu - w->last_cpu < w->period * 10L
+             && (!w->spawns || spawns == w->last_spawns);
+    bool due = idle && !w->fired;
+    w->fired = idle;
+    w->last_cpu = cpu;
+    w->last_spawns = spawns;
+    w->next = now + w->period * 1000L;
+    return due;
+}
+
+static long mono_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *purge_thread(void *unused) {
+    (void)unused;
+    struct pollfd pfd[3 + PURGE_CONNS] = {
+        {purge_pipe[0], POLLIN, 0}, {purge_sock, POLLIN, 0}, {purge_psi, POLLPRI, 0},
+    };
+    struct purge_conn conns[PURGE_CONNS];
+    for (int i = 0; i < PURGE_CONNS; i++) conns[i].fd = -1;
+    long now = mono_ms();
+    long next_sample = heap_interval_ms > 0 ? now : LONG_MAX;
+    struct idle_watch idle = {.period = purge_idle_sec};
+    struct idle_watch cold = {.period = reclaim_idle_sec, .spawns = true};
+    idle_watch_start(&idle, now);
+    idle_watch_start(&cold, now);
+    for (;;) {
+        now = mono_ms();
+        if (now >= next_sample) {
+            heap_record(now);
+            next_sample = now + heap_interval_ms;
+        }
+        // Re-read the CPU clock after acting so our own work is not taken
+        // for the process becoming busy.
+        if (idle_watch_due(&idle, now)) { purge_auto(); idle.last_cpu = cpu_ms(); }
+        if (idle_watch_due(&cold, now)) { reclaim_cold(); cold.last_cpu = cpu_ms(); }
+        long next = next_sample;
+        if (idle.next < next) next = idle.next;
+        if (cold.next < next) next = cold.next;
+        // A client past its deadline is dropped; while every slot is taken,
+        // new ones wait in the listen backlog.
+        bool full = true;
+        for (int i = 0; i < PURGE_CONNS; i++) {
+            if (conns[i].fd >= 0 && conns[i].deadline <= now) {
+                close(conns[i].fd);
+                conns[i].fd = -1;
+            }
+            if (conns[i].fd >= 0 && conns[i].deadline < next) next = conns[i].deadline;
+            full &= conns[i].fd >= 0;
+            pfd[3 + i] = (struct pollfd){conns[i].fd, POLLIN, 0};
+        }
+        pfd[1].fd = full ? -1 : purge_sock;
+        int timeout = next == LONG_MAX ? -1 : (int)(next > now ? next - now : 0);
+        int n = poll(pfd, 3 + PURGE_CONNS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return NULL;
+        }
+        if (n == 0) continue;
+        if (pfd[2].revents & POLLERR) pfd[2].fd = -1;   // cgroup/PSI went away
+        else if (pfd[2].revents & POLLPRI) purge_auto();
+        if (pfd[0].revents & POLLIN) {
+            char drain[16];
+            if (read(purge_pipe[0], drain, sizeof(drain)) > 0) {
+                atomic_fetch_add(&purge_signal_count, 1);
+                atomic_fetch_add(&purge_signal_bytes, (unsigned long)purge_now());
+            }
+        }
+        for (int i = 0; i < PURGE_CONNS; i++)
+            if (pfd[3 + i].revents) purge_conn_read(&conns[i]);
+        if (pfd[1].revents & POLLIN) purge_accept(conns, mono_ms());
+    }
+}
+
+static int purge_open_socket(void) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (!dir || *dir != '/') return -1;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    char sub[sizeof(addr.sun_path)];
+    if ((size_t)snprintf(sub, sizeof(sub), "%s/libchildenv", dir) >= sizeof(sub)
+        || (size_t)snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%d.sock",
+                            sub, (int)getpid()) >= sizeof(addr.sun_path)) return -1;
+    if (mkdir(sub, 0700) < 0 && errno != EEXIST) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(addr.sun_path);      // stale socket from a recycled pid
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        close(fd);
+        return -1;
+    }
+    purge_sock_path = strdup(addr.sun_path);
+    return fd;
+}
+
+static int purge_signal_number(const char *name) {
+    if (!strncmp(name, "SIG", 3)) name += 3;
+    if (!strcmp(name, "USR1")) return SIGUSR1;
+    if (!strcmp(name, "USR2")) return SIGUSR2;
+    char *end;
+    long n = strtol(name, &end, 10);
+    return *name && !*end && n > 0 && n < NSIG ? (int)n : -1;
+}
+
+static int purge_open_psi(const char *ms) {
+    char *end;
+    long stall = strtol(ms, &end, 10);
+    if (*end || stall <= 0 || stall > 2000) return -1;
+    int fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return -1;
+    char trigger[64];
+    int len = snprintf(trigger, sizeof(trigger), "some %ld 2000000", stall * 1000);
+    if (write(fd, trigger, (size_t)len + 1) < 0) { close(fd); return -1; }
+    return fd;
+}
+
+// The control thread does not survive fork(): a child keeps the signal
+// handler (harmless, the pipe is non-blocking) but must not hold the socket
+// or the PSI trigger.
+static void purge_atfork_child(void) {
+    if (purge_sock >= 0) close(purge_sock);
+    if (purge_psi >= 0) close(purge_psi);
+    purge_sock = purge_psi = -1;
+    free(purge_sock_path);
+    purge_sock_path = NULL;
+}
+
+static void purge_control_init(void) {
+    const char *signame = getenv("CHILD_ENV_PURGE_SIGNAL");
+    const char *sockopt = getenv("CHILD_ENV_PURGE_SOCKET");
+    const char *psi = getenv("CHILD_ENV_PURGE_PSI");
+    const char *idle = getenv("CHILD_ENV_PURGE_IDLE");
+    const char *sample = getenv("CHILD_ENV_HEAP_SAMPLE");
+    const char *reclaim = getenv("CHILD_ENV_RECLAIM_IDLE");
+    int sig = signame && *signame ? purge_signal_number(signame) : -1;
+    bool want_sock = sockopt && !strcmp(sockopt, "1");
+    if (idle && *idle && atoi(idle) > 0)
+        purge_idle_sec = atoi(idle) < 86400 ? atoi(idle) : 86400;
+    if (sample && *sample && strtod(sample, NULL) > 0) {
+        double sec = strtod(sample, NULL);
+        heap_interval_ms = sec < 0.05 ? 50 : sec > 86400 ? 86400000 : (long)(sec * 1000);
+    }
+    if (reclaim && atoi(reclaim) > 0) {
+        reclaim_idle_sec = atoi(reclaim) < 86400 ? atoi(reclaim) : 86400;
+        for (const char *opt = strchr(reclaim, ':'); opt; opt = strchr(opt, ':')) {
+            size_t len = strcspn(++opt, ":");
+            if (len == 7 && !strncmp(opt, "pageout", 7)) reclaim_advice = MADV_PAGEOUT;
+            else if (len == 4 && !strncmp(opt, "anon", 4)) reclaim_anon = true;
+        }
+    }
+    if (sig < 0 && !want_sock && !(psi && *psi) && !purge_idle_sec && !heap_interval_ms
+        && !reclaim_idle_sec)
+        return;
+    purge_detect();
+    if (heap_interval_ms) heap_detect();
+    if (pipe2(purge_pipe, O_CLOEXEC | O_NONBLOCK) < 0) return;
+    if (want_sock) purge_sock = purge_open_socket();
+    if (psi && *psi) purge_psi = purge_open_psi(psi);
+    if (sig < 0 && purge_sock < 0 && purge_psi < 0 && !purge_idle_sec && !heap_interval_ms
+        && !reclaim_idle_sec)
+        return;
+    purge_owner = getpid();
+    pthread_atfork(NULL, NULL, purge_atfork_child);
+
+    // Start the thread with every signal blocked so the host's signals keep
+    // going to the host's own threads.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t th;
+    bool started = pthread_create(&th, NULL, purge_thread, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!started) return;
+    pthread_detach(th);
+    if (sig > 0) {
+        struct sigaction sa = {.sa_handler = purge_signal, .sa_flags = SA_RESTART};
+        sigemptyset(&sa.sa_mask);
+        sigaction(sig, &sa, NULL);
+    }
+}
+
+__attribute__((destructor))
+static void purge_control_fini(void) {
+    if (purge_sock_path && getpid() == purge_owner) unlink(purge_sock_path);
 }
 
 // ---------- host-process strip (constructor) ----------
@@ -141,13 +3853,116 @@ oom:
 // which is harmless (the child has no LD_PRELOAD, so allocator/render vars are
 // inert there).
 //
-// Caches CHILD_ENV_RULES into `cached_rules` before removing it, so the hooks
-// keep working after it leaves the environ.
+// Compiles CHILD_ENV_RULES (plus CHILD_ENV_DEPTH_RULES and the policy file)
+// into the active policy before removing it, so the hooks keep working after
+// it leaves the environ.
+//
+// CHILD_ENV_DEPTH_RULES and CHILD_ENV_POLICY_FILE are pure control state and
+// always leave the environ. A descendant (CHILDENV_DEPTH set) maps the policy
+// from CHILDENV_POLICY_FD instead of compiling it, then drops LD_PRELOAD and
+// the control vars: all were written by its parent's hook and are re-derived
+// by ours, so keeping them would only re-open the environ-copy leak described
+// above.
+//
+// A setuid/setgid program (AT_SECURE) gets none of this. Every CHILD_ENV_*
+// knob names files, directories or libraries the process would then create,
+// truncate or load with its raised privileges, so the constructor returns
+// before reading any of them, the hooks stay idle and no destructor has
+// anything to write.
 __attribute__((constructor))
-static void strip_host_environ(void) {
+static void strip_host_environ(int argc, char **argv, char **envp) {
+    (void)argc; (void)envp;
+    if (getauxval(AT_SECURE)) {
+        getenv_profile_init(false);
+        hooks_idle = true;
+        ctor_done = true;
+        return;
+    }
+    apply_embedded_policy();
+    char *d = getenv("CHILDENV_DEPTH");
+    if (!d && !apply_system_policy(argv) && !embedded_found && !preload_names_self()) {
+        // System mode, unlisted program: nothing else is read.
+        getenv_profile_init(false);
+#ifdef CHILDENV_MALLOC_MUX
+        mux_resolve();
+#endif
+        hooks_idle = true;
+        ctor_done = true;
+        return;
+    }
+    getenv_profile_init(true);
+    hot_first_init();
+    if (!d) self_exec_init();
+#ifdef CHILDENV_MALLOC_MUX
+    mux_resolve();
+#endif
+    apply_mallopt();
+    apply_mm_policy();
+    path_cache_init();
+    tel_init();
+    purge_control_init();
+    ctor_done = true;
+    self_pid = getpid();
+    pthread_atfork(NULL, NULL, self_pid_atfork_child);
+    Dl_info info;
+    if (dladdr((void *)strip_host_environ, &info) && info.dli_fname
+        && *info.dli_fname)
+        self_path = strdup(info.dli_fname);
+    char *depth_rules = getenv("CHILD_ENV_DEPTH_RULES");
+    if (depth_rules && *depth_rules) cached_depth_rules = strdup(depth_rules);
+    unsetenv("CHILD_ENV_DEPTH_RULES");
+    char *file = getenv("CHILD_ENV_POLICY_FILE");
+    if (file && *file) policy_file = strdup(file);
+    unsetenv("CHILD_ENV_POLICY_FILE");
+
+    if (d && atoi(d) > 0 && (cached_depth_rules || policy_file)) {
+        self_depth = atoi(d);
+        char *fdstr = getenv("CHILDENV_POLICY_FD");
+        int fd = fdstr ? atoi(fdstr) : -1;
+        const struct policy *pol = fd >= 0 ? policy_map_inherited(fd) : NULL;
+        struct policy_ref *ref = NULL;
+        if (pol && (ref = calloc(1, sizeof(*ref)))) {
+            ref->pol = pol;
+            ref->map_len = pol->size;
+            ref->fd = fd;
+            ref->gen = atomic_fetch_add(&policy_gen, 1) + 1;
+            atomic_init(&ref->refs, 1);
+            // Our children are the last ruled level: they need neither the
+            // library nor the fd.
+            if (pol->max_depth <= self_depth + 1) { close(fd); ref->fd = -1; }
+        } else {
+            // Inherited fd gone: compile from the propagated sources, and
+            // keep following the file like the host does.
+            policy_reloadable = policy_file != NULL;
+            if (policy_reloadable && stat(policy_file, &policy_file_st) < 0)
+                memset(&policy_file_st, 0, sizeof(policy_file_st));
+            struct policy *own = compile_current();
+            if (own) ref = policy_ref_new(own, own->max_depth > self_depth + 1);
+        }
+        atomic_store(&active_ref, ref);
+        unsetenv("CHILDENV_DEPTH");
+        unsetenv("CHILDENV_POLICY_FD");
+        unsetenv("LD_PRELOAD");
+        return;
+    }
+
     char *raw = getenv("CHILD_ENV_RULES");
+    if (raw && *raw) cached_rules = strdup(raw);
+    if (policy_file) {
+        policy_reloadable = true;
+        if (stat(policy_file, &policy_file_st) < 0)
+            memset(&policy_file_st, 0, sizeof(policy_file_st));
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        atomic_store(&reload_next, now.tv_sec + 1);
+    }
+    struct policy *pol = compile_current();
+    if (pol) atomic_store(&active_ref,
+                          policy_ref_new(pol, pol->max_depth > 1 && self_path));
+    hooks_idle = !pol && !policy_reloadable && !self_exec_enabled
+              && child_mm.thp < 0 && child_mm.ksm < 0 && !reclaim_idle_sec && !tel_on
+              && !hot_count;
     if (!raw || !*raw) return;
-    cached_rules = strdup(raw);
     char *s = strdup(raw);
     if (!s) return;
     char *p = s, *tok;
@@ -165,10 +3980,15 @@ int execve(const char *path, char *const argv[], char *const envp[]) {
     static int (*real)(const char *, char *const *, char *const *);
     if (!real) real = dlsym(RTLD_NEXT, "execve");
     if (!real) { errno = ENOSYS; return -1; }
-    char **new_envp = build_child_env(envp);
+    if (hooks_idle) return real(path, argv, envp);
+    struct policy_ref *ref;
+    char **new_envp = prepare_env(path, -1, envp, &ref);
     if (!new_envp) { errno = ENOMEM; return -1; }
+    struct mm_policy mm = child_mm_enter();
+    struct child_res res = child_res_enter(ref, -1);
+    ref = vfork_unpin(ref, new_envp);
     int r = real(path, argv, new_envp);
-    int saved = errno; free_envp(new_envp); errno = saved;
+    int saved = errno; res_switch(&res); mm_switch(mm); release_env(new_envp, ref); errno = saved;
     return r;
 }
 
@@ -176,10 +3996,15 @@ int execvpe(const char *file, char *const argv[], char *const envp[]) {
     static int (*real)(const char *, char *const *, char *const *);
     if (!real) real = dlsym(RTLD_NEXT, "execvpe");
     if (!real) { errno = ENOSYS; return -1; }
-    char **new_envp = build_child_env(envp);
+    if (hooks_idle) return exec_path_cached(file, argv, envp, real);
+    struct policy_ref *ref;
+    char **new_envp = prepare_env(file, -1, envp, &ref);
     if (!new_envp) { errno = ENOMEM; return -1; }
-    int r = real(file, argv, new_envp);
-    int saved = errno; free_envp(new_envp); errno = saved;
+    struct mm_policy mm = child_mm_enter();
+    struct child_res res = child_res_enter(ref, -1);
+    ref = vfork_unpin(ref, new_envp);
+    int r = exec_path_cached(file, argv, new_envp, real);
+    int saved = errno; res_switch(&res); mm_switch(mm); release_env(new_envp, ref); errno = saved;
     return r;
 }
 
@@ -189,10 +4014,15 @@ int execv(const char *path, char *const argv[]) {
     static int (*real)(const char *, char *const *, char *const *);
     if (!real) real = dlsym(RTLD_NEXT, "execve");
     if (!real) { errno = ENOSYS; return -1; }
-    char **new_envp = build_child_env(environ);
+    if (hooks_idle) return real(path, argv, environ);
+    struct policy_ref *ref;
+    char **new_envp = prepare_env(path, -1, environ, &ref);
     if (!new_envp) { errno = ENOMEM; return -1; }
+    struct mm_policy mm = child_mm_enter();
+    struct child_res res = child_res_enter(ref, -1);
+    ref = vfork_unpin(ref, new_envp);
     int r = real(path, argv, new_envp);
-    int saved = errno; free_envp(new_envp); errno = saved;
+    int saved = errno; res_switch(&res); mm_switch(mm); release_env(new_envp, ref); errno = saved;
     return r;
 }
 
@@ -200,10 +4030,15 @@ int execvp(const char *file, char *const argv[]) {
     static int (*real)(const char *, char *const *, char *const *);
     if (!real) real = dlsym(RTLD_NEXT, "execvpe");
     if (!real) { errno = ENOSYS; return -1; }
-    char **new_envp = build_child_env(environ);
+    if (hooks_idle) return exec_path_cached(file, argv, environ, real);
+    struct policy_ref *ref;
+    char **new_envp = prepare_env(file, -1, environ, &ref);
     if (!new_envp) { errno = ENOMEM; return -1; }
-    int r = real(file, argv, new_envp);
-    int saved = errno; free_envp(new_envp); errno = saved;
+    struct mm_policy mm = child_mm_enter();
+    struct child_res res = child_res_enter(ref, -1);
+    ref = vfork_unpin(ref, new_envp);
+    int r = exec_path_cached(file, argv, new_envp, real);
+    int saved = errno; res_switch(&res); mm_switch(mm); release_env(new_envp, ref); errno = saved;
     return r;
 }
 
@@ -255,6 +4090,37 @@ int execle(const char *path, const char *arg, ...) {
     return r;
 }
 
+// fork(): hand the child the current snapshot so one that execs with
+// environ finds its envp ready (see fork_ready_env()).
+pid_t fork(void) {
+    static pid_t (*real)(void);
+    if (!real) real = dlsym(RTLD_NEXT, "fork");
+    if (!real) { errno = ENOSYS; return -1; }
+    if (hooks_idle) return real();
+    pthread_once(&fork_once, fork_shared_map);
+    pid_t self = cached_pid();
+    bool children_exec = fork_exec_parent
+        && atomic_load_explicit(fork_exec_parent, memory_order_relaxed) == self;
+    // Only a reference is held across the real fork, not snapshot_lock, so
+    // atfork handlers can use the snapshot API. The child cannot trust the
+    // cache pointer or the lock, either of which another thread may have
+    // been updating, and starts over from the snapshot it holds.
+    childenv_snapshot *snap = NULL;
+    if (children_exec) snap = childenv_snapshot_get();
+    else if (atomic_load_explicit(&cached_snapshot, memory_order_relaxed)) snap = snapshot_cached();
+    pid_t pid = real();
+    if (pid == 0) {
+        fork_parent = self;
+        pthread_mutex_init(&snapshot_lock, NULL);
+        if (cached_snapshot == snap) childenv_snapshot_unref(snap);
+        else cached_snapshot = snap;
+        in_fork_child = true;
+        return 0;
+    }
+    childenv_snapshot_unref(snap);
+    return pid;
+}
+
 // posix_spawn family: required for Qt6 QProcess, GLib g_spawn_async,
 // Python subprocess — they bypass exec* entirely. Returns an errno value
 // directly (not -1/errno).
@@ -267,10 +4133,14 @@ int posix_spawn(pid_t *pid, const char *path,
         char *const *, char *const *);
     if (!real) real = dlsym(RTLD_NEXT, "posix_spawn");
     if (!real) return ENOSYS;
-    char **new_envp = build_child_env(envp);
-    if (!new_envp) return ENOMEM;
-    int r = real(pid, path, fa, attr, argv, new_envp);
-    free_envp(new_envp);
+    if (hooks_idle) return real(pid, path, fa, attr, argv, envp);
+    int slot = gov_enter(path);
+    struct policy_ref *ref;
+    char **new_envp = prepare_env(path, -1, envp, &ref);
+    if (!new_envp) { gov_leave(slot, path, -1); return ENOMEM; }
+    int r = spawn_prepared(pid, path, fa, attr, argv, new_envp, real, false, ref,
+                           exec_is_self, slot);
+    release_env(new_envp, ref);
     return r;
 }
 
@@ -278,10 +4148,15 @@ int fexecve(int fd, char *const argv[], char *const envp[]) {
     static int (*real)(int, char *const *, char *const *);
     if (!real) real = dlsym(RTLD_NEXT, "fexecve");
     if (!real) { errno = ENOSYS; return -1; }
-    char **new_envp = build_child_env(envp);
+    if (hooks_idle) return real(fd, argv, envp);
+    struct policy_ref *ref;
+    char **new_envp = prepare_env(NULL, fd, envp, &ref);
     if (!new_envp) { errno = ENOMEM; return -1; }
+    struct mm_policy mm = child_mm_enter();
+    struct child_res res = child_res_enter(ref, fd);
+    ref = vfork_unpin(ref, new_envp);
     int r = real(fd, argv, new_envp);
-    int saved = errno; free_envp(new_envp); errno = saved;
+    int saved = errno; res_switch(&res); mm_switch(mm); release_env(new_envp, ref); errno = saved;
     return r;
 }
 
@@ -294,9 +4169,83 @@ int posix_spawnp(pid_t *pid, const char *file,
         char *const *, char *const *);
     if (!real) real = dlsym(RTLD_NEXT, "posix_spawnp");
     if (!real) return ENOSYS;
-    char **new_envp = build_child_env(envp);
-    if (!new_envp) return ENOMEM;
-    int r = real(pid, file, fa, attr, argv, new_envp);
-    free_envp(new_envp);
+    if (hooks_idle) return spawn_path_cached(pid, file, fa, attr, argv, envp, real);
+    int slot = gov_enter(file);
+    struct policy_ref *ref;
+    char **new_envp = prepare_env(file, -1, envp, &ref);
+    if (!new_envp) { gov_leave(slot, file, -1); return ENOMEM; }
+    int r = spawn_prepared(pid, file, fa, attr, argv, new_envp, real, true, ref,
+                           exec_is_self, slot);
+    release_env(new_envp, ref);
     return r;
 }
+
+// ---------- batch spawn (libchildenv.h) ----------
+
+// childenv_spawn_batch(): the environment comes from the snapshot cache (for
+// environ) or is built once (for an explicit envp), under a policy
+// reference held while the batch uses it, so a policy memfd named in it
+// stays open. Each child is then only the real posix_spawn(). A child the
+// governor throttles may wait, so before one the batch lets go of the
+// snapshot and the reference and takes both again after (for an explicit
+// envp, one more build). Batch children are never treated as self
+// re-execs: they get the ruled environment, so they get the resource
+// profile too.
+
+static int batch_spawn_one(struct childenv_spawn *c, const struct policy_ref *ref,
+                           char *const envp[], unsigned flags, int slot) {
+    static spawn_fn real, search;
+    if (!real) real = (spawn_fn)dlsym(RTLD_NEXT, "posix_spawn");
+    if (!search) search = (spawn_fn)dlsym(RTLD_NEXT, "posix_spawnp");
+    if (!real || !search) { gov_leave(slot, c->path, -1); return ENOSYS; }
+    pid_t pid;
+    bool searched = flags & CHILDENV_SPAWN_SEARCH;
+    int err = spawn_prepared(&pid, c->path, c->file_actions, c->attr, c->argv, envp,
+                             searched ? search : real, searched, ref, false, slot);
+    if (err) return err;
+    c->pid = pid;
+    // Until the caller reaps it, no other process can take the child's pid.
+    // The child runs either way, so a failed pidfd_open is not an error.
+    if ((flags & CHILDENV_SPAWN_PIDFD)
+        && (c->pidfd = (int)syscall(SYS_pidfd_open, pid, 0)) < 0) {
+        c->pidfd = -1;
+        c->pidfd_error = errno;
+    }
+    return 0;
+}
+
+size_t childenv_spawn_batch(char *const envp[], struct childenv_spawn *children,
+                            size_t n, unsigned flags) {
+    for (size_t i = 0; i < n; i++) {
+        children[i].pid = -1;
+        children[i].pidfd = -1;
+        children[i].error = 0;
+        children[i].pidfd_error = 0;
+    }
+    if (!n) return 0;
+    atomic_fetch_add_explicit(&spawn_count, n, memory_order_relaxed);
+    struct policy_ref *ref = NULL;
+    childenv_snapshot *snap = NULL;
+    size_t started = 0;
+    for (size_t i = 0; i < n; i++) {
+        struct childenv_spawn *c = &children[i];
+        struct gov_spec g;
+        int slot = -1;
+        if (!i || gov_match(ref, c->path, &g)) {
+            if (snap) childenv_snapshot_unref(snap);
+            if (ref) policy_leave(ref);
+            slot = gov_enter(c->path);
+            ref = policy_enter();
+            snap = !envp || envp == environ ? snapshot_get(ref) : snapshot_build(ref, envp);
+        }
+        if (!snap) {
+            gov_leave(slot, c->path, -1);
+            c->error = ENOMEM;
+        } else if (!(c->error = batch_spawn_one(c, ref, snap->envp, flags, slot))) {
+            started++;
+        }
+    }
+    if (snap) childenv_snapshot_unref(snap);
+    policy_leave(ref);
+    return started;
+}
@@ -0,0 +1,93 @@
+// libchildenv public API: environment snapshots for hosts that bypass exec.
+//
+// Launchers that hand the environment to something other than an exec hook —
+// systemd StartTransientUnit (KIO/KProcessRunner), D-Bus activation, their own
+// clone()-based spawn code — can ask libchildenv for "environ as a child would
+// see it" and get exactly what build_child_env() would produce: the active
+// rules for the next depth, the depth-scoped propagation state, and any
+// policy-file reload already applied.
+//
+// Snapshots are immutable and reference counted. childenv_snapshot_get()
+// returns the same snapshot, with one more reference, for as long as neither
+// the host environ nor the policy changes, so repeated launches share one
+// array without copying. All functions are thread-safe.
+//
+// childenv_spawn_batch() goes one step further for hosts that launch many
+// identical helpers: the policy is applied once and every child of the batch
+// is spawned with that one environment.
+//
+// The symbols live in libchildenv.so. Hosts running with it in LD_PRELOAD can
+// resolve them at run time with dlsym(RTLD_DEFAULT, ...) and should check
+// childenv_api_version() against CHILDENV_API_VERSION first.
+
+#ifndef LIBCHILDENV_H
+#define LIBCHILDENV_H
+
+#include <spawn.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHILDENV_API_VERSION 2
+
+typedef struct childenv_snapshot childenv_snapshot;
+
+// CHILDENV_API_VERSION of the loaded library. Newer versions only add
+// functions; a caller built against version N works with any version >= N.
+unsigned childenv_api_version(void);
+
+// Snapshot of the current environ with the child policy applied. Returns NULL
+// with errno set (ENOMEM) on failure. Release with childenv_snapshot_unref().
+childenv_snapshot *childenv_snapshot_get(void);
+
+// Same, for an explicit envp instead of environ. Never cached.
+childenv_snapshot *childenv_snapshot_from(char *const envp[]);
+
+// Take another reference; returns `snap`.
+childenv_snapshot *childenv_snapshot_ref(childenv_snapshot *snap);
+
+// Drop a reference; the last one frees the snapshot. NULL is ignored.
+void childenv_snapshot_unref(childenv_snapshot *snap);
+
+// NULL-terminated "NAME=value" array, valid while a reference is held.
+char *const *childenv_snapshot_envp(const childenv_snapshot *snap);
+
+// Number of entries in childenv_snapshot_envp(), terminator excluded.
+size_t childenv_snapshot_count(const childenv_snapshot *snap);
+
+// ---- version 2 ----
+
+// One child of a batch. The caller fills the inputs; file_actions and attr
+// may be NULL.
+struct childenv_spawn {
+    const char *path;           // program, searched in PATH with CHILDENV_SPAWN_SEARCH
+    char *const *argv;
+    const posix_spawn_file_actions_t *file_actions;
+    const posix_spawnattr_t *attr;
+    pid_t pid;                  // out: child pid, or -1
+    int pidfd;                  // out: with CHILDENV_SPAWN_PIDFD, else -1
+    int error;                  // out: 0 or the errno value it failed with
+    int pidfd_error;            // out: why pidfd is -1 for a started child, or 0
+};
+
+#define CHILDENV_SPAWN_SEARCH 0x1   // posix_spawnp() semantics for path
+#define CHILDENV_SPAWN_PIDFD  0x2   // also open a pidfd (O_CLOEXEC) per child
+
+// posix_spawn() each of the `n` children with envp (environ when NULL)
+// after applying the child policy once, for the whole batch. A child that
+// fails does not stop the others. Returns the number of children started.
+// Without a pidfd the caller reaps by pid as usual; with one, the pid stays
+// valid for waitpid() as well. A child whose pidfd could not be opened still
+// counts as started (error 0, pid set): it has pidfd -1 and the reason in
+// pidfd_error, and must be reaped by pid.
+size_t childenv_spawn_batch(char *const envp[], struct childenv_spawn *children,
+                            size_t n, unsigned flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBCHILDENV_H
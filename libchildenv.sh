@@ -1,16 +1,34 @@
 #!/bin/bash
 # Wrapper to run a command with libchildenv and a memory allocator.
-# Usage: libchildenv.sh [mimalloc|jemalloc|tcmalloc] <command> [args...]
+# Usage: libchildenv.sh [mimalloc|jemalloc|tcmalloc|glibc] <command> [args...]
 #        libchildenv.sh verify <process_name>
-#        libchildenv.sh apply-malloc <binary> <mimalloc|jemalloc|tcmalloc>
+#        libchildenv.sh apply-malloc <binary> <mimalloc|jemalloc|tcmalloc|glibc>
+#        libchildenv.sh patch-malloc <binary> <mimalloc|jemalloc|tcmalloc|glibc>
+#        libchildenv.sh system-malloc <binary> <mimalloc|jemalloc|tcmalloc|glibc>
+#        libchildenv.sh system-remove <binary>
+#        libchildenv.sh purge <pid>
+#        libchildenv.sh purge-stats <pid>
+#        libchildenv.sh heap <pid>
+#        libchildenv.sh stats <pid>
+#        libchildenv.sh children <pid>
+#        libchildenv.sh fds <pid> [first_fd]
 
 set -u
 
 usage() {
     cat >&2 <<EOF
-Usage: $0 [mimalloc|jemalloc|tcmalloc] <command> [args...]
+Usage: $0 [mimalloc|jemalloc|tcmalloc|glibc] <command> [args...]
        $0 verify <process_name>
-       $0 apply-malloc <binary> <mimalloc|jemalloc|tcmalloc>
+       $0 apply-malloc <binary> <mimalloc|jemalloc|tcmalloc|glibc>
+       $0 patch-malloc <binary> <mimalloc|jemalloc|tcmalloc|glibc>
+       $0 system-malloc <binary> <mimalloc|jemalloc|tcmalloc|glibc>
+       $0 system-remove <binary>
+       $0 purge <pid>
+       $0 purge-stats <pid>
+       $0 heap <pid>
+       $0 stats <pid>
+       $0 children <pid>
+       $0 fds <pid> [first_fd]
        $0 unwrap <binary>
 EOF
 }
@@ -23,43 +41,54 @@ fi
 option_selected="$1"
 shift
 
-# Each allocator is represented as an array so env assignments survive
-# expansion without literal quote corruption (bash does not re-parse
-# assignment prefixes after variable expansion). Each array is consumed by
-# name via `local -n` in run_with_malloc/wrap_binary_with_malloc, which the
-# linter cannot trace — hence the SC2034 suppressions below.
-# shellcheck disable=SC2034
-mimalloc_env=(
-    "LD_PRELOAD=libchildenv.so:libmimalloc.so"
-    "CHILD_ENV_RULES=LD_PRELOAD,MIMALLOC_PURGE_DELAY,CHILD_ENV_RULES"
-    "MIMALLOC_PURGE_DELAY=0"
-)
-# shellcheck disable=SC2034
-jemalloc_env=(
-    "LD_PRELOAD=libchildenv.so:libjemalloc.so"
-    "CHILD_ENV_RULES=LD_PRELOAD,MALLOC_CONF,CHILD_ENV_RULES"
-    "MALLOC_CONF=narenas:1"
-)
-# shellcheck disable=SC2034
-tcmalloc_env=(
-    "LD_PRELOAD=libchildenv.so:libtcmalloc.so"
-    "CHILD_ENV_RULES=LD_PRELOAD,TCMALLOC_AGGRESSIVE_DECOMMIT,CHILD_ENV_RULES"
-    "TCMALLOC_AGGRESSIVE_DECOMMIT=1"
-)
+# Print the path of helper tool $1: from PATH, else next to this script, so
+# an uninstalled build tree works the same for every command. Empty if absent.
+find_tool() {
+    local tool
+    tool=$(command -v "$1" || true)
+    if [[ -z "$tool" && -x "$(dirname "$0")/$1" ]]; then
+        tool="$(cd "$(dirname "$0")" && pwd)/$1"
+    fi
+    printf '%s' "$tool"
+}
+
+# The allocator profiles (mimalloc, jemalloc, tcmalloc, glibc) are defined
+# once, in the native launcher (childenv-launch.c), which also replaces the
+# `exec env` hop here and the `#!/bin/sh` + `exec env` pair in apply-malloc
+# wrappers. `childenv-launch --print <profile>` lists one.
+launcher=$(find_tool childenv-launch)
+
+# Fill the array named $2 with profile $1.
+load_profile() {
+    local -n out=$2
+    if [[ -z "$launcher" ]]; then
+        echo "childenv-launch not found; it provides the allocator profiles" >&2
+        exit 1
+    fi
+    mapfile -t out < <("$launcher" --print "$1")
+    if [[ ${#out[@]} -eq 0 ]]; then
+        echo "Unknown allocator: $1" >&2
+        exit 1
+    fi
+}
 
 run_with_malloc() {
-    local -n env_arr=$1
+    local profile=$1
     shift
     if [[ $# -eq 0 ]]; then
         usage
         exit 1
     fi
-    exec env "${env_arr[@]}" "$@"
+    if [[ -z "$launcher" ]]; then
+        echo "childenv-launch not found; it provides the allocator profiles" >&2
+        exit 1
+    fi
+    exec "$launcher" "$profile" "$@"
 }
 
 wrap_binary_with_malloc() {
-    local bin_path="$1"
-    local -n env_arr=$2
+    local bin_path="$1" env_arr
+    load_profile "$2" env_arr
 
     if [[ $EUID -ne 0 ]]; then
         echo "You need root permission" >&2
@@ -80,24 +109,181 @@ wrap_binary_with_malloc() {
 
     cp -f "$bin_path" "$bin_path.orig"
 
-    # Build env-assignment prefix. Values are fixed allocator settings with no
-    # shell metacharacters, so they embed directly without extra quoting.
-    local env_line=""
-    local item
-    for item in "${env_arr[@]}"; do
-        env_line+="${item} "
-    done
-
-    cat > "$bin_path" <<EOF
-#!/bin/sh
-exec env ${env_line}"${bin_path}.orig" "\$@"
-EOF
-    chmod +x "$bin_path"
+    # Symlink the binary to the native launcher, which reads the profile
+    # from "$bin_path.childenv" and execs "$bin_path.orig" directly: one exec
+    # per launch instead of three (sh, env, program).
+    printf '%s\n' "${env_arr[@]}" > "$bin_path.childenv"
+    ln -sf "$launcher" "$bin_path"
     echo "Now $bin_path uses custom malloc"
     echo "Note: a package update overwriting $bin_path removes this wrapper;" \
          "re-run apply-malloc after upgrades. Undo with: $0 unwrap $bin_path" >&2
 }
 
+# Wrapper-free variant: childenv-elf writes a copy of the binary with
+# libchildenv and the allocator as DT_NEEDED entries and the knobs embedded,
+# so launching it costs no extra exec and sets no LD_PRELOAD.
+patch_binary_with_malloc() {
+    local bin_path="$1" env_arr
+    load_profile "$2" env_arr
+
+    if [[ $EUID -ne 0 ]]; then
+        echo "You need root permission" >&2
+        exit 1
+    fi
+    local elftool
+    elftool=$(find_tool childenv-elf)
+    if [[ -z "$elftool" ]]; then
+        echo "childenv-elf not found" >&2
+        exit 1
+    fi
+    if [[ ! -f "$bin_path" || -L "$bin_path" ]]; then
+        echo "Binary not found or already wrapped: $bin_path" >&2
+        exit 1
+    fi
+    if [[ -e "$bin_path.orig" ]]; then
+        echo "$bin_path.orig already exists; refusing to overwrite." >&2
+        exit 1
+    fi
+
+    local profile
+    profile=$(mktemp) || exit 1
+    printf '%s\n' "${env_arr[@]}" > "$profile"
+    if ! "$elftool" add-needed "$bin_path" "$bin_path.childenv-new" "$profile"; then
+        rm -f "$profile" "$bin_path.childenv-new"
+        exit 1
+    fi
+    rm -f "$profile"
+    cp -f "$bin_path" "$bin_path.orig"
+    mv -f "$bin_path.childenv-new" "$bin_path"
+    echo "Now $bin_path loads custom malloc without a wrapper"
+    echo "Note: a package update overwriting $bin_path removes this patch;" \
+         "re-run patch-malloc after upgrades. Undo with: $0 unwrap $bin_path" >&2
+}
+
+# System-wide mode: libchildenv is listed in /etc/ld.so.preload and looks the
+# running executable up in an index compiled from system.conf. Nothing on disk
+# is wrapped or patched, so package upgrades leave the setting in place.
+system_conf=/etc/libchildenv/system.conf
+system_index=/etc/libchildenv/system.idx
+
+# Print system.conf without the section for $1.
+system_conf_without() {
+    [[ -f "$system_conf" ]] || return 0
+    awk -v sec="[$1]" '/^[[:space:]]*\[/ { skip = ($1 == sec) } !skip' "$system_conf"
+}
+
+update_system_conf() {
+    local new="$1"
+    if [[ $EUID -ne 0 ]]; then
+        echo "You need root permission" >&2
+        exit 1
+    fi
+    local indextool
+    indextool=$(find_tool childenv-index)
+    if [[ -z "$indextool" ]]; then
+        echo "childenv-index not found" >&2
+        exit 1
+    fi
+    mkdir -p "${system_conf%/*}" || exit 1
+    printf '%s' "$new" > "$system_conf.new" && mv -f "$system_conf.new" "$system_conf" || exit 1
+    "$indextool" "$system_conf" "$system_index" || exit 1
+}
+
+system_add_malloc() {
+    local bin_path="$1" env_arr
+    load_profile "$2" env_arr
+
+    if [[ "$bin_path" != /* ]]; then
+        echo "Binary path must be absolute: $bin_path" >&2
+        exit 1
+    fi
+    local conf
+    conf=$(system_conf_without "$bin_path"; printf '[%s]\n' "$bin_path"; printf '%s\n' "${env_arr[@]}")
+    update_system_conf "$conf"$'\n'
+    echo "Now $bin_path runs with custom malloc system-wide"
+    if ! grep -qs 'libchildenv\.so' /etc/ld.so.preload; then
+        echo "Note: add the full path of libchildenv.so to /etc/ld.so.preload" \
+             "to enable system-wide mode." >&2
+    fi
+}
+
+system_remove() {
+    local bin_path="$1"
+    if ! grep -qsxF "[$bin_path]" "$system_conf"; then
+        echo "$bin_path is not listed in $system_conf" >&2
+        exit 1
+    fi
+    local conf
+    conf=$(system_conf_without "$bin_path")
+    update_system_conf "${conf:+$conf$'\n'}"
+    echo "Removed $bin_path from $system_conf"
+}
+
+# Send one command to a host's control socket (CHILD_ENV_PURGE_SOCKET=1) and
+# print the reply. Returns 2 if the host has no socket.
+control_request() {
+    local pid="$1" cmd="$2"
+    local sock="${XDG_RUNTIME_DIR:-/run/user/$(id -u)}/libchildenv/$pid.sock"
+    [[ -S "$sock" ]] || return 2
+    if command -v socat >/dev/null; then
+        printf '%s\n' "$cmd" | socat - "UNIX-CONNECT:$sock"
+    elif command -v python3 >/dev/null; then
+        python3 -c 'import socket, sys
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+s.sendall(sys.argv[2].encode() + b"\n")
+while True:
+    data = s.recv(4096)
+    if not data:
+        break
+    sys.stdout.write(data.decode())' "$sock" "$cmd"
+    else
+        echo "Need socat or python3 to talk to $sock" >&2
+        exit 1
+    fi
+}
+
+# Ask a running host to return its allocator's cached memory over the
+# control socket; without one, send the CHILD_ENV_PURGE_SIGNAL found in its
+# environment, in which case the host counts the result on the `stats`
+# reply's purge_signal line.
+purge_process() {
+    local pid="$1"
+    control_request "$pid" purge
+    [[ $? -ne 2 ]] && return
+    local sig
+    sig=$(tr '\0' '\n' < "/proc/$pid/environ" 2>/dev/null \
+          | sed -n 's/^CHILD_ENV_PURGE_SIGNAL=//p')
+    if [[ -z "$sig" ]]; then
+        echo "Process $pid has no purge control" \
+             "(start it with CHILD_ENV_PURGE_SOCKET=1 or CHILD_ENV_PURGE_SIGNAL)" >&2
+        exit 1
+    fi
+    if [[ "$sig" =~ ^[0-9]+$ ]]; then
+        kill -n "$sig" "$pid" || exit 1
+    else
+        kill -s "${sig#SIG}" "$pid" || exit 1
+    fi
+    echo "Sent ${sig#SIG} to $pid; the purge result is counted in its stats"
+}
+
+# List the descriptors of a running process, from `first` (default 3) up,
+# that lack O_CLOEXEC and so leak into every child it starts: "fd target".
+# These are what a `closefds` policy line keeps from its children.
+list_leaked_fds() {
+    local pid="$1" first="$2" info fd flags
+    [[ -d "/proc/$pid/fdinfo" ]] || { echo "No process $pid" >&2; exit 1; }
+    for info in "/proc/$pid/fdinfo/"*; do
+        fd=${info##*/}
+        (( fd >= first )) || continue
+        flags=$(sed -n 's/^flags:[[:space:]]*//p' "$info" 2>/dev/null)
+        [[ -n "$flags" ]] || continue
+        # fdinfo flags are octal; O_CLOEXEC is 02000000.
+        (( (8#$flags & 8#2000000) == 0 )) || continue
+        printf '%s %s\n' "$fd" "$(readlink "/proc/$pid/fd/$fd" 2>/dev/null)"
+    done | sort -n
+}
+
 restore_wrapped_binary() {
     local bin_path="$1"
 
@@ -111,18 +297,13 @@ restore_wrapped_binary() {
     fi
 
     mv -f "$bin_path.orig" "$bin_path"
+    rm -f "$bin_path.childenv"
     echo "Restored original $bin_path"
 }
 
 case "$option_selected" in
-    mimalloc)
-        run_with_malloc mimalloc_env "$@"
-        ;;
-    jemalloc)
-        run_with_malloc jemalloc_env "$@"
-        ;;
-    tcmalloc)
-        run_with_malloc tcmalloc_env "$@"
+    mimalloc|jemalloc|tcmalloc|glibc)
+        run_with_malloc "$option_selected" "$@"
         ;;
 
     verify)
@@ -141,15 +322,13 @@ case "$option_selected" in
 
     apply-malloc)
         if [[ $# -ne 2 ]]; then
-            echo "Usage: $0 apply-malloc <binary> <mimalloc|jemalloc|tcmalloc>" >&2
+            echo "Usage: $0 apply-malloc <binary> <mimalloc|jemalloc|tcmalloc|glibc>" >&2
             exit 1
         fi
         bin="$1"
         malloc="$2"
         case "$malloc" in
-            mimalloc) wrap_binary_with_malloc "$bin" mimalloc_env ;;
-            jemalloc) wrap_binary_with_malloc "$bin" jemalloc_env ;;
-            tcmalloc) wrap_binary_with_malloc "$bin" tcmalloc_env ;;
+            mimalloc|jemalloc|tcmalloc|glibc) wrap_binary_with_malloc "$bin" "$malloc" ;;
             *)
                 echo "Unknown allocator: $malloc" >&2
                 exit 1
@@ -157,6 +336,82 @@ case "$option_selected" in
         esac
         ;;
 
+    patch-malloc)
+        if [[ $# -ne 2 ]]; then
+            echo "Usage: $0 patch-malloc <binary> <mimalloc|jemalloc|tcmalloc|glibc>" >&2
+            exit 1
+        fi
+        case "$2" in
+            mimalloc|jemalloc|tcmalloc|glibc) patch_binary_with_malloc "$1" "$2" ;;
+            *)
+                echo "Unknown allocator: $2" >&2
+                exit 1
+                ;;
+        esac
+        ;;
+
+    system-malloc)
+        if [[ $# -ne 2 ]]; then
+            echo "Usage: $0 system-malloc <binary> <mimalloc|jemalloc|tcmalloc|glibc>" >&2
+            exit 1
+        fi
+        case "$2" in
+            mimalloc|jemalloc|tcmalloc|glibc) system_add_malloc "$1" "$2" ;;
+            *)
+                echo "Unknown allocator: $2" >&2
+                exit 1
+                ;;
+        esac
+        ;;
+
+    system-remove)
+        if [[ $# -ne 1 ]]; then
+            echo "Usage: $0 system-remove <binary>" >&2
+            exit 1
+        fi
+        system_remove "$1"
+        ;;
+
+    purge)
+        if [[ $# -ne 1 || ! "$1" =~ ^[0-9]+$ ]]; then
+            echo "Usage: $0 purge <pid>" >&2
+            exit 1
+        fi
+        purge_process "$1"
+        ;;
+
+    purge-stats)
+        if [[ $# -ne 1 || ! "$1" =~ ^[0-9]+$ ]]; then
+            echo "Usage: $0 purge-stats <pid>" >&2
+            exit 1
+        fi
+        control_request "$1" info
+        if [[ $? -eq 2 ]]; then
+            echo "Process $1 has no control socket (CHILD_ENV_PURGE_SOCKET=1)" >&2
+            exit 1
+        fi
+        ;;
+
+    heap|stats|children)
+        if [[ $# -ne 1 || ! "$1" =~ ^[0-9]+$ ]]; then
+            echo "Usage: $0 $option_selected <pid>" >&2
+            exit 1
+        fi
+        control_request "$1" "$option_selected"
+        if [[ $? -eq 2 ]]; then
+            echo "Process $1 has no control socket (CHILD_ENV_PURGE_SOCKET=1)" >&2
+            exit 1
+        fi
+        ;;
+
+    fds)
+        if [[ $# -lt 1 || $# -gt 2 || ! "$1" =~ ^[0-9]+$ || ! "${2:-3}" =~ ^[0-9]+$ ]]; then
+            echo "Usage: $0 fds <pid> [first_fd]" >&2
+            exit 1
+        fi
+        list_leaked_fds "$1" "${2:-3}"
+        ;;
+
     unwrap)
         if [[ $# -ne 1 ]]; then
             echo "Usage: $0 unwrap <binary>" >&2
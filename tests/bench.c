@@ -0,0 +1,203 @@
+// Micro-benchmarks for libchildenv, run under different environments by
+// bench.sh. Each prints the best per-operation time over <rounds> rounds.
+//
+//   bench spawn <iterations> <rounds> <program> [args...]
+//       posix_spawn + waitpid of <program>, in microseconds. The parent's
+//       hooks and every child's constructor are both on the measured path.
+//   bench spawn-mt <threads> <iterations> <rounds> <program> [args...]
+//       The same loop run by <threads> threads at once; prints the total
+//       spawns per second. With linear scaling it grows with <threads>
+//       until the CPUs run out.
+//   bench fanout|batch <iterations> <rounds> <program> [args...]
+//       Children started 32 at a time and then reaped, in microseconds per
+//       child: fanout makes 32 posix_spawn calls through the hooks, batch
+//       one childenv_spawn_batch call that prepares the environment once.
+//   bench fork <iterations> <rounds>
+//       fork() of a child that only _exit()s, + waitpid, in microseconds:
+//       what the fork hook costs hosts whose children never exec.
+//   bench toolkit
+//       Stand-in child for a toolkit starting up: 400 getenv() calls over
+//       names GTK and Qt read, then exit. Run through `bench spawn`.
+//   bench malloc <iterations> <rounds>
+//       malloc + free of small blocks, in nanoseconds: the cost of the
+//       libchildenv-malloc.so forwarding layer.
+
+#define _GNU_SOURCE
+#include "../libchildenv.h"
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int bench_spawn(int iters, int rounds, char **argv) {
+    double best = 0;
+    for (int r = 0; r < rounds; r++) {
+        double t0 = now_us();
+        for (int i = 0; i < iters; i++) {
+            pid_t pid;
+            int err = posix_spawn(&pid, argv[0], NULL, NULL, argv, environ);
+            if (err) { fprintf(stderr, "posix_spawn failed: %d\n", err); return 1; }
+            int st;
+            if (waitpid(pid, &st, 0) < 0) { perror("waitpid"); return 1; }
+        }
+        double per = (now_us() - t0) / iters;
+        if (r == 0 || per < best) best = per;
+    }
+    printf("%.1f\n", best);
+    return 0;
+}
+
+static int bench_fork(int iters, int rounds) {
+    double best = 0;
+    for (int r = 0; r < rounds; r++) {
+        double t0 = now_us();
+        for (int i = 0; i < iters; i++) {
+            pid_t pid = fork();
+            if (pid < 0) { perror("fork"); return 1; }
+            if (pid == 0) _exit(0);
+            if (waitpid(pid, NULL, 0) < 0) { perror("waitpid"); return 1; }
+        }
+        double per = (now_us() - t0) / iters;
+        if (r == 0 || per < best) best = per;
+    }
+    printf("%.1f\n", best);
+    return 0;
+}
+
+struct spawn_job {
+    int iters;
+    char **argv;
+    int err;
+};
+
+static void *spawn_thread(void *arg) {
+    struct spawn_job *job = arg;
+    for (int i = 0; i < job->iters && !job->err; i++) {
+        pid_t pid;
+        job->err = posix_spawn(&pid, job->argv[0], NULL, NULL, job->argv, environ);
+        if (!job->err && waitpid(pid, NULL, 0) < 0) job->err = -1;
+    }
+    return NULL;
+}
+
+static int bench_spawn_mt(int threads, int iters, int rounds, char **argv) {
+    if (threads < 1 || threads > 256) { fprintf(stderr, "threads: 1..256\n"); return 2; }
+    pthread_t tid[256];
+    struct spawn_job jobs[256];
+    double best = 0;
+    for (int r = 0; r < rounds; r++) {
+        double t0 = now_us();
+        for (int i = 0; i < threads; i++) {
+            jobs[i] = (struct spawn_job){iters, argv, 0};
+            pthread_create(&tid[i], NULL, spawn_thread, &jobs[i]);
+        }
+        for (int i = 0; i < threads; i++) pthread_join(tid[i], NULL);
+        for (int i = 0; i < threads; i++)
+            if (jobs[i].err) { fprintf(stderr, "posix_spawn failed: %d\n", jobs[i].err); return 1; }
+        double rate = threads * iters / ((now_us() - t0) / 1e6);
+        if (rate > best) best = rate;
+    }
+    printf("%.0f\n", best);
+    return 0;
+}
+
+#define FANOUT 32
+
+static int bench_fanout(int iters, int rounds, char **argv, bool batched) {
+    size_t (*batch)(char *const *, struct childenv_spawn *, size_t, unsigned) =
+        dlsym(RTLD_DEFAULT, "childenv_spawn_batch");
+    if (batched && !batch) { fprintf(stderr, "childenv_spawn_batch not loaded\n"); return 1; }
+    struct childenv_spawn c[FANOUT];
+    double best = 0;
+    for (int r = 0; r < rounds; r++) {
+        double t0 = now_us();
+        for (int done = 0; done < iters; done += FANOUT) {
+            for (int i = 0; i < FANOUT; i++)
+                c[i] = (struct childenv_spawn){.path = argv[0], .argv = argv};
+            if (batched) {
+                batch(environ, c, FANOUT, 0);
+            } else {
+                for (int i = 0; i < FANOUT; i++)
+                    c[i].error = posix_spawn(&c[i].pid, argv[0], NULL, NULL, argv, environ);
+            }
+            for (int i = 0; i < FANOUT; i++) {
+                if (c[i].error) { fprintf(stderr, "spawn failed: %d\n", c[i].error); return 1; }
+                waitpid(c[i].pid, NULL, 0);
+            }
+        }
+        double per = (now_us() - t0) / ((iters + FANOUT - 1) / FANOUT * FANOUT);
+        if (r == 0 || per < best) best = per;
+    }
+    printf("%.1f\n", best);
+    return 0;
+}
+
+static int bench_malloc(int iters, int rounds) {
+    // volatile: keep the compiler from pairing up and eliding malloc/free.
+    void *volatile slots[64];
+    double best = 0;
+    for (int r = 0; r < rounds; r++) {
+        double t0 = now_us();
+        for (int i = 0; i < iters; i++) {
+            int k = i & 63;
+            slots[k] = malloc(16 + (size_t)(i & 255));
+            free(slots[k]);
+        }
+        double per = (now_us() - t0) * 1e3 / iters;
+        if (r == 0 || per < best) best = per;
+    }
+    printf("%.1f\n", best);
+    return 0;
+}
+
+static int bench_toolkit(void) {
+    static const char *const names[] = {
+        "PATH", "HOME", "LANG", "LC_ALL", "LC_MESSAGES", "LANGUAGE", "DISPLAY",
+        "WAYLAND_DISPLAY", "XDG_RUNTIME_DIR", "XDG_DATA_DIRS", "XDG_DATA_HOME",
+        "XDG_CONFIG_HOME", "XDG_CONFIG_DIRS", "XDG_CURRENT_DESKTOP", "XDG_SESSION_TYPE",
+        "GDK_BACKEND", "GTK_THEME", "QT_QPA_PLATFORM", "QT_SCALE_FACTOR", "DBUS_SESSION_BUS_ADDRESS",
+    };
+    volatile size_t found = 0;
+    for (int round = 0; round < 20; round++)
+        for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++)
+            found += getenv(names[i]) != NULL;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 5 && !strcmp(argv[1], "spawn"))
+        return bench_spawn(atoi(argv[2]), atoi(argv[3]), argv + 4);
+    if (argc >= 6 && !strcmp(argv[1], "spawn-mt"))
+        return bench_spawn_mt(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), argv + 5);
+    if (argc >= 5 && (!strcmp(argv[1], "fanout") || !strcmp(argv[1], "batch")))
+        return bench_fanout(atoi(argv[2]), atoi(argv[3]), argv + 4, argv[1][0] == 'b');
+    if (argc == 4 && !strcmp(argv[1], "malloc"))
+        return bench_malloc(atoi(argv[2]), atoi(argv[3]));
+    if (argc == 4 && !strcmp(argv[1], "fork"))
+        return bench_fork(atoi(argv[2]), atoi(argv[3]));
+    if (argc == 2 && !strcmp(argv[1], "toolkit"))
+        return bench_toolkit();
+    fprintf(stderr, "Usage: %s spawn <iterations> <rounds> <program> [args...]\n"
+                    "       %s spawn-mt <threads> <iterations> <rounds> <program> [args...]\n"
+                    "       %s fanout|batch <iterations> <rounds> <program> [args...]\n"
+                    "       %s malloc <iterations> <rounds>\n"
+                    "       %s fork <iterations> <rounds>\n"
+                    "       %s toolkit\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+    return 2;
+}
@@ -0,0 +1,137 @@
+#!/bin/bash
+# Measures what libchildenv costs processes it has nothing to do for, which is
+# nearly every process once it is listed in /etc/ld.so.preload. Compares a
+# spawn+exit loop of /bin/true without the library, with an empty preloaded
+# stub (the dynamic loader's share, paid by any preload), with libchildenv in
+# system mode and no index, and with an index that does not list /bin/true.
+# Then runs the spawn loop from 1, 2 and 4 threads at once with rules to
+# apply, where per-thread env scratch should keep throughput scaling with the
+# thread count (up to the CPU count), then starts children 32 at a time
+# through the hooks and through childenv_spawn_batch(), then measures child
+# startup behind a long environment with and without CHILD_ENV_HOT_FIRST
+# (bench toolkit, and real GLib/Qt programs where installed), times a plain
+# fork() whose child never execs, with and without rules to apply, and
+# compares malloc+free with and without libchildenv-malloc.so forwarding to
+# glibc.
+#
+# Usage: tests/bench.sh [iterations] [rounds]
+
+set -u
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+REPO_DIR="$(cd "$SCRIPT_DIR/.." && pwd)"
+cd "$REPO_DIR" || exit 2
+
+ITERS=${1:-2000}
+ROUNDS=${2:-5}
+SO="$REPO_DIR/libchildenv.so"
+BENCH="$SCRIPT_DIR/bench"
+INDEXTOOL="$REPO_DIR/childenv-index"
+TARGET=/bin/true
+
+MUX_SO="$REPO_DIR/libchildenv-malloc.so"
+
+workdir=$(mktemp -d)
+trap 'rm -rf "$workdir"' EXIT
+
+gcc -shared -fPIC -O2 -o "$SO" "$REPO_DIR/libchildenv.c" -ldl || exit 2
+# System mode reads only the fixed index path, so a copy built against one in
+# the work directory stands in for /etc/ld.so.preload: the bench linked to it
+# loads it the way the preload list would.
+gcc -shared -fPIC -O2 -DCHILDENV_INDEX_PATH="\"$workdir/system.idx\"" \
+    -o "$workdir/libchildenv-system.so" "$REPO_DIR/libchildenv.c" -ldl || exit 2
+gcc -shared -fPIC -O2 -DCHILDENV_MALLOC_MUX -o "$MUX_SO" "$REPO_DIR/libchildenv.c" -ldl || exit 2
+gcc -O2 -o "$INDEXTOOL" "$REPO_DIR/childenv-index.c" || exit 2
+gcc -O2 -pthread -o "$BENCH" "$SCRIPT_DIR/bench.c" -ldl || exit 2
+gcc -O2 -pthread -o "$workdir/bench-system" "$SCRIPT_DIR/bench.c" -ldl \
+    -Wl,--no-as-needed "$workdir/libchildenv-system.so" || exit 2
+echo 'void childenv_bench_stub(void) {}' >"$workdir/stub.c"
+gcc -shared -fPIC -O2 -o "$workdir/stub.so" "$workdir/stub.c" || exit 2
+for i in $(seq 1 200); do
+    printf '[/opt/listed/app%d]\nLD_PRELOAD=libtcmalloc.so\nTCMALLOC_AGGRESSIVE_DECOMMIT=1\n' "$i"
+done >"$workdir/system.conf"
+
+run() {
+    env -i PATH="/usr/bin:/bin" "$@" "${BENCH_BIN:-$BENCH}" spawn "$ITERS" "$ROUNDS" "$TARGET"
+}
+
+run_malloc() {
+    env -i PATH="/usr/bin:/bin" "$@" "$BENCH" malloc $((ITERS * 5000)) "$ROUNDS"
+}
+
+base=$(run)
+stub=$(run LD_PRELOAD="$workdir/stub.so")
+noidx=$(BENCH_BIN="$workdir/bench-system" run)
+"$INDEXTOOL" "$workdir/system.conf" "$workdir/system.idx" || exit 2
+unlisted=$(BENCH_BIN="$workdir/bench-system" run)
+
+printf '%-34s %8s us/spawn\n' "no libchildenv" "$base"
+printf '%-34s %8s us/spawn\n' "empty preloaded stub" "$stub"
+printf '%-34s %8s us/spawn\n' "libchildenv system, no index" "$noidx"
+printf '%-34s %8s us/spawn\n' "libchildenv system, unlisted (200)" "$unlisted"
+awk -v s="$stub" -v u="$unlisted" 'BEGIN { printf "libchildenv cost beyond loading a library: %+.1f us/spawn\n", u - s }'
+
+echo ""
+for t in 1 2 4; do
+    rate=$(env -i PATH="/usr/bin:/bin" LD_PRELOAD="$SO" \
+           CHILD_ENV_RULES="LD_PRELOAD,MALLOC_ARENA_MAX=2" \
+           "$BENCH" spawn-mt "$t" $((ITERS / 4)) "$ROUNDS" "$TARGET")
+    printf '%-34s %8s spawns/s (%d CPUs)\n' "libchildenv, rules, $t thread(s)" "$rate" "$(nproc)"
+done
+
+echo ""
+fan() {
+    env -i PATH="/usr/bin:/bin" LD_PRELOAD="$SO" \
+        CHILD_ENV_RULES="LD_PRELOAD,MALLOC_ARENA_MAX=2" "$BENCH" "$1" "$ITERS" "$ROUNDS" "$TARGET"
+}
+fanout=$(fan fanout)
+batch=$(fan batch)
+printf '%-34s %8s us/child\n' "32 x posix_spawn through hooks" "$fanout"
+printf '%-34s %8s us/child\n' "childenv_spawn_batch of 32" "$batch"
+
+echo ""
+# 150 long variables nobody reads come before the ones toolkits look up.
+# The hot list is profiled from the child itself (CHILD_ENV_GETENV_PROFILE).
+pad=()
+for i in $(seq 1 150); do pad+=("PAD_$i=$(printf '%0100d' "$i")"); done
+desk=(HOME="$HOME" LANG=C.UTF-8 XDG_RUNTIME_DIR=/run/user/1000 XDG_DATA_DIRS=/usr/share
+      XDG_CURRENT_DESKTOP=X-Cinnamon DISPLAY=:0 WAYLAND_DISPLAY=wayland-0 PATH="/usr/bin:/bin")
+startup() {
+    local hot=$1; shift
+    env -i "${pad[@]}" "${desk[@]}" LD_PRELOAD="$SO" \
+        CHILD_ENV_RULES="LD_PRELOAD" ${hot:+CHILD_ENV_HOT_FIRST="$hot"} \
+        "$BENCH" spawn $((ITERS / 4)) "$ROUNDS" "$@"
+}
+toolkits=("$BENCH toolkit")
+for cmd in gdk-pixbuf-query-loaders qtpaths6 qtpaths; do
+    path=$(command -v "$cmd") && toolkits+=("$path --version")
+done
+for t in "${toolkits[@]}"; do
+    read -ra argv <<<"$t"
+    env -i "${pad[@]}" "${desk[@]}" LD_PRELOAD="$SO" CHILD_ENV_GETENV_PROFILE="$workdir/getenv.prof" \
+        "${argv[@]}" >/dev/null 2>&1
+    cold=$(startup "" "${argv[@]}")
+    hot=$(startup "$workdir/getenv.prof" "${argv[@]}")
+    name="${argv[0]##*/} ${argv[1]:-}"
+    printf '%-34s %8s us/spawn\n' "$name, env order kept" "$cold"
+    printf '%-34s %8s us/spawn\n' "$name, CHILD_ENV_HOT_FIRST" "$hot"
+done
+
+echo ""
+# Worker-pool style: the children only exit, so the fork hook must not build
+# an envp for them, even behind the long environment above.
+plain_fork() {
+    env -i "${pad[@]}" "${desk[@]}" "$@" "$BENCH" fork "$ITERS" "$ROUNDS"
+}
+fbase=$(plain_fork)
+frules=$(plain_fork LD_PRELOAD="$SO" \
+         CHILD_ENV_RULES="LD_PRELOAD,MALLOC_ARENA_MAX=2")
+printf '%-34s %8s us/fork\n' "fork, no exec, no libchildenv" "$fbase"
+printf '%-34s %8s us/fork\n' "fork, no exec, libchildenv rules" "$frules"
+
+echo ""
+mbase=$(run_malloc)
+mmux=$(run_malloc LD_PRELOAD="$MUX_SO")
+printf '%-34s %8s ns/malloc+free\n' "glibc" "$mbase"
+printf '%-34s %8s ns/malloc+free\n' "libchildenv-malloc.so -> glibc" "$mmux"
+awk -v b="$mbase" -v m="$mmux" 'BEGIN { printf "forwarding cost: %+.1f ns per malloc+free pair\n", m - b }'
@@ -12,7 +12,18 @@ REPO_DIR="$(cd "$SCRIPT_DIR/.." && pwd)"
 cd "$REPO_DIR" || exit 2
 
 SO="$REPO_DIR/libchildenv.so"
+MUX_SO="$REPO_DIR/libchildenv-malloc.so"
+TEST_ALLOC="$SCRIPT_DIR/test_alloc.so"
+TEST_SECURE="$SCRIPT_DIR/test_secure.so"
+LAUNCH="$REPO_DIR/childenv-launch"
+ELFTOOL="$REPO_DIR/childenv-elf"
+INDEXTOOL="$REPO_DIR/childenv-index"
 BIN="$SCRIPT_DIR/test_exec"
+# System mode: a libchildenv reading its index from SYS_IDX, and test_exec
+# linked against it instead of preloading it, as /etc/ld.so.preload would.
+SYS_IDX="$SCRIPT_DIR/system.idx"
+SYS_SO="$SCRIPT_DIR/libchildenv-system.so"
+SYS_BIN="$SCRIPT_DIR/test_exec_system"
 
 RED=$'\033[0;31m'
 GREEN=$'\033[0;32m'
@@ -27,17 +38,52 @@ build() {
     gcc -shared -fPIC -O2 -Wall -Wextra -o "$SO" "$REPO_DIR/libchildenv.c" -ldl \
         || { echo "${RED}build failed${RST}"; exit 2; }
 
+    echo "[build] libchildenv-malloc.so"
+    gcc -shared -fPIC -O2 -Wall -Wextra -DCHILDENV_MALLOC_MUX -o "$MUX_SO" \
+        "$REPO_DIR/libchildenv.c" -ldl \
+        || { echo "${RED}build failed${RST}"; exit 2; }
+
+    echo "[build] tests/test_alloc.so"
+    gcc -shared -fPIC -O2 -Wall -Wextra -o "$TEST_ALLOC" "$SCRIPT_DIR/test_alloc.c" \
+        || { echo "${RED}build failed${RST}"; exit 2; }
+
+    echo "[build] tests/test_secure.so"
+    gcc -shared -fPIC -O2 -Wall -Wextra -o "$TEST_SECURE" "$SCRIPT_DIR/test_secure.c" -ldl \
+        || { echo "${RED}build failed${RST}"; exit 2; }
+
+    echo "[build] childenv-launch"
+    gcc -static -O2 -Wall -Wextra -o "$LAUNCH" "$REPO_DIR/childenv-launch.c" \
+        || { echo "${RED}build failed${RST}"; exit 2; }
+
+    echo "[build] childenv-elf"
+    gcc -O2 -Wall -Wextra -o "$ELFTOOL" "$REPO_DIR/childenv-elf.c" \
+        || { echo "${RED}build failed${RST}"; exit 2; }
+
+    echo "[build] childenv-index"
+    gcc -O2 -Wall -Wextra -o "$INDEXTOOL" "$REPO_DIR/childenv-index.c" \
+        || { echo "${RED}build failed${RST}"; exit 2; }
+
     echo "[build] tests/test_exec"
-    gcc -O2 -Wall -Wextra -o "$BIN" "$SCRIPT_DIR/test_exec.c" \
+    gcc -O2 -Wall -Wextra -pthread -o "$BIN" "$SCRIPT_DIR/test_exec.c" \
+        || { echo "${RED}build failed${RST}"; exit 2; }
+
+    echo "[build] tests/libchildenv-system.so, tests/test_exec_system"
+    gcc -shared -fPIC -O2 -Wall -Wextra -DCHILDENV_INDEX_PATH="\"$SYS_IDX\"" -o "$SYS_SO" \
+        "$REPO_DIR/libchildenv.c" -ldl \
+        && gcc -O2 -Wall -Wextra -pthread -o "$SYS_BIN" "$SCRIPT_DIR/test_exec.c" \
+               -Wl,--no-as-needed "$SYS_SO" \
         || { echo "${RED}build failed${RST}"; exit 2; }
 }
 
 # Run test_exec with given env setup and return captured stdout.
-# Args: <method> <rules> [extra env assignments...]
+# Args: <method> <rules> [extra env assignments...] [-- <method arg>]
 run_capture() {
     local method=$1
     local rules=$2
     shift 2
+    local vars=()
+    while [[ $# -gt 0 && $1 != "--" ]]; do vars+=("$1"); shift; done
+    [[ $# -gt 0 ]] && shift
     # Use env to inject extra vars cleanly. LD_PRELOAD must point at absolute
     # path since we don't install into ldconfig search path.
     env -i \
@@ -45,8 +91,23 @@ run_capture() {
         HOME="$HOME" \
         LD_PRELOAD="$SO" \
         CHILD_ENV_RULES="$rules" \
+        "${vars[@]}" \
+        "$BIN" "$method" "$@" 2>&1
+}
+
+# Run `sh -c <script>` as the child under depth-scoped propagation.
+# Args: <rules> <depth_rules> <script> [extra env assignments...]
+run_shell_capture() {
+    local rules=$1 depth_rules=$2 script=$3
+    shift 3
+    env -i \
+        PATH="/usr/bin:/bin" \
+        HOME="$HOME" \
+        LD_PRELOAD="$SO" \
+        CHILD_ENV_RULES="$rules" \
+        CHILD_ENV_DEPTH_RULES="$depth_rules" \
         "$@" \
-        "$BIN" "$method" 2>&1
+        "$BIN" shell "$script" 2>&1
 }
 
 report_pass() {
@@ -192,6 +253,711 @@ else
     report_pass "grandchild env clean"
 fi
 
+echo ""
+echo "=== depth-scoped propagation (CHILD_ENV_DEPTH_RULES) ==="
+# Depth-2 group must reach the grandchild through sh (depth 1), which only
+# happens if sh kept libchildenv loaded. env (depth 2) is the deepest ruled
+# level, so it must come up with neither LD_PRELOAD nor the control vars.
+out=$(run_shell_capture "LD_PRELOAD,SET_VAR=one" "2:DEEP_VAR=two,SET_VAR" "env")
+if grep -q '^EXEC_FAILED' <<<"$out"; then
+    report_fail "depth-2" "shell exec failed" "$out"
+elif ! grep -q '^DEEP_VAR=two$' <<<"$out"; then
+    report_fail "depth-2" "depth-2 group not applied by sh" "$out"
+elif grep -q '^SET_VAR=' <<<"$out"; then
+    report_fail "depth-2" "depth-2 unset rule not applied" "$out"
+elif grep -qE '^(LD_PRELOAD|CHILDENV_DEPTH|CHILD_ENV_DEPTH_RULES)=' <<<"$out"; then
+    report_fail "depth-2" "propagation state leaked past the last ruled depth" "$out"
+else
+    report_pass "depth-2 group applied to grandchild, propagation stops"
+fi
+
+# Depth 1 keeps libchildenv but not the rest of the host's LD_PRELOAD (the
+# "allocator" here is libm, which dash never links on its own).
+out=$(run_shell_capture "LD_PRELOAD" "3:X=y" 'cat /proc/$$/maps' \
+      LD_PRELOAD="$SO:libm.so.6")
+if ! grep -q 'libchildenv\.so' <<<"$out"; then
+    report_fail "depth-preload" "libchildenv not propagated into sh" "$out"
+elif grep -q 'libm\.so' <<<"$out"; then
+    report_fail "depth-preload" "host allocator propagated into sh" "$out"
+else
+    report_pass "descendants keep libchildenv, lose the allocator"
+fi
+
+# Three levels: depth-3 group applied by the inner sh (depth 2).
+out=$(run_shell_capture "LD_PRELOAD" "2:MID=2;3:LEAF=3" 'sh -c env')
+if grep -q '^LEAF=3$' <<<"$out" && grep -q '^MID=2$' <<<"$out" \
+   && ! grep -q '^LD_PRELOAD=' <<<"$out"; then
+    report_pass "depth-3 group applied to great-grandchild"
+else
+    report_fail "depth-3" "depth-3 group not applied" "$out"
+fi
+
+# The host compiles once into a sealed memfd; depth 1 maps it (no re-parse)
+# and removes the fd number from its own environ.
+out=$(run_shell_capture "LD_PRELOAD" "3:X=y" \
+      'cat /proc/$$/maps; echo "FDVAR=${CHILDENV_POLICY_FD:-unset}"')
+if ! grep -q 'memfd:childenv-policy' <<<"$out"; then
+    report_fail "policy-memfd" "descendant did not map the shared policy" "$out"
+elif ! grep -q '^FDVAR=unset$' <<<"$out"; then
+    report_fail "policy-memfd" "CHILDENV_POLICY_FD left in descendant environ" "$out"
+else
+    report_pass "descendant maps the host's sealed policy memfd"
+fi
+
+# An intermediate that closes inherited fds must not break the tree: the next
+# descendant falls back to the propagated rule text.
+out=$(run_shell_capture "LD_PRELOAD" "2:MID=2;3:LEAF=3" \
+      'for fd in 3 4 5 6 7 8 9; do eval "exec $fd>&-"; done; sh -c env')
+if grep -q '^LEAF=3$' <<<"$out"; then
+    report_pass "closed policy fd falls back to rule text"
+else
+    report_fail "policy-fallback" "depth-3 group lost after fd was closed" "$out"
+fi
+
+echo ""
+echo "=== self re-exec (CHILD_ENV_SELF_EXEC) ==="
+# A host re-exec'ing its own binary must come back with its allocator (libm
+# stands in) and knobs, and without child-only rules applied.
+out=$(run_capture selfexec "LD_PRELOAD,CHILD_ENV_RULES,KNOB,SET_VAR=child" \
+      LD_PRELOAD="$SO:libm.so.6" KNOB=1 CHILD_ENV_SELF_EXEC=1)
+if grep -q '^EXEC_FAILED' <<<"$out"; then
+    report_fail "self-exec" "re-exec failed" "$out"
+elif ! grep -q 'libm\.so' <<<"$out" || ! grep -q '^KNOB=1$' <<<"$out"; then
+    report_fail "self-exec" "re-exec'd host lost its allocator or knob" "$out"
+elif grep -q '^SET_VAR=' <<<"$out"; then
+    report_fail "self-exec" "child rules applied to the host's own re-exec" "$out"
+elif grep -qE '^(LD_PRELOAD|CHILD_ENV_RULES)=' <<<"$out"; then
+    report_fail "self-exec" "restarted host did not strip its environ again" "$out"
+else
+    report_pass "self re-exec keeps host environment"
+fi
+
+# Without the option a self re-exec is treated like any other child.
+out=$(run_capture selfexec "LD_PRELOAD,KNOB" LD_PRELOAD="$SO:libm.so.6" KNOB=1)
+if grep -q 'libm\.so' <<<"$out" || grep -q '^KNOB=' <<<"$out"; then
+    report_fail "self-exec-off" "self re-exec bypassed rules without opt-in" "$out"
+else
+    report_pass "self re-exec stripped when option is off"
+fi
+
+echo ""
+echo "=== policy file hot reload (CHILD_ENV_POLICY_FILE) ==="
+policy=$(mktemp)
+printf 'set PHASE=one\nset TAG=A\n' >"$policy"
+out=$(run_capture reload "" CHILD_ENV_POLICY_FILE="$policy" -- "$policy")
+rm -f "$policy" "$policy.tmp"
+before=$(sed -n '1,/^--- after reload ---$/p' <<<"$out")
+after=$(sed -n '/^--- after reload ---$/,$p' <<<"$out")
+if grep -q '^EXEC_FAILED' <<<"$out"; then
+    report_fail "reload" "spawn failed" "$out"
+elif ! grep -q '^PHASE=one$' <<<"$before"; then
+    report_fail "reload" "initial policy file not applied" "$out"
+elif ! grep -q '^PHASE=two$' <<<"$after"; then
+    report_fail "reload" "rewritten policy file not picked up" "$out"
+elif ! grep -q '^RELOAD_BAD=0$' <<<"$out"; then
+    report_fail "reload" "concurrent spawn saw a torn or failed policy" "$out"
+else
+    report_pass "policy file reloaded without restart, concurrent spawns consistent"
+fi
+# vfork() children whose exec succeeds never return to let go of the policy
+# they read; every generation but the active one must still be freed.
+policy=$(mktemp)
+printf 'set GEN=start\n[depth 2]\nset DEEP=1\n' >"$policy"
+out=$(run_capture vforkreload "" CHILD_ENV_POLICY_FILE="$policy" -- "$policy")
+rm -f "$policy" "$policy.tmp"
+if grep -qx 'POLICY_MEMFDS=1' <<<"$out"; then
+    report_pass "policies read by vfork() children are freed after a reload"
+else
+    report_fail "vfork-reload" "retired policies kept open" "$out"
+fi
+
+echo ""
+echo "=== public snapshot API (libchildenv.h) ==="
+out=$(run_capture snapshot "SET_VAR=injected,UNSET_VAR" UNSET_VAR=should_not_leak)
+if grep -q '^EXEC_FAILED' <<<"$out"; then
+    report_fail "snapshot" "API not available" "$out"
+elif ! grep -q '^SET_VAR=injected$' <<<"$out" || grep -q '^UNSET_VAR=' <<<"$out"; then
+    report_fail "snapshot" "snapshot does not match the child view" "$out"
+elif ! grep -q '^SNAPSHOT_SHARED=1$' <<<"$out"; then
+    report_fail "snapshot" "unchanged environ did not reuse the snapshot" "$out"
+elif ! grep -q '^SNAPSHOT_FRESH=1$' <<<"$out" || ! grep -q '^SNAP_NEW=1$' <<<"$out"; then
+    report_fail "snapshot" "setenv() did not invalidate the snapshot" "$out"
+elif ! grep -q '^SNAPSHOT_EDITED=1$' <<<"$out"; then
+    report_fail "snapshot" "in-place edit of a putenv() string did not invalidate it" "$out"
+elif ! grep -q '^SNAPSHOT_ATFORK=1$' <<<"$out"; then
+    report_fail "snapshot-atfork" "fork() with snapshot atfork handlers failed" "$out"
+else
+    report_pass "snapshot API returns shared child view, tracks environ"
+fi
+
+echo ""
+echo "=== native launcher (childenv-launch) ==="
+# apply-malloc layout: app -> launcher, app.orig = real binary, app.childenv =
+# profile. The wrapped host must get the profile; its children the rules.
+wrapdir=$(mktemp -d)
+cp "$BIN" "$wrapdir/app.orig"
+ln -s "$LAUNCH" "$wrapdir/app"
+printf '%s\n' "# test profile" "LD_PRELOAD=$SO" \
+    "CHILD_ENV_RULES=LD_PRELOAD,LAUNCH_KNOB,CHILD_ENV_RULES" "LAUNCH_KNOB=1" \
+    >"$wrapdir/app.childenv"
+host=$(env -i PATH="/usr/bin:/bin" "$wrapdir/app" hostmaps 2>&1)
+child=$(env -i PATH="/usr/bin:/bin" "$wrapdir/app" execve 2>&1)
+if ! grep -q 'libchildenv\.so' <<<"$host" || ! grep -q '^LAUNCH_KNOB=1$' <<<"$host"; then
+    report_fail "launcher-wrap" "wrapped binary did not get its profile" "$host"
+elif grep -qE '^(LAUNCH_KNOB|LD_PRELOAD)=' <<<"$child"; then
+    report_fail "launcher-wrap" "profile leaked to the wrapped binary's child" "$child"
+else
+    report_pass "launcher wrapper applies profile with a single exec"
+fi
+
+# CLI mode with a profile file, command looked up in PATH.
+out=$(env -i PATH="$wrapdir:/usr/bin:/bin" "$LAUNCH" "$wrapdir/app.childenv" \
+      app.orig hostenv 2>&1)
+if grep -q '^LAUNCH_KNOB=1$' <<<"$out" && ! grep -q '^CHILD_ENV_RULES=' <<<"$out"; then
+    report_pass "launcher CLI runs command with profile file"
+else
+    report_fail "launcher-cli" "profile not applied in CLI mode" "$out"
+fi
+# An alias of the launcher under another name, with no profile next to it,
+# is still the CLI; --print lists a built-in profile.
+ln -s "$LAUNCH" "$wrapdir/cenv"
+out=$(env -i PATH="$wrapdir:/usr/bin:/bin" cenv "$wrapdir/app.childenv" app.orig hostenv 2>&1)
+if ! grep -q '^LAUNCH_KNOB=1$' <<<"$out"; then
+    report_fail "launcher-alias" "aliased launcher did not run in CLI mode" "$out"
+elif ! "$LAUNCH" --print glibc | grep -qx 'LD_PRELOAD=libchildenv.so'; then
+    report_fail "launcher-print" "built-in profile not printed" "$("$LAUNCH" --print glibc 2>&1)"
+else
+    report_pass "launcher mode follows the profile file, not the name"
+fi
+# An alias of the wrapped binary (vi -> vim) has no profile of its own; the
+# launcher must follow the link to app.childenv instead of falling into CLI.
+ln -s app "$wrapdir/app-alias"
+host=$(env -i PATH="/usr/bin:/bin" "$wrapdir/app-alias" hostenv 2>&1)
+if grep -q '^LAUNCH_KNOB=1$' <<<"$host"; then
+    report_pass "launcher follows an alias symlink to the wrapped profile"
+else
+    report_fail "launcher-wrap-alias" "alias of wrapped binary did not get its profile" "$host"
+fi
+rm -rf "$wrapdir"
+
+echo ""
+echo "=== DT_NEEDED injection (childenv-elf) ==="
+# Patched copy loads libchildenv + "allocator" (test_alloc.so, via the mux)
+# with no LD_PRELOAD and applies the embedded knobs/rules: the allocator sees
+# its knob when loaded, the host keeps the knob, children lose it. The
+# original program headers, notes included, survive.
+patchdir=$(mktemp -d)
+printf '%s\n' "LD_PRELOAD=$SO:$TEST_ALLOC" "CHILD_ENV_RULES=ELF_KNOB,TEST_ALLOC_KNOB,CHILD_ENV_RULES" \
+    "ELF_KNOB=1" "TEST_ALLOC_KNOB=1" >"$patchdir/profile"
+if ! "$ELFTOOL" add-needed "$BIN" "$patchdir/app" "$patchdir/profile" 2>&1; then
+    report_fail "elf-needed" "childenv-elf failed" ""
+else
+    host=$(env -i PATH="/usr/bin:/bin" "$patchdir/app" hostmaps 2>&1)
+    child=$(env -i PATH="/usr/bin:/bin" "$patchdir/app" execve 2>&1)
+    notes_in=$(readelf -lW "$BIN" | grep -c '^ *NOTE')
+    notes_out=$(readelf -lW "$patchdir/app" | grep -c '^ *NOTE')
+    if ! grep -q 'libchildenv-malloc\.so' <<<"$host" || ! grep -q 'test_alloc\.so' <<<"$host"; then
+        report_fail "elf-needed" "DT_NEEDED libraries not loaded" "$host"
+    elif ! grep -q '^TEST_ALLOC_KNOB_AT_INIT=1$' <<<"$host"; then
+        report_fail "elf-needed" "allocator loaded before its knob was set" "$host"
+    elif ! grep -q '^ELF_KNOB=1$' <<<"$host" || grep -q '^CHILD_ENV_RULES=' <<<"$host"; then
+        report_fail "elf-needed" "embedded policy not applied in host" "$host"
+    elif grep -qE '^(ELF_KNOB|TEST_ALLOC_KNOB|CHILD_ENV_MALLOC|LD_PRELOAD)=' <<<"$child"; then
+        report_fail "elf-needed" "knob or LD_PRELOAD reached the child" "$child"
+    elif [[ $notes_in -eq 0 || $notes_in -ne $notes_out ]]; then
+        report_fail "elf-needed" "PT_NOTE headers lost ($notes_in -> $notes_out)" "$(readelf -lW "$patchdir/app")"
+    else
+        report_pass "DT_NEEDED-patched binary applies embedded policy"
+    fi
+    if "$ELFTOOL" add-needed "$patchdir/app" "$patchdir/app2" "$patchdir/profile" 2>/dev/null; then
+        report_fail "elf-needed-twice" "patching twice was not refused" ""
+    else
+        report_pass "already-patched binary refused"
+    fi
+fi
+rm -rf "$patchdir"
+
+echo ""
+echo "=== system-wide preload mode (childenv-index) ==="
+# test_exec_system loads libchildenv without LD_PRELOAD, as /etc/ld.so.preload
+# would. A listed program is re-exec'd with its allocator (libm here) and
+# knobs; an unlisted one is left alone and reads no CHILD_ENV_* knob, unless
+# it was started with LD_PRELOAD.
+sysdir=$(mktemp -d)
+printf '%s\n' "[/nonexistent/other]" "SYS_KNOB=2" "[$SYS_BIN]" "LD_PRELOAD=libm.so.6" \
+    "CHILD_ENV_RULES=SYS_KNOB,LD_PRELOAD,CHILD_ENV_RULES" "SYS_KNOB=1" >"$sysdir/system.conf"
+printf '%s\n' "[/nonexistent/other]" "LD_PRELOAD=libm.so.6" "SYS_KNOB=2" >"$sysdir/other.conf"
+if ! "$INDEXTOOL" "$sysdir/system.conf" "$SYS_IDX" \
+    || ! "$INDEXTOOL" "$sysdir/other.conf" "$sysdir/other.idx"; then
+    report_fail "system-index" "childenv-index failed" ""
+else
+    host=$(env -i PATH="/usr/bin:/bin" "$SYS_BIN" hostmaps 2>&1)
+    child=$(env -i PATH="/usr/bin:/bin" "$SYS_BIN" execve 2>&1)
+    if ! grep -q 'libm\.so' <<<"$host" || ! grep -q '^SYS_KNOB=1$' <<<"$host"; then
+        report_fail "system-match" "listed program did not get its profile" "$host"
+    elif grep -qE '^(CHILDENV_SYSTEM|LD_PRELOAD|CHILD_ENV_RULES)=' <<<"$host"; then
+        report_fail "system-match" "control vars left in host environ" "$host"
+    elif grep -qE '^(SYS_KNOB|LD_PRELOAD)=' <<<"$child"; then
+        report_fail "system-match" "profile leaked to child" "$child"
+    else
+        report_pass "listed program re-exec'd with allocator and profile"
+    fi
+    cp "$sysdir/other.idx" "$SYS_IDX"
+    host=$(env -i PATH="/usr/bin:/bin" "$SYS_BIN" hostmaps 2>&1)
+    child=$(env -i PATH="/usr/bin:/bin" CHILD_ENV_RULES="SET_VAR=injected" \
+            CHILD_ENV_GETENV_PROFILE="$sysdir/profile" "$SYS_BIN" posix_spawn 2>&1)
+    preloaded=$(env -i PATH="/usr/bin:/bin" LD_PRELOAD="$SYS_SO" \
+                CHILD_ENV_RULES="SET_VAR=injected" "$BIN" posix_spawn 2>&1)
+    if grep -q 'libm\.so' <<<"$host" || grep -q '^SYS_KNOB=' <<<"$host"; then
+        report_fail "system-nomatch" "unlisted program was modified" "$host"
+    elif grep -q '^SET_VAR=' <<<"$child" || [[ -e "$sysdir/profile" ]]; then
+        report_fail "system-nomatch" "unlisted program acted on CHILD_ENV_* knobs" "$child"
+    elif ! grep -q '^SET_VAR=injected$' <<<"$preloaded"; then
+        report_fail "system-nomatch" "LD_PRELOAD start lost its knobs" "$preloaded"
+    else
+        report_pass "unlisted program left untouched, knobs only with LD_PRELOAD"
+    fi
+fi
+rm -rf "$sysdir" "$SYS_IDX"
+
+# In a setuid/setgid program (test_secure.so fakes AT_SECURE) no knob may act:
+# the output files stay untouched, the rules are not applied, and the
+# multiplexer does not load the allocator CHILD_ENV_MALLOC names.
+secdir=$(mktemp -d)
+echo untouched >"$secdir/profile"
+echo untouched >"$secdir/stats"
+out=$(env -i PATH="/usr/bin:/bin" LD_PRELOAD="$TEST_SECURE:$SO" \
+      CHILD_ENV_RULES="SET_VAR=injected" CHILD_ENV_GETENV_PROFILE="$secdir/profile" \
+      CHILD_ENV_CHILD_STATS="$secdir/stats" "$BIN" posix_spawn 2>&1)
+mux=$(env -i PATH="/usr/bin:/bin" LD_PRELOAD="$TEST_SECURE:$MUX_SO" \
+      CHILD_ENV_MALLOC="$TEST_ALLOC" "$BIN" hostenv 2>&1)
+if [[ "$(cat "$secdir/profile" "$secdir/stats")" != $'untouched\nuntouched' ]]; then
+    report_fail "secure" "a secure process wrote a CHILD_ENV_* output file" \
+        "$(cat "$secdir/profile" "$secdir/stats")"
+elif grep -q '^SET_VAR=' <<<"$out"; then
+    report_fail "secure" "rules applied in a secure process" "$out"
+elif grep -q '^TEST_ALLOC_CALLS=' <<<"$mux"; then
+    report_fail "secure" "CHILD_ENV_MALLOC loaded in a secure process" "$mux"
+else
+    report_pass "setuid/setgid (AT_SECURE) process ignores every CHILD_ENV_* knob"
+fi
+rm -rf "$secdir"
+
+echo ""
+echo "=== malloc multiplexer (libchildenv-malloc.so) ==="
+# CHILD_ENV_MALLOC routes the host's malloc family to test_alloc.so, which
+# reports its call count at exit (hostenv returns instead of exec'ing); rules
+# keep the choice out of the child.
+mux_run() {
+    env -i PATH="/usr/bin:/bin" LD_PRELOAD="$MUX_SO" CHILD_ENV_MALLOC="$TEST_ALLOC" \
+        CHILD_ENV_RULES="LD_PRELOAD,CHILD_ENV_MALLOC,CHILD_ENV_RULES" "$BIN" "$1" 2>&1
+}
+host=$(mux_run hostenv)
+out=$(mux_run execve)
+if ! grep -qE '^TEST_ALLOC_CALLS=[1-9]' <<<"$host"; then
+    report_fail "malloc-mux" "allocations did not reach the selected allocator" "$host"
+elif grep -qE '^(CHILD_ENV_MALLOC|LD_PRELOAD)=' <<<"$out"; then
+    report_fail "malloc-mux" "allocator selection leaked to child" "$out"
+else
+    report_pass "CHILD_ENV_MALLOC routes malloc through the chosen allocator"
+fi
+
+# An allocator whose constructor needs more than the boot arena while the
+# multiplexer is still loading it gets the spill mapping, not ENOMEM.
+out=$(env -i PATH="/usr/bin:/bin" LD_PRELOAD="$MUX_SO" CHILD_ENV_MALLOC="$TEST_ALLOC" \
+      TEST_ALLOC_BOOT_BYTES=$((3 << 20)) "$BIN" hostenv 2>&1)
+if ! grep -q '^TEST_ALLOC_BOOT=ok$' <<<"$out"; then
+    report_fail "malloc-mux-boot" "boot allocation failed while resolving" "$out"
+else
+    report_pass "allocations past the boot arena while resolving are served"
+fi
+
+# Without a selection it forwards to glibc and behaves like libchildenv.so.
+out=$(env -i PATH="/usr/bin:/bin" LD_PRELOAD="$MUX_SO" \
+      CHILD_ENV_RULES="SET_VAR=injected,LD_PRELOAD" "$BIN" posix_spawn 2>&1)
+if grep -q '^TEST_ALLOC_CALLS=' <<<"$out" || ! grep -q '^SET_VAR=injected$' <<<"$out"; then
+    report_fail "malloc-mux-default" "default forwarding broke the hooks" "$out"
+else
+    report_pass "no selection forwards to glibc, rules still applied"
+fi
+
+echo ""
+echo "=== glibc malloc tuning (CHILD_ENV_MALLOPT) ==="
+# mmap_threshold above the 512 KiB test block moves it from mmap to the heap
+# in the host only; a child running the same probe keeps glibc's default.
+host=$(run_capture mallinfo "CHILD_ENV_MALLOPT,LD_PRELOAD" \
+       CHILD_ENV_MALLOPT="mmap_threshold=1048576,arena_max=1")
+child=$(run_shell_capture "CHILD_ENV_MALLOPT,LD_PRELOAD" "" "$BIN mallinfo" \
+       CHILD_ENV_MALLOPT="mmap_threshold=1048576,arena_max=1")
+if ! grep -q '^MMAPPED_BLOCKS=0$' <<<"$host"; then
+    report_fail "mallopt-host" "mmap_threshold not applied in host" "$host"
+elif ! grep -q '^MMAPPED_BLOCKS=1$' <<<"$child"; then
+    report_fail "mallopt-child" "tuning leaked into child" "$child"
+else
+    report_pass "mallopt tuning applied in host, not in children"
+fi
+
+echo ""
+echo "=== batch spawn API (childenv_spawn_batch) ==="
+out=$(run_capture batch "SET_VAR=injected,UNSET_VAR" UNSET_VAR=should_not_leak)
+if ! grep -q '^BATCH started=2 pidfds=2 missing=ENOENT$' <<<"$out"; then
+    report_fail "batch" "wrong per-child results" "$out"
+elif [[ $(grep -c '^SET_VAR=injected$' <<<"$out") -ne 2 ]] || grep -q '^UNSET_VAR=' <<<"$out"; then
+    report_fail "batch" "children did not get the ruled environment" "$out"
+else
+    report_pass "batch spawn shares one ruled environment, returns pidfds"
+fi
+
+echo ""
+echo "=== fork-time child environment ==="
+# The fork hook prepares the child's envp in the parent once a fork()ed
+# child has exec'd: later children exec'ing with environ allocate nothing
+# (counted by test_alloc.so), still get the rules applied, and a setenv()
+# between forks is picked up. A fork() before any child exec'd builds
+# nothing in the parent.
+out=$(env -i PATH="/usr/bin:/bin" HOME="$HOME" LD_PRELOAD="$SO:$TEST_ALLOC" \
+      CHILD_ENV_RULES="LD_PRELOAD,UNSET_VAR" UNSET_VAR=leak "$BIN" forkexec 2>&1)
+if ! grep -q '^PARENT_FORK_ALLOCS=0$' <<<"$out"; then
+    report_fail "fork-plain" "fork() built an envp before any child exec'd" "$out"
+elif [[ "$(grep '^CHILD_ALLOCS=' <<<"$out" | tr '\n' ' ')" != *" CHILD_ALLOCS=0 CHILD_ALLOCS=0 " ]]; then
+    report_fail "fork-ready" "fork()ed child still built its own envp" "$out"
+elif grep -q '^UNSET_VAR=' <<<"$out" || [[ $(grep -c '^FORK_NEW=1$' <<<"$out") -ne 1 ]]; then
+    report_fail "fork-env" "wrong environment in fork()ed children" "$out"
+else
+    report_pass "fork()ed children exec with an envp prepared in the parent"
+fi
+
+echo ""
+echo "=== per-thread env scratch ==="
+# Four threads spawning at once reuse their own scratch block for the child
+# envp: after one warm-up spawn each, further spawns allocate nothing.
+out=$(env -i PATH="/usr/bin:/bin" HOME="$HOME" LD_PRELOAD="$SO:$TEST_ALLOC" \
+      CHILD_ENV_RULES="LD_PRELOAD,UNSET_VAR,SET_VAR=x" UNSET_VAR=leak "$BIN" threadspawn 2>&1)
+if grep -q '^SPAWN_ALLOCS=0$' <<<"$out"; then
+    report_pass "threads build child environments without touching the heap"
+else
+    report_fail "env-scratch" "spawns after warm-up still allocated" "$out"
+fi
+
+echo ""
+echo "=== kernel memory policy (CHILD_ENV_MM / CHILD_ENV_CHILD_MM) ==="
+# Host: THP off and KSM on. Children: THP back to default and KSM off, set
+# in the child itself (fork+exec hook, or the launcher shim for posix_spawn);
+# the host's flags never change.
+out=$(run_capture mmpolicy "LD_PRELOAD,CHILD_ENV_MM,CHILD_ENV_CHILD_MM" \
+      CHILD_ENV_MM="thp=never,ksm=1" CHILD_ENV_CHILD_MM="thp=default,ksm=0")
+if [[ ! -r /proc/self/ksm_stat ]]; then
+    report_pass "kernel memory policy (skipped: no per-process KSM)"
+elif ! grep -q '^HOST THP_DISABLE=1 KSM=1$' <<<"$out"; then
+    report_fail "mm-host" "host policy not applied" "$out"
+elif ! grep -q '^SPAWN THP_ENABLED=1 KSM=no$' <<<"$out" \
+     || ! grep -q '^FORK THP_ENABLED=1 KSM=no$' <<<"$out"; then
+    report_fail "mm-child" "child policy not applied" "$out"
+elif ! grep -q '^AFTER THP_DISABLE=1$' <<<"$out"; then
+    report_fail "mm-restore" "spawn changed the host's THP flag" "$out"
+else
+    report_pass "kernel memory policy set separately for host and children"
+fi
+
+echo ""
+echo "=== child resource profile (policy file nice/ioprio/cpus/sched) ==="
+# Both spawn paths start children at nice 7, SCHED_BATCH (3) and idle I/O
+# priority (class 3 << 13), or SCHED_IDLE (5) in the second run; the host
+# keeps its own settings. cpus 0 is a no-op on one CPU but must still parse.
+policy=$(mktemp)
+for profile in "nice 7|ioprio idle|cpus 0|sched batch" "sched idle"; do
+    printf 'unset LD_PRELOAD\n%s\n' "${profile//|/$'\n'}" >"$policy"
+    [[ $profile == "sched idle" ]] && want='nice=0 sched=5 ioprio=0' \
+                                  || want='nice=7 sched=3 ioprio=24576'
+    out=$(env -i PATH="/usr/bin:/bin" HOME="$HOME" LD_PRELOAD="$SO" \
+          CHILD_ENV_POLICY_FILE="$policy" "$BIN" resprofile 2>&1)
+    host=$(sed -n 's/^HOST //p' <<<"$out")
+    if [[ $(grep -c "^\(SPAWN\|FORK\) $want cpus=" <<<"$out") -ne 2 ]]; then
+        report_fail "resources" "children did not get: $profile" "$out"
+    elif [[ -z "$host" || "$(sed -n 's/^AFTER //p' <<<"$out")" != "$host" ]]; then
+        report_fail "resources" "host settings changed: $profile" "$out"
+    else
+        report_pass "policy file profile applied to children: $profile"
+    fi
+done
+# A self re-exec keeps the host's profile; a batch child spawned right after
+# on the same thread must not inherit that decision.
+printf 'unset LD_PRELOAD\nnice 7\n' >"$policy"
+out=$(env -i PATH="/usr/bin:/bin" HOME="$HOME" LD_PRELOAD="$SO" CHILD_ENV_SELF_EXEC=1 \
+      CHILD_ENV_POLICY_FILE="$policy" "$BIN" resbatch 2>&1)
+if ! grep -q '^SELF nice=0 ' <<<"$out" || ! grep -q '^BATCH nice=7 ' <<<"$out"; then
+    report_fail "resources-batch" "batch child after a self re-exec lost the profile" "$out"
+else
+    report_pass "batch child after a self re-exec still gets the profile"
+fi
+rm -f "$policy"
+
+echo ""
+echo "=== child cgroup placement (policy file cgroup) ==="
+# A delegated subtree on the cgroup2 mount: both spawn paths must land their
+# children in the leaf, created on first use; the host stays where it was.
+cg_mount=$(awk '$3 == "cgroup2" { print $2; exit }' /proc/mounts)
+cg_base="$cg_mount/childenv-test.$$"
+if [[ -n "$cg_mount" ]] && mkdir "$cg_base" 2>/dev/null; then
+    policy=$(mktemp)
+    printf 'unset LD_PRELOAD\ncgroup %s/helpers memory.max=64M cpu.weight=20\n' "$cg_base" >"$policy"
+    out=$(env -i PATH="/usr/bin:/bin" HOME="$HOME" LD_PRELOAD="$SO" \
+          CHILD_ENV_POLICY_FILE="$policy" "$BIN" resprofile 2>&1)
+    host=$(sed -n 's/^HOST //p' <<<"$out")
+    if [[ $(grep -c "^\(SPAWN\|FORK\) .* cgroup=/childenv-test.$$/helpers$" <<<"$out") -ne 2 ]]; then
+        report_fail "cgroup" "children not placed in the leaf" "$out"
+    elif [[ -z "$host" || "$(sed -n 's/^AFTER //p' <<<"$out")" != "$host" ]]; then
+        report_fail "cgroup" "host moved" "$out"
+    else
+        report_pass "children are placed in the configured cgroup v2 leaf"
+    fi
+    rmdir "$cg_base/helpers" "$cg_base" 2>/dev/null
+    rm -f "$policy"
+else
+    echo "  (skipped: no writable cgroup2 mount)"
+fi
+
+echo ""
+echo "=== descriptor hygiene (policy file closefds) ==="
+# fds 3-6 leak from the host without O_CLOEXEC; children keep only fd 5,
+# and the host keeps all four as they were, even while it spawns. A spawn
+# with file actions of its own gets all four and one line on stderr.
+policy=$(mktemp)
+printf 'unset LD_PRELOAD\nclosefds 3 keep=5\n' >"$policy"
+out=$(env -i PATH="/usr/bin:/bin" HOME="$HOME" LD_PRELOAD="$SO" \
+      CHILD_ENV_POLICY_FILE="$policy" "$BIN" fdleak 2>&1)
+if [[ $(grep -cx '\(SPAWN\|FORK\) 5' <<<"$out") -ne 2 ]]; then
+    report_fail "closefds" "children still got leaked descriptors" "$out"
+elif ! grep -qx 'HOST 3 4 5 6' <<<"$out"; then
+    report_fail "closefds" "host descriptors changed" "$out"
+elif grep -qx 'TOGGLED' <<<"$out"; then
+    report_fail "closefds" "host descriptors were marked close-on-exec during spawns" "$out"
+elif [[ $(grep -cx 'ACTIONS 3 4 5 6' <<<"$out") -ne 2 \
+      || $(grep -c '^libchildenv: closefds skipped' <<<"$out") -ne 1 ]]; then
+    report_fail "closefds" "spawn with its own file actions not left alone and logged once" "$out"
+else
+    report_pass "leaked descriptors are kept from children"
+fi
+rm -f "$policy"
+# The auditor lists a process's descriptors without O_CLOEXEC.
+exec {leak_fd}</dev/null
+out=$("$REPO_DIR/libchildenv.sh" fds $$ "$leak_fd" 2>&1)
+exec {leak_fd}<&-
+if grep -qx "[0-9]* /dev/null" <<<"$out"; then
+    report_pass "libchildenv.sh fds reports descriptors that would leak"
+else
+    report_fail "fds-audit" "leaked descriptor not listed" "$out"
+fi
+
+echo ""
+echo "=== spawn governor (policy file throttle) ==="
+# test_exec storm starts four 0.4 s sleeps. With max=2 the last two wait for
+# the first two to exit; a 100 ms timeout lets each held spawn through
+# early; a throttle on another name changes nothing.
+storm() {
+    local policy
+    policy=$(mktemp)
+    printf 'unset LD_PRELOAD\n%s\n' "$1" >"$policy"
+    env -i PATH="/usr/bin:/bin" HOME="$HOME" LD_PRELOAD="$SO" \
+        CHILD_ENV_POLICY_FILE="$policy" "$BIN" storm "$2" 2>&1 | sed -n 's/^STARTED_MS=//p'
+    rm -f "$policy"
+}
+held=$(storm 'throttle sl*p max=2' 0.4)
+timed=$(storm 'throttle sleep max=1 timeout=100' 2)
+free=$(storm 'throttle *-thumbnailer max=1' 0.4)
+if [[ -z "$held" || "$held" -lt 350 ]]; then
+    report_fail "throttle" "spawns beyond max=2 were not held" "started in ${held}ms"
+elif [[ -z "$timed" || "$timed" -lt 250 || "$timed" -gt 1500 ]]; then
+    report_fail "throttle-timeout" "held spawns did not go ahead at the timeout" "started in ${timed}ms"
+elif [[ -z "$free" || "$free" -gt 300 ]]; then
+    report_fail "throttle-match" "unmatched program was held" "started in ${free}ms"
+else
+    report_pass "spawn governor holds matching spawns up to its timeout"
+fi
+
+echo ""
+echo "=== child telemetry (CHILD_ENV_CHILD_STATS) ==="
+# test_exec telemetry spawns a child holding 64 MiB for 0.6 s of CPU, then
+# `sleep 0.1`, reaping each at once; the host writes the table at exit.
+stats=$(mktemp -u)
+env -i PATH="/usr/bin:/bin" HOME="$HOME" LD_PRELOAD="$SO" \
+    CHILD_ENV_CHILD_STATS="$stats" "$BIN" telemetry >/dev/null 2>&1
+out=$(cat "$stats" 2>&1)
+if ! awk '$1 == "test_exec" && $2 == 1 && $3 == 1 && $4 >= 550 && $7 >= 60000 && $8 >= 300 {ok=1}
+          END {exit !ok}' <<<"$out"; then
+    report_fail "telemetry" "expected lifetime, peak RSS and CPU for test_exec" "$out"
+elif ! awk '$1 == "sleep" && $2 == 1 && $3 == 1 && $4 >= 90 {ok=1} END {exit !ok}' <<<"$out"; then
+    report_fail "telemetry" "expected one sleep child" "$out"
+else
+    report_pass "child telemetry records lifetime, peak RSS and CPU per executable"
+fi
+rm -f "$stats"
+
+echo ""
+echo "=== getenv profile and hot-first order ==="
+# The profile counts lookups per name, most looked-up first, with the mean
+# entries scanned (HOME is 4th); its hot names (HOME, then LANG; the unset
+# one is skipped) lead the children's envp.
+prof=$(mktemp -u)
+env -i A=1 B=2 LANG=C HOME="$HOME" PATH="/usr/bin:/bin" LD_PRELOAD="$SO" \
+    CHILD_ENV_GETENV_PROFILE="$prof" "$BIN" getenvs
+out=$(cat "$prof" 2>&1)
+if ! head -n 2 <<<"$out" | tr '\n' ' ' | grep -qE "^HOME 5 4.0 0 CENV_NOPE 2 [0-9.]+ 2 $"; then
+    report_fail "getenv-profile" "expected HOME 5 4.0 0, then CENV_NOPE 2 <scan> 2" "$out"
+elif ! grep -qx "LANG 1 3.0 0" <<<"$out"; then
+    report_fail "getenv-profile" "secure_getenv lookup not counted" "$out"
+else
+    report_pass "getenv profile counts lookups and scan lengths per name"
+fi
+for hot in "HOME,LANG" "$prof"; do
+    out=$(env -i A=1 B=2 LANG=C HOME="$HOME" PATH="/usr/bin:/bin" LD_PRELOAD="$SO" \
+          CHILD_ENV_HOT_FIRST="$hot" "$BIN" posix_spawn 2>&1)
+    if [[ "$(head -n 2 <<<"$out" | cut -d= -f1 | tr '\n' ' ')" != "HOME LANG " ]]; then
+        report_fail "hot-first" "HOME and LANG not first with CHILD_ENV_HOT_FIRST=$hot" "$out"
+    elif [[ "$hot" == /* ]]; then
+        report_pass "hot variables from a getenv profile lead the child envp"
+    else
+        report_pass "hot variables from a list lead the child envp"
+    fi
+done
+rm -f "$prof"
+
+echo ""
+echo "=== PATH resolution cache (CHILD_ENV_PATH_CACHE) ==="
+# cenvtool is first found in late/; its first run plants another one in
+# early/. The immediate second spawn still uses the cached path; after the
+# trust window the changed early/ mtime must invalidate the entry.
+pdir=$(mktemp -d)
+mkdir "$pdir/early" "$pdir/late"
+cat >"$pdir/late/cenvtool" <<EOF
+#!/bin/sh
+echo late
+printf '#!/bin/sh\\necho early\\n' >"$pdir/early/cenvtool"
+chmod +x "$pdir/early/cenvtool"
+EOF
+chmod +x "$pdir/late/cenvtool"
+out=$(env -i PATH="$pdir/missing:$pdir/early:$pdir/late:/usr/bin:/bin" HOME="$HOME" \
+      LD_PRELOAD="$SO" CHILD_ENV_RULES="LD_PRELOAD" CHILD_ENV_PATH_CACHE=1 \
+      "$BIN" pathcache cenvtool 2>&1 | tr '\n' ' ')
+if [[ "$out" == "late late early early " ]]; then
+    report_pass "PATH cache reuses resolutions and revalidates directories"
+else
+    report_fail "path-cache" "expected: late late early early" "$out"
+fi
+rm -rf "$pdir"
+
+echo ""
+echo "=== allocator purge control ==="
+# test_exec idle caches ~32 MiB of freed blocks and waits. `libchildenv.sh
+# purge` must get a byte count back over the socket; the signal purge must
+# show up in the stats counters and leave the host's stderr alone.
+rundir=$(mktemp -d)
+env -i PATH="/usr/bin:/bin" XDG_RUNTIME_DIR="$rundir" LD_PRELOAD="$SO" \
+    CHILD_ENV_PURGE_SOCKET=1 CHILD_ENV_PURGE_SIGNAL=USR2 \
+    "$BIN" idle >"$rundir/out" 2>&1 &
+idle_pid=$!
+for _ in $(seq 1 50); do
+    grep -q READY "$rundir/out" && break
+    sleep 0.1
+done
+out=$(XDG_RUNTIME_DIR="$rundir" "$REPO_DIR/libchildenv.sh" purge "$idle_pid" 2>&1)
+if grep -qE '^ok glibc [1-9][0-9]*$' <<<"$out"; then
+    report_pass "socket purge returns cached memory"
+else
+    report_fail "purge-socket" "no byte count from the control socket" "$out"
+fi
+kill -USR2 "$idle_pid"
+for _ in $(seq 1 20); do
+    out=$(XDG_RUNTIME_DIR="$rundir" "$REPO_DIR/libchildenv.sh" stats "$idle_pid" 2>&1)
+    grep -qE '^purge_signal 1 ' <<<"$out" && break
+    sleep 0.1
+done
+if ! grep -qE '^purge_signal 1 [0-9]+$' <<<"$out"; then
+    report_fail "purge-signal" "signal purge not counted in stats" "$out"
+elif grep -q 'libchildenv' "$rundir/out"; then
+    report_fail "purge-signal" "signal purge wrote to the host's stderr" "$(cat "$rundir/out")"
+else
+    report_pass "purge signal handled off the signal path, counted in stats"
+fi
+
+# A client that connects and sends nothing must not hold up the others.
+python3 - "$rundir/libchildenv/$idle_pid.sock" <<'PY' &
+import socket, sys, time
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+time.sleep(3)
+PY
+silent=$!
+sleep 0.2
+t0=$(date +%s%N)
+out=$(XDG_RUNTIME_DIR="$rundir" "$REPO_DIR/libchildenv.sh" purge-stats "$idle_pid" 2>&1)
+ms=$(( ($(date +%s%N) - t0) / 1000000 ))
+if grep -qE '^ok glibc auto ' <<<"$out" && (( ms < 500 )); then
+    report_pass "silent socket client does not block the control thread"
+else
+    report_fail "purge-socket-stall" "request took ${ms} ms behind a silent client" "$out"
+fi
+kill "$silent" 2>/dev/null
+wait "$silent" 2>/dev/null
+kill "$idle_pid" 2>/dev/null
+wait "$idle_pid" 2>/dev/null
+
+# CHILD_ENV_PURGE_IDLE: an idle host purges once by itself (the PSI trigger
+# is registered alongside but a test cannot create real memory pressure).
+env -i PATH="/usr/bin:/bin" XDG_RUNTIME_DIR="$rundir" LD_PRELOAD="$SO" \
+    CHILD_ENV_PURGE_SOCKET=1 CHILD_ENV_PURGE_IDLE=1 CHILD_ENV_PURGE_PSI=150 \
+    "$BIN" idle >"$rundir/out" 2>&1 &
+idle_pid=$!
+sleep 3
+out=$(XDG_RUNTIME_DIR="$rundir" "$REPO_DIR/libchildenv.sh" purge-stats "$idle_pid" 2>&1)
+if grep -qE '^ok glibc auto 1 [1-9][0-9]*$' <<<"$out"; then
+    report_pass "idle host purges exactly once on its own"
+else
+    report_fail "purge-idle" "expected one automatic purge" "$out"
+fi
+kill "$idle_pid" 2>/dev/null
+wait "$idle_pid" 2>/dev/null
+
+# CHILD_ENV_RECLAIM_IDLE: the idle host advises its ~32 MiB heap cold once,
+# whatever the allocator; `libchildenv.sh stats` reports it.
+env -i PATH="/usr/bin:/bin" XDG_RUNTIME_DIR="$rundir" LD_PRELOAD="$SO" \
+    CHILD_ENV_PURGE_SOCKET=1 CHILD_ENV_RECLAIM_IDLE=1 \
+    "$BIN" idle >"$rundir/out" 2>&1 &
+idle_pid=$!
+sleep 3
+out=$(XDG_RUNTIME_DIR="$rundir" "$REPO_DIR/libchildenv.sh" stats "$idle_pid" 2>&1)
+if grep -qE '^reclaim cold 1 [1-9][0-9]{7,} [0-9]+$' <<<"$out"; then
+    report_pass "idle host advises its heap cold exactly once"
+else
+    report_fail "reclaim-idle" "expected one cold reclaim of the heap" "$out"
+fi
+kill "$idle_pid" 2>/dev/null
+wait "$idle_pid" 2>/dev/null
+rm -rf "$rundir"
+
+echo ""
+echo "=== heap growth sampler ==="
+# test_exec heapgrow grows the heap for 1.5 s either by keeping its blocks
+# (a leak) or by leaving unreusable holes behind (fragmentation); the
+# sampler must tell which from the allocator's own counters.
+rundir=$(mktemp -d)
+for mode in leak:leak frag:fragmentation; do
+    env -i PATH="/usr/bin:/bin" XDG_RUNTIME_DIR="$rundir" LD_PRELOAD="$SO" \
+        CHILD_ENV_PURGE_SOCKET=1 CHILD_ENV_HEAP_SAMPLE=0.1 \
+        "$BIN" heapgrow "${mode%%:*}" >/dev/null 2>&1 &
+    grow_pid=$!
+    sleep 2
+    out=$(XDG_RUNTIME_DIR="$rundir" "$REPO_DIR/libchildenv.sh" heap "$grow_pid" 2>&1)
+    if grep -qE "^ok glibc samples [0-9]+ verdict ${mode#*:}\$" <<<"$out"; then
+        report_pass "heap sampler reports ${mode#*:}"
+    else
+        report_fail "heap-${mode%%:*}" "expected verdict ${mode#*:}" "$out"
+    fi
+    kill "$grow_pid" 2>/dev/null
+    wait "$grow_pid" 2>/dev/null
+done
+rm -rf "$rundir"
+
 echo ""
 echo "=== negative baseline (sanity check: harness must catch leaks) ==="
 # Without LD_PRELOAD the rules have no effect: UNSET_VAR SHOULD leak.
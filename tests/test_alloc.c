@@ -0,0 +1,101 @@
+// Stand-in allocator for the malloc multiplexer tests: wraps glibc's
+// __libc_* entry points, counts calls, and reports the count at exit so the
+// harness can tell that libchildenv-malloc.so really routed through it.
+// test_alloc_calls() lets a test count allocations across a call.
+// Like a real allocator it reads its knob (TEST_ALLOC_KNOB) when loaded, and
+// reports the value it saw. TEST_ALLOC_BOOT_BYTES makes its constructor
+// allocate that much while the multiplexer is still loading it.
+// Blocks carry a header {base, size} so malloc_usable_size and free work for
+// aligned blocks too.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_memalign(size_t, size_t);
+extern void __libc_free(void *);
+
+static atomic_ulong calls;
+
+void *memalign(size_t align, size_t size) {
+    if (align < 16) align = 16;
+    atomic_fetch_add(&calls, 1);
+    char *base = __libc_memalign(align, size + align);
+    if (!base) return NULL;
+    char *p = base + align;
+    ((void **)p)[-2] = base;
+    ((size_t *)p)[-1] = size;
+    return p;
+}
+
+void *malloc(size_t size) { return memalign(16, size); }
+
+void free(void *p) {
+    if (p) __libc_free(((void **)p)[-2]);
+}
+
+size_t malloc_usable_size(void *p) { return p ? ((size_t *)p)[-1] : 0; }
+
+void *calloc(size_t n, size_t size) {
+    if (size && n > SIZE_MAX / size) { errno = ENOMEM; return NULL; }
+    // Not malloc(): GCC folds malloc+memset back into a calloc() call.
+    void *p = memalign(16, n * size);
+    if (p) memset(p, 0, n * size);
+    return p;
+}
+
+void *realloc(void *p, size_t size) {
+    void *n = malloc(size);
+    if (n && p) {
+        size_t old = malloc_usable_size(p);
+        memcpy(n, p, old < size ? old : size);
+    }
+    if (n || !size) free(p);
+    return n;
+}
+
+int posix_memalign(void **out, size_t align, size_t size) {
+    void *p = memalign(align, size);
+    if (!p) return ENOMEM;
+    *out = p;
+    return 0;
+}
+
+unsigned long test_alloc_calls(void) { return atomic_load(&calls); }
+
+static char knob[64];
+static const char *boot_result;
+
+__attribute__((constructor))
+static void read_knob(void) {
+    const char *v = getenv("TEST_ALLOC_KNOB");
+    if (v) snprintf(knob, sizeof(knob), "%s", v);
+    if ((v = getenv("TEST_ALLOC_BOOT_BYTES"))) {
+        size_t n = strtoul(v, NULL, 10);
+        char *p = malloc(n);
+        if (p) memset(p, 1, n);
+        boot_result = p && malloc_usable_size(p) == n ? "ok" : "failed";
+        free(p);
+    }
+}
+
+__attribute__((destructor))
+static void report(void) {
+    char buf[64];
+    int n = snprintf(buf, sizeof(buf), "TEST_ALLOC_CALLS=%lu\n", atomic_load(&calls));
+    if (write(2, buf, (size_t)n) < 0) {}
+    if (*knob) {
+        n = snprintf(buf, sizeof(buf), "TEST_ALLOC_KNOB_AT_INIT=%s\n", knob);
+        if (write(2, buf, (size_t)n) < 0) {}
+    }
+    if (boot_result) {
+        n = snprintf(buf, sizeof(buf), "TEST_ALLOC_BOOT=%s\n", boot_result);
+        if (write(2, buf, (size_t)n) < 0) {}
+    }
+}
@@ -5,13 +5,26 @@
 // child env.
 
 #define _GNU_SOURCE
+#include "../libchildenv.h"
+
+#include <dirent.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
 #include <spawn.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 extern char **environ;
@@ -112,12 +125,550 @@ static int run_grandchild_depth(void) {
     return fail("execlp/sh");
 }
 
+// Host environ plus mapped objects: shows what a re-exec'd host came up with
+// even though its own constructor strips LD_PRELOAD again.
+static int run_hostmaps(void) {
+    run_hostenv();
+    FILE *f = fopen("/proc/self/maps", "r");
+    if (!f) return fail("fopen");
+    char line[512];
+    while (fgets(line, sizeof(line), f)) fputs(line, stdout);
+    fclose(f);
+    return 0;
+}
+
+// Re-exec our own binary (the crash-restart / --replace pattern) by its real
+// path, landing in hostmaps.
+static int run_selfexec(void) {
+    char self[4096];
+    ssize_t n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (n < 0) return fail("readlink");
+    self[n] = '\0';
+    char *const argv[] = {self, "hostmaps", NULL};
+    execv(self, argv);
+    return fail("execv/self");
+}
+
+static int spawn_env_and_wait(void) {
+    pid_t pid;
+    int r = posix_spawn(&pid, CHILD_PATH, NULL, NULL, CHILD_ARGV, environ);
+    if (r != 0) {
+        errno = r;
+        return fail("posix_spawn");
+    }
+    return wait_child(pid);
+}
+
+static int write_policy(const char *path, const char *text) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (!f) return -1;
+    fputs(text, f);
+    if (fclose(f) != 0) return -1;
+    return rename(tmp, path);
+}
+
+static atomic_int reload_stop;
+static atomic_int reload_bad;
+static atomic_int reload_spawns;
+
+// Spawns a checker until told to stop: every child must see a complete
+// policy (PHASE and its matching TAG together), never a mix.
+static void *reload_spinner(void *unused) {
+    (void)unused;
+    char *const argv[] = {"sh", "-c",
+        "[ \"$PHASE$TAG\" = oneA ] || [ \"$PHASE$TAG\" = twoB ]", NULL};
+    while (!atomic_load(&reload_stop)) {
+        pid_t pid;
+        int st;
+        if (posix_spawn(&pid, "/bin/sh", NULL, NULL, argv, environ) != 0
+            || waitpid(pid, &st, 0) < 0 || !WIFEXITED(st) || WEXITSTATUS(st))
+            atomic_fetch_add(&reload_bad, 1);
+        atomic_fetch_add(&reload_spawns, 1);
+    }
+    return NULL;
+}
+
+// Hot reload: spawn, rewrite CHILD_ENV_POLICY_FILE (`path`, which the
+// harness pre-filled with phase one), wait out the one-second recheck
+// interval, spawn again — with other threads spawning throughout. Prints both
+// children's env and a RELOAD_BAD= count.
+static int run_reload(const char *path) {
+    pthread_t th[4];
+    for (int i = 0; i < 4; i++) pthread_create(&th[i], NULL, reload_spinner, NULL);
+    spawn_env_and_wait();
+    usleep(200000);
+    if (write_policy(path, "# reloaded\nset PHASE=two\nset TAG=B\n") < 0)
+        return fail("write");
+    usleep(1300000);
+    puts("--- after reload ---");
+    fflush(stdout);
+    spawn_env_and_wait();
+    atomic_store(&reload_stop, 1);
+    for (int i = 0; i < 4; i++) pthread_join(th[i], NULL);
+    printf("RELOAD_BAD=%d\nRELOAD_SPAWNS=%d\n",
+           atomic_load(&reload_bad), atomic_load(&reload_spawns));
+    return 0;
+}
+
+static pid_t vfork_exec(char *const argv[]) {
+    pid_t pid = vfork();
+    if (pid == 0) { execve("/bin/true", argv, environ); _exit(127); }
+    return pid;
+}
+
+// vfork()+execve children across policy reloads. The policy has a depth-2
+// section, so each generation lives in a memfd; a posix_spawn first makes
+// the host pick up each rewrite. Prints how many policy memfds remain.
+static int run_vforkreload(const char *path) {
+    char *argv[] = {"true", NULL};
+    for (int i = 0; i < 4; i++) {
+        char text[64];
+        snprintf(text, sizeof(text), "set GEN=%d\n[depth 2]\nset DEEP=1\n", i);
+        if (write_policy(path, text) < 0) return fail("write");
+        usleep(1100000);
+        pid_t pid;
+        if (posix_spawnp(&pid, "true", NULL, NULL, argv, environ) == 0) wait_child(pid);
+        if ((pid = vfork_exec(argv)) < 0) return fail("vfork");
+        wait_child(pid);
+    }
+    DIR *d = opendir("/proc/self/fd");
+    if (!d) return fail("opendir");
+    int memfds = 0;
+    for (struct dirent *e; (e = readdir(d)); ) {
+        char target[256];
+        ssize_t n = readlinkat(dirfd(d), e->d_name, target, sizeof(target) - 1);
+        if (n > 0 && (target[n] = '\0', strstr(target, "memfd:childenv-policy"))) memfds++;
+    }
+    closedir(d);
+    printf("POLICY_MEMFDS=%d\n", memfds);
+    return 0;
+}
+
+static childenv_snapshot *(*snap_get)(void);
+static void (*snap_unref)(childenv_snapshot *);
+
+static void snapshot_atfork(void) { snap_unref(snap_get()); }
+
+// Public snapshot API, resolved at run time the way a preloaded host would.
+// Prints the child view of environ plus whether repeated calls share one
+// snapshot and whether a setenv(), or an in-place edit of a putenv()
+// string, invalidates it, then whether fork() works with atfork handlers
+// that use the API (the alarm catches a deadlock).
+static int run_snapshot(void) {
+    unsigned (*version)(void) = dlsym(RTLD_DEFAULT, "childenv_api_version");
+    childenv_snapshot *(*get)(void) = dlsym(RTLD_DEFAULT, "childenv_snapshot_get");
+    void (*unref)(childenv_snapshot *) = dlsym(RTLD_DEFAULT, "childenv_snapshot_unref");
+    char *const *(*envp)(const childenv_snapshot *) =
+        dlsym(RTLD_DEFAULT, "childenv_snapshot_envp");
+    if (!version || !get || !unref || !envp) {
+        errno = ENOSYS;
+        return fail("dlsym");
+    }
+    if (version() < CHILDENV_API_VERSION) {
+        errno = ENOTSUP;
+        return fail("version");
+    }
+    childenv_snapshot *a = get(), *b = get();
+    if (!a || !b) return fail("snapshot_get");
+    setenv("SNAP_NEW", "1", 1);
+    childenv_snapshot *c = get();
+    if (!c) return fail("snapshot_get");
+    printf("SNAPSHOT_SHARED=%d\nSNAPSHOT_FRESH=%d\n", a == b, c != a);
+    for (char *const *e = envp(c); *e; ++e) puts(*e);
+    static char edit[] = "SNAP_EDIT=old";
+    putenv(edit);
+    childenv_snapshot *d = get();
+    memcpy(edit + 10, "new", 3);
+    childenv_snapshot *f = get();
+    if (!d || !f) return fail("snapshot_get");
+    int edited = 0;
+    for (char *const *e = envp(f); *e; ++e) edited |= !strcmp(*e, "SNAP_EDIT=new");
+    printf("SNAPSHOT_EDITED=%d\n", f != d && edited);
+    unref(a); unref(b); unref(c); unref(d); unref(f);
+    fflush(stdout);
+    snap_get = get;
+    snap_unref = unref;
+    pthread_atfork(snapshot_atfork, NULL, snapshot_atfork);
+    alarm(10);
+    pid_t pid = fork();
+    if (pid == 0) _exit(0);
+    if (pid < 0) return fail("fork");
+    printf("SNAPSHOT_ATFORK=%d\n", wait_child(pid) == 0);
+    return 0;
+}
+
+// childenv_spawn_batch: two env children (one by PATH search) with pidfds,
+// and a missing program in between that must fail alone.
+static int run_batch(void) {
+    size_t (*batch)(char *const *, struct childenv_spawn *, size_t, unsigned) =
+        dlsym(RTLD_DEFAULT, "childenv_spawn_batch");
+    unsigned (*version)(void) = dlsym(RTLD_DEFAULT, "childenv_api_version");
+    if (!batch || !version || version() < 2) {
+        errno = ENOSYS;
+        return fail("dlsym");
+    }
+    struct childenv_spawn c[3] = {
+        {.path = "env", .argv = CHILD_ARGV},
+        {.path = "/nonexistent/env", .argv = CHILD_ARGV},
+        {.path = CHILD_PATH, .argv = CHILD_ARGV},
+    };
+    size_t started = batch(NULL, c, 3, CHILDENV_SPAWN_SEARCH | CHILDENV_SPAWN_PIDFD);
+    int pidfds = 0;
+    for (int i = 0; i < 3; i++) {
+        if (c[i].pidfd >= 0) { pidfds++; close(c[i].pidfd); }
+        if (c[i].pid > 0) wait_child(c[i].pid);
+    }
+    printf("BATCH started=%zu pidfds=%d missing=%s\n", started, pidfds,
+           c[1].error == ENOENT ? "ENOENT" : strerror(c[1].error));
+    return 0;
+}
+
+// A fork() whose child only exits, then fork()+execv from the host three
+// times, the last after a setenv(): each exec'ing child must get the ruled
+// environment, the last one with FORK_NEW. With test_alloc.so preloaded,
+// the host first reports how many allocations the plain fork() cost it (none:
+// nothing is built for children that never exec), and each child how many a
+// (failing) exec cost it: none once the fork hook prepares its envp, which
+// it starts doing after the first child exec'd.
+static int run_forkexec(void) {
+    unsigned long (*calls)(void) =
+        (unsigned long (*)(void))dlsym(RTLD_DEFAULT, "test_alloc_calls");
+    unsigned long before = calls ? calls() : 0;
+    pid_t pid = fork();
+    if (pid < 0) return fail("fork");
+    if (pid == 0) _exit(0);
+    printf("PARENT_FORK_ALLOCS=%lu\n", calls ? calls() - before : 0);
+    fflush(stdout);
+    wait_child(pid);
+    for (int round = 0; round < 3; round++) {
+        if (round == 2) setenv("FORK_NEW", "1", 1);
+        pid = fork();
+        if (pid < 0) return fail("fork");
+        if (pid == 0) {
+            unsigned long before = calls ? calls() : 0;
+            execv("/nonexistent/env", CHILD_ARGV);
+            unsigned long used = calls ? calls() - before : 0;
+            printf("CHILD_ALLOCS=%lu\n", used);
+            fflush(stdout);
+            execv(CHILD_PATH, CHILD_ARGV);
+            _exit(127);
+        }
+        wait_child(pid);
+    }
+    return 0;
+}
+
+// Four threads build child environments at once: one warm-up spawn each,
+// then eight more while the main thread counts allocations (test_alloc.so).
+// The per-thread scratch blocks make the eight rounds allocation-free. The
+// spawns target a missing program, so only the env building is exercised.
+static pthread_barrier_t scratch_barrier;
+
+static void *scratch_thread(void *arg) {
+    (void)arg;
+    char *argv[] = {"missing", NULL};
+    for (int i = 0; i < 9; i++) {
+        if (i < 2) pthread_barrier_wait(&scratch_barrier);
+        pid_t pid;
+        if (posix_spawn(&pid, "/nonexistent/missing", NULL, NULL, argv, environ) == 0)
+            waitpid(pid, NULL, 0);
+    }
+    return NULL;
+}
+
+static int run_threadspawn(void) {
+    unsigned long (*calls)(void) =
+        (unsigned long (*)(void))dlsym(RTLD_DEFAULT, "test_alloc_calls");
+    pthread_t t[4];
+    pthread_barrier_init(&scratch_barrier, NULL, 5);
+    for (int i = 0; i < 4; i++) pthread_create(&t[i], NULL, scratch_thread, NULL);
+    // The second barrier opens once every thread has done its warm-up spawn.
+    pthread_barrier_wait(&scratch_barrier);
+    pthread_barrier_wait(&scratch_barrier);
+    unsigned long before = calls ? calls() : 0;
+    for (int i = 0; i < 4; i++) pthread_join(t[i], NULL);
+    printf("SPAWN_ALLOCS=%lu\n", calls ? calls() - before : 0);
+    return 0;
+}
+
+// Long-running host for purge control: leaves ~32 MiB of freed blocks cached
+// behind a live one (so the allocator cannot just shrink the heap top), says
+// READY, then idles until the harness kills it.
+static int run_idle(void) {
+    enum { NBLOCKS = 8192, BLOCK = 4096 };
+    static char *blocks[NBLOCKS];
+    for (int i = 0; i < NBLOCKS; i++)
+        if ((blocks[i] = malloc(BLOCK))) memset(blocks[i], 1, BLOCK);
+    for (int i = 0; i < NBLOCKS - 1; i++) free(blocks[i]);
+    puts("READY");
+    fflush(stdout);
+    for (int i = 0; i < 100; i++) usleep(100000);
+    return 0;
+}
+
+// Grows the heap for 1.5 s, then idles until the harness kills it. "leak"
+// keeps every block; "frag" shrinks each to 16 bytes once the round is
+// allocated, leaving holes pinned apart that next round's slightly larger
+// blocks cannot use: the heap grows while allocated bytes barely move.
+static int run_heapgrow(const char *mode) {
+    int leak = !strcmp(mode, "leak");
+    static char *volatile blocks[30][256];    // volatile: keep GCC from eliding them
+    for (int round = 0; round < 30; round++) {
+        size_t size = 4096 + (size_t)round * 64;
+        for (int i = 0; i < 256; i++) {
+            if (!(blocks[round][i] = malloc(size))) return fail("malloc");
+            memset(blocks[round][i], 1, size);
+        }
+        for (int i = 0; i < 256 && !leak; i++)
+            blocks[round][i] = realloc(blocks[round][i], 16);
+        usleep(50000);
+    }
+    for (int i = 0; i < 100; i++) usleep(100000);
+    return 0;
+}
+
+#ifndef PR_GET_MEMORY_MERGE
+#define PR_GET_MEMORY_MERGE 68
+#endif
+
+// Kernel memory policy: prints this process's THP-disable and KSM flags, then
+// those a child sees when started through posix_spawn and through
+// fork+execv, then ours again (the spawn hook must not touch them).
+static int run_mmpolicy(void) {
+    char *argv[] = {"sh", "-c",
+        "echo \"$0 THP_ENABLED=$(sed -n 's/^THP_enabled:\\t//p' /proc/self/status)"
+        " KSM=$(sed -n 's/^ksm_merge_any: //p' /proc/self/ksm_stat)\"", "SPAWN", NULL};
+    printf("HOST THP_DISABLE=%d KSM=%d\n", prctl(PR_GET_THP_DISABLE, 0, 0, 0, 0),
+           prctl(PR_GET_MEMORY_MERGE, 0, 0, 0, 0));
+    fflush(stdout);
+    pid_t pid;
+    if ((errno = posix_spawn(&pid, "/bin/sh", NULL, NULL, argv, environ)))
+        return fail("posix_spawn");
+    wait_child(pid);
+    argv[3] = "FORK";
+    if ((pid = fork()) == 0) { execv("/bin/sh", argv); _exit(127); }
+    wait_child(pid);
+    printf("AFTER THP_DISABLE=%d\n", prctl(PR_GET_THP_DISABLE, 0, 0, 0, 0));
+    return 0;
+}
+
+// Scheduling state of this task, one line tagged `tag`. Waits a little
+// first: a posix_spawn child gets its nice value only after it started.
+static int run_resinfo(const char *tag) {
+    usleep(200000);
+    cpu_set_t cpus;
+    sched_getaffinity(0, sizeof(cpus), &cpus);
+    char line[512] = "", cgroup[512] = "?";
+    FILE *f = fopen("/proc/self/cgroup", "re");
+    while (f && fgets(line, sizeof(line), f))
+        if (sscanf(line, "0::%511s", cgroup) == 1) break;
+    if (f) fclose(f);
+    printf("%s nice=%d sched=%d ioprio=%ld cpus=%d cgroup=%s\n", tag,
+           getpriority(PRIO_PROCESS, 0), sched_getscheduler(0),
+           syscall(SYS_ioprio_get, 1, 0), CPU_COUNT(&cpus), cgroup);
+    fflush(stdout);
+    return 0;
+}
+
+// Resource profile: the host's state, a posix_spawn child's, a fork+exec
+// child's, then the host's again (which must not have changed).
+static int run_resprofile(void) {
+    char *argv[] = {"test_exec", "resinfo", "SPAWN", NULL};
+    run_resinfo("HOST");
+    pid_t pid;
+    if ((errno = posix_spawn(&pid, "/proc/self/exe", NULL, NULL, argv, environ)))
+        return fail("posix_spawn");
+    wait_child(pid);
+    argv[2] = "FORK";
+    if ((pid = fork()) == 0) { execv("/proc/self/exe", argv); _exit(127); }
+    wait_child(pid);
+    return run_resinfo("AFTER");
+}
+
+// With CHILD_ENV_SELF_EXEC=1: a posix_spawn of ourselves (a self re-exec,
+// which keeps the host's profile), then a childenv_spawn_batch child on the
+// same thread, which must still get the children's profile.
+static int run_resbatch(void) {
+    size_t (*batch)(char *const *, struct childenv_spawn *, size_t, unsigned) =
+        dlsym(RTLD_DEFAULT, "childenv_spawn_batch");
+    if (!batch) { errno = ENOSYS; return fail("dlsym"); }
+    char *argv[] = {"test_exec", "resinfo", "SELF", NULL};
+    pid_t pid;
+    if ((errno = posix_spawn(&pid, "/proc/self/exe", NULL, NULL, argv, environ)))
+        return fail("posix_spawn");
+    wait_child(pid);
+    argv[2] = "BATCH";
+    struct childenv_spawn c = {.path = "/proc/self/exe", .argv = argv};
+    if (batch(NULL, &c, 1, 0) != 1) { errno = c.error; return fail("childenv_spawn_batch"); }
+    wait_child(c.pid);
+    return 0;
+}
+
+// Descriptors from 3 up that this process has open, one line tagged `tag`.
+static int run_fdlist(const char *tag) {
+    DIR *d = opendir("/proc/self/fd");
+    if (!d) return fail("opendir");
+    printf("%s", tag);
+    for (struct dirent *e; (e = readdir(d)); ) {
+        int fd = atoi(e->d_name);
+        if (fd >= 3 && fd != dirfd(d)) printf(" %d", fd);
+    }
+    closedir(d);
+    printf("\n");
+    fflush(stdout);
+    return 0;
+}
+
+// Leaks two pipes (fds 3-6) without O_CLOEXEC into a posix_spawn child and
+// a fork+exec child, then reports which of them the host itself still has
+// without close-on-exec. A second thread watches the flags while the host
+// spawns `true` 50 more times and prints TOGGLED if it ever saw them set.
+static int leak_fds[4];
+static atomic_int leak_watching, leak_toggled;
+
+static void *leak_watcher(void *unused) {
+    (void)unused;
+    while (atomic_load(&leak_watching))
+        for (int i = 0; i < 4; i++)
+            if (fcntl(leak_fds[i], F_GETFD) & FD_CLOEXEC) atomic_store(&leak_toggled, 1);
+    return NULL;
+}
+
+static int run_fdleak(void) {
+    int *p = leak_fds;
+    if (pipe(p) < 0 || pipe(p + 2) < 0) return fail("pipe");
+    char *argv[] = {"test_exec", "fdlist", "SPAWN", NULL};
+    pid_t pid;
+    if ((errno = posix_spawn(&pid, "/proc/self/exe", NULL, NULL, argv, environ)))
+        return fail("posix_spawn");
+    wait_child(pid);
+    argv[2] = "FORK";
+    if ((pid = fork()) == 0) { execv("/proc/self/exe", argv); _exit(127); }
+    wait_child(pid);
+    pthread_t watcher;
+    atomic_store(&leak_watching, 1);
+    pthread_create(&watcher, NULL, leak_watcher, NULL);
+    char *nop[] = {"true", NULL};
+    for (int i = 0; i < 50; i++)
+        if (posix_spawnp(&pid, "true", NULL, NULL, nop, environ) == 0) wait_child(pid);
+    atomic_store(&leak_watching, 0);
+    pthread_join(watcher, NULL);
+    // With file actions of its own the spawn is left alone, twice.
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    argv[2] = "ACTIONS";
+    for (int i = 0; i < 2; i++)
+        if (posix_spawn(&pid, "/proc/self/exe", &fa, NULL, argv, environ) == 0) wait_child(pid);
+    posix_spawn_file_actions_destroy(&fa);
+    printf("HOST");
+    for (int i = 0; i < 4; i++)
+        if (!(fcntl(p[i], F_GETFD) & FD_CLOEXEC)) printf(" %d", p[i]);
+    printf("\n%s", atomic_load(&leak_toggled) ? "TOGGLED\n" : "");
+    return 0;
+}
+
+// Spawn storm: four `sleep <secs>` children through posix_spawnp, reaped
+// only after all four started; prints how long starting them took.
+static int run_storm(const char *secs) {
+    char *argv[] = {"sleep", (char *)secs, NULL};
+    pid_t pids[4];
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < 4; i++)
+        if ((errno = posix_spawnp(&pids[i], "sleep", NULL, NULL, argv, environ)))
+            return fail("posix_spawnp");
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("STARTED_MS=%ld\n", (t1.tv_sec - t0.tv_sec) * 1000
+                               + (t1.tv_nsec - t0.tv_nsec) / 1000000);
+    for (int i = 0; i < 4; i++) wait_child(pids[i]);
+    return 0;
+}
+
+// Child telemetry: a test_exec child that touches 64 MiB and burns 0.6 s
+// of CPU, then `sleep 0.1`, each reaped as soon as it exits.
+static int run_telemetry(void) {
+    char *hog[] = {"test_exec", "hog", NULL};
+    char *nap[] = {"sleep", "0.1", NULL};
+    char self[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (len < 0) return fail("readlink");
+    self[len] = '\0';
+    pid_t pid;
+    if ((errno = posix_spawn(&pid, self, NULL, NULL, hog, environ)))
+        return fail("posix_spawn");
+    wait_child(pid);
+    if ((errno = posix_spawnp(&pid, "sleep", NULL, NULL, nap, environ)))
+        return fail("posix_spawnp");
+    wait_child(pid);
+    usleep(100000);
+    return 0;
+}
+
+static char *volatile hog_block;
+
+static int run_hog(void) {
+    size_t len = 64 << 20;
+    char *p = hog_block = malloc(len);
+    if (!p) return fail("malloc");
+    memset(p, 1, len);
+    struct timespec ts;
+    do clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    while (ts.tv_sec * 1000 + ts.tv_nsec / 1000000 < 600);
+    free(p);
+    return 0;
+}
+
+// getenv profile: HOME five times, an unset name twice, LANG once through
+// secure_getenv().
+static int run_getenvs(void) {
+    for (int i = 0; i < 5; i++) if (!getenv("HOME")) return fail("getenv");
+    for (int i = 0; i < 2; i++) if (getenv("CENV_NOPE")) return fail("getenv");
+    if (!secure_getenv("LANG")) return fail("secure_getenv");
+    return 0;
+}
+
+// PATH cache: posix_spawnp(name) twice, then once more after the cache's
+// trust window (two seconds at most), then fork+execvp. The harness's first `name`
+// plants a second one earlier in PATH, which only a revalidated entry sees.
+static int run_pathcache(const char *name) {
+    char *argv[] = {(char *)name, NULL};
+    pid_t pid;
+    for (int round = 0; round < 3; round++) {
+        if (round == 2) usleep(2500000);
+        if ((errno = posix_spawnp(&pid, name, NULL, NULL, argv, environ)))
+            return fail("posix_spawnp");
+        wait_child(pid);
+    }
+    if ((pid = fork()) == 0) { execvp(name, argv); _exit(127); }
+    return wait_child(pid);
+}
+
+// One 512 KiB block, below or above the mmap threshold depending on
+// CHILD_ENV_MALLOPT; prints how many blocks glibc served with mmap.
+static int run_mallinfo(void) {
+    void *p = malloc(512 * 1024);
+    if (!p) return fail("malloc");
+    printf("MMAPPED_BLOCKS=%zu\n", mallinfo2().hblks);
+    free(p);
+    return 0;
+}
+
+// exec /bin/sh -c <script> — lets the harness inspect an intermediate
+// descendant (its maps, its own children) rather than only the leaf env.
+static int run_shell(const char *script) {
+    execlp("sh", "sh", "-c", script, (char *)NULL);
+    return fail("execlp/sh");
+}
+
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <method>\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "usage: %s <method> [arg]\n", argv[0]);
         return 2;
     }
     const char *m = argv[1];
+    const char *arg = argc == 3 ? argv[2] : NULL;
 
     if (!strcmp(m, "execve"))        return run_execve();
     if (!strcmp(m, "execvp"))        return run_execvp();
@@ -131,6 +682,29 @@ int main(int argc, char **argv) {
     if (!strcmp(m, "fexecve"))       return run_fexecve();
     if (!strcmp(m, "grandchild"))    return run_grandchild_depth();
     if (!strcmp(m, "hostenv"))       return run_hostenv();
+    if (!strcmp(m, "hostmaps"))      return run_hostmaps();
+    if (!strcmp(m, "selfexec"))      return run_selfexec();
+    if (!strcmp(m, "snapshot"))      return run_snapshot();
+    if (!strcmp(m, "batch"))         return run_batch();
+    if (!strcmp(m, "forkexec"))      return run_forkexec();
+    if (!strcmp(m, "threadspawn"))   return run_threadspawn();
+    if (!strcmp(m, "idle"))          return run_idle();
+    if (!strcmp(m, "mmpolicy"))      return run_mmpolicy();
+    if (!strcmp(m, "mallinfo"))      return run_mallinfo();
+    if (!strcmp(m, "heapgrow") && arg) return run_heapgrow(arg);
+    if (!strcmp(m, "resprofile"))    return run_resprofile();
+    if (!strcmp(m, "resbatch"))      return run_resbatch();
+    if (!strcmp(m, "fdleak"))        return run_fdleak();
+    if (!strcmp(m, "storm") && arg)  return run_storm(arg);
+    if (!strcmp(m, "telemetry"))     return run_telemetry();
+    if (!strcmp(m, "hog"))           return run_hog();
+    if (!strcmp(m, "getenvs"))       return run_getenvs();
+    if (!strcmp(m, "fdlist") && arg) return run_fdlist(arg);
+    if (!strcmp(m, "resinfo") && arg) return run_resinfo(arg);
+    if (!strcmp(m, "pathcache") && arg) return run_pathcache(arg);
+    if (!strcmp(m, "shell") && arg)  return run_shell(arg);
+    if (!strcmp(m, "reload") && arg) return run_reload(arg);
+    if (!strcmp(m, "vforkreload") && arg) return run_vforkreload(arg);
 
     fprintf(stderr, "unknown method: %s\n", m);
     return 2;
@@ -0,0 +1,15 @@
+// Stand-in for a setuid/setgid start: preloaded ahead of libchildenv, it
+// answers getauxval(AT_SECURE) with 1, so the harness can check what the
+// library does in a secure process without installing a setuid binary and
+// an /etc/ld.so.preload entry. Every other auxv type is glibc's.
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <sys/auxv.h>
+
+unsigned long getauxval(unsigned long type) {
+    static unsigned long (*real)(unsigned long);
+    if (type == AT_SECURE) return 1;
+    if (!real) real = (unsigned long (*)(unsigned long))dlsym(RTLD_NEXT, "getauxval");
+    return real ? real(type) : 0;
+}